@@ -0,0 +1,49 @@
+#include "BloomFilter.h"
+
+#include "Hash.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+namespace {
+
+// Two independent-enough hashes of a key, combined to give each of the
+// filter's hash functions (Kirsch and Mitzenmacher's double hashing).
+std::pair<uint64_t, uint64_t> hash(StringView key) {
+    auto h = fnv1a(key);
+    // Mixing gives a second hash from the first.
+    return std::make_pair(h, mix64(h + 0x9e3779b97f4a7c15ull) | 1);
+}
+
+}
+
+BloomFilter::BloomFilter(size_t numKeys, double falsePositiveRate) {
+    static const double Ln2 = std::log(2.0);
+    auto bits = std::ceil(-static_cast<double>(numKeys)
+                          * std::log(falsePositiveRate) / (Ln2 * Ln2));
+    bits_.assign(std::max<size_t>(8u, static_cast<size_t>(bits / 8) + 1), 0);
+    auto hashes = numKeys ? std::round(bits / numKeys * Ln2) : 1.0;
+    numHashes_ = static_cast<unsigned>(std::min(16.0, std::max(1.0, hashes)));
+}
+
+BloomFilter::BloomFilter(std::string bits, unsigned numHashes)
+        : bits_(std::move(bits)), numHashes_(numHashes) {}
+
+void BloomFilter::add(StringView key) {
+    auto h = hash(key);
+    for (unsigned i = 0; i < numHashes_; ++i) {
+        auto bit = (h.first + i * h.second) % numBits();
+        bits_[bit / 8] |= static_cast<char>(1u << (bit % 8));
+    }
+}
+
+bool BloomFilter::mayContain(StringView key) const {
+    if (bits_.empty()) return true;
+    auto h = hash(key);
+    for (unsigned i = 0; i < numHashes_; ++i) {
+        auto bit = (h.first + i * h.second) % numBits();
+        if (!(bits_[bit / 8] & (1u << (bit % 8)))) return false;
+    }
+    return true;
+}
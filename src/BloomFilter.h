@@ -0,0 +1,33 @@
+#pragma once
+
+#include "StringView.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// A Bloom filter over a set of string keys: a compact bit set which can say
+// for certain that a key isn't in the set, but which will sometimes say a key
+// may be present when it isn't. The bits are a plain string so they can be
+// stored and loaded again.
+class BloomFilter {
+    std::string bits_;
+    unsigned numHashes_;
+
+public:
+    // An empty filter sized to hold numKeys keys with roughly the given rate
+    // of false positives.
+    BloomFilter(size_t numKeys, double falsePositiveRate);
+    // A filter previously saved from bits() and numHashes().
+    BloomFilter(std::string bits, unsigned numHashes);
+
+    void add(StringView key);
+    // Returns false if the key was definitely never added.
+    bool mayContain(StringView key) const;
+
+    const std::string &bits() const { return bits_; }
+    unsigned numHashes() const { return numHashes_; }
+
+private:
+    uint64_t numBits() const { return bits_.size() * 8u; }
+};
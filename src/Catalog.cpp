@@ -0,0 +1,191 @@
+#include "Catalog.h"
+
+#include "Log.h"
+#include "Sqlite.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+
+const std::string IndexSuffix = ".zindex";
+
+std::string baseName(const std::string &path) {
+    auto slash = path.rfind('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+bool endsWith(const std::string &str, const std::string &suffix) {
+    return str.size() > suffix.size()
+           && str.compare(str.size() - suffix.size(), suffix.size(),
+                          suffix) == 0;
+}
+
+}
+
+const char *const Catalog::FileName = "zindex.catalog";
+
+size_t Catalog::build(Log &log, const std::string &directory) {
+    std::vector<std::string> names;
+    auto dir = opendir(directory.c_str());
+    if (!dir)
+        throw std::runtime_error("Unable to read directory " + directory);
+    while (auto entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (endsWith(name, IndexSuffix)) names.push_back(name);
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+
+    auto path = directory + "/" + FileName;
+    auto tempPath = path + ".tmp";
+    unlink(tempPath.c_str());
+    size_t numCatalogued = 0;
+    try {
+        Sqlite catalog(log);
+        catalog.open(tempPath, false);
+        catalog.exec(R"(
+CREATE TABLE Files(
+    file TEXT PRIMARY KEY,
+    size INTEGER,
+    modTime INTEGER,
+    inode INTEGER
+))");
+        catalog.exec(R"(
+CREATE TABLE KeySummaries(
+    file TEXT,
+    name TEXT,
+    isNumeric INTEGER,
+    numKeys INTEGER,
+    minKey TEXT,
+    maxKey TEXT,
+    bloomHashes INTEGER,
+    bloom BLOB,
+    PRIMARY KEY(file, name)
+))");
+        catalog.exec("BEGIN TRANSACTION");
+        auto addFile = catalog.prepare(R"(
+INSERT INTO Files VALUES(:file, :size, :modTime, :inode))");
+        auto addSummary = catalog.prepare(R"(
+INSERT INTO KeySummaries VALUES(:file, :name, :isNumeric, :numKeys, :minKey,
+                                :maxKey, :bloomHashes, :bloom))");
+        for (auto &name : names) {
+            auto indexPath = directory + "/" + name;
+            struct stat stats;
+            if (stat(indexPath.c_str(), &stats) != 0) continue;
+            try {
+                Sqlite index(log);
+                index.open(indexPath, true);
+                auto summaries = index.prepare(R"(
+SELECT s.name, i.isNumeric, s.numKeys, s.minKey, s.maxKey, s.bloomHashes,
+       s.bloom
+FROM KeySummaries AS s JOIN Indexes AS i ON i.name = s.name)");
+                while (!summaries.step()) {
+                    auto bloom = summaries.columnBlobView(6);
+                    addSummary
+                            .reset()
+                            .bindString(":file", name)
+                            .bindString(":name", summaries.columnString(0))
+                            .bindInt64(":isNumeric", summaries.columnInt64(1))
+                            .bindInt64(":numKeys", summaries.columnInt64(2))
+                            .bindString(":minKey", summaries.columnString(3))
+                            .bindString(":maxKey", summaries.columnString(4))
+                            .bindInt64(":bloomHashes",
+                                       summaries.columnInt64(5))
+                            .bindBlob(":bloom", bloom.begin(), bloom.length())
+                            .step();
+                }
+            } catch (const std::exception &e) {
+                // Most likely an index built before keys were summarised.
+                log.warn("Not cataloguing ", indexPath, ": ", e.what());
+                continue;
+            }
+            addFile
+                    .reset()
+                    .bindString(":file", name)
+                    .bindInt64(":size", stats.st_size)
+                    .bindInt64(":modTime", stats.st_mtime)
+                    .bindInt64(":inode", stats.st_ino)
+                    .step();
+            ++numCatalogued;
+        }
+        catalog.exec("END TRANSACTION");
+    } catch (...) {
+        unlink(tempPath.c_str());
+        throw;
+    }
+    if (rename(tempPath.c_str(), path.c_str()) != 0)
+        throw std::runtime_error("Unable to replace " + path); // todo errno
+    return numCatalogued;
+}
+
+std::unique_ptr<Catalog> Catalog::load(Log &log,
+                                       const std::string &directory) {
+    auto path = directory + "/" + FileName;
+    if (access(path.c_str(), R_OK) != 0) return nullptr;
+    Sqlite db(log);
+    db.open(path, true);
+    std::unique_ptr<Catalog> catalog(new Catalog);
+    auto files = db.prepare("SELECT file, size, modTime, inode FROM Files");
+    while (!files.step()) {
+        catalog->entries_.emplace(
+                files.columnString(0),
+                Entry{files.columnInt64(1), files.columnInt64(2),
+                      files.columnInt64(3), {}});
+    }
+    auto summaries = db.prepare(R"(
+SELECT file, name, isNumeric, numKeys, minKey, maxKey, bloomHashes, bloom
+FROM KeySummaries)");
+    while (!summaries.step()) {
+        auto it = catalog->entries_.find(summaries.columnString(0));
+        if (it == catalog->entries_.end()) continue;
+        BloomFilter filter(summaries.columnBlobView(7).str(),
+                           static_cast<unsigned>(summaries.columnInt64(6)));
+        it->second.summaries.emplace(
+                summaries.columnString(1),
+                KeySummary(summaries.columnInt64(2) != 0,
+                           static_cast<size_t>(summaries.columnInt64(3)),
+                           summaries.columnString(4),
+                           summaries.columnString(5), std::move(filter)));
+    }
+    log.debug("Loaded catalog of ", catalog->entries_.size(), " indexes from ",
+              path);
+    return catalog;
+}
+
+const KeySummary *Catalog::summary(const std::string &indexFile,
+                                   const std::string &index) const {
+    auto entry = entries_.find(baseName(indexFile));
+    if (entry == entries_.end()) return nullptr;
+    struct stat stats;
+    if (stat(indexFile.c_str(), &stats) != 0
+        || stats.st_size != entry->second.size
+        || stats.st_mtime != entry->second.modTime
+        || static_cast<int64_t>(stats.st_ino) != entry->second.inode)
+        return nullptr;
+    auto summary = entry->second.summaries.find(index);
+    if (summary == entry->second.summaries.end()) return nullptr;
+    return &summary->second;
+}
+
+bool Catalog::mayContainAny(const std::string &indexFile,
+                            const std::string &index,
+                            const std::vector<std::string> &keys) const {
+    auto keySummary = summary(indexFile, index);
+    if (!keySummary) return true;
+    for (auto &key : keys)
+        if (keySummary->mayContain(key)) return true;
+    return false;
+}
+
+bool Catalog::mayContainRange(const std::string &indexFile,
+                              const std::string &index,
+                              const std::string &from,
+                              const std::string &to) const {
+    auto keySummary = summary(indexFile, index);
+    return !keySummary || keySummary->mayContainRange(from, to);
+}
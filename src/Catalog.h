@@ -0,0 +1,57 @@
+#pragma once
+
+#include "KeySummary.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class Log;
+
+// A catalog gathers the key summaries of all the indexes in a directory into
+// one file, so a query over many files can rule out those which can't match
+// without opening their indexes. Entries for indexes which have changed since
+// the catalog was built are ignored.
+class Catalog {
+    struct Entry {
+        int64_t size;
+        int64_t modTime;
+        int64_t inode;
+        std::unordered_map<std::string, KeySummary> summaries;
+    };
+    // Keyed by the index's file name within the directory.
+    std::unordered_map<std::string, Entry> entries_;
+
+    Catalog() = default;
+
+public:
+    // The name of the catalog file within its directory.
+    static const char *const FileName;
+
+    // Build (or rebuild) the catalog of the indexes in the given directory.
+    // Returns the number of indexes catalogued.
+    static size_t build(Log &log, const std::string &directory);
+
+    // Load the catalog of the given directory, or return nullptr if it has
+    // none.
+    static std::unique_ptr<Catalog> load(Log &log,
+                                         const std::string &directory);
+
+    // Returns false if the catalogued index at indexFile has no key in the
+    // given sub-index equal to any of keys.
+    bool mayContainAny(const std::string &indexFile, const std::string &index,
+                       const std::vector<std::string> &keys) const;
+    // Returns false if the catalogued index at indexFile has no key in the
+    // given sub-index between from and to inclusive.
+    bool mayContainRange(const std::string &indexFile,
+                         const std::string &index, const std::string &from,
+                         const std::string &to) const;
+
+private:
+    // The summary of a sub-index, or nullptr if it isn't catalogued or its
+    // index has changed since.
+    const KeySummary *summary(const std::string &indexFile,
+                              const std::string &index) const;
+};
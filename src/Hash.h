@@ -0,0 +1,24 @@
+#pragma once
+
+#include "StringView.h"
+
+#include <cstdint>
+
+// The 64-bit FNV-1a hash of a key. Hashes are stored in indexes and Bloom
+// filters, so these must never change.
+inline uint64_t fnv1a(StringView key) {
+    uint64_t h = 14695981039346656037ull;
+    for (auto c : key) {
+        h ^= static_cast<uint8_t>(c);
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// The splitmix64 finaliser, spreading a hash's bits so that keys differing
+// only in their last few bytes end up far apart.
+inline uint64_t mix64(uint64_t h) {
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
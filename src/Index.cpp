@@ -1,9 +1,21 @@
 #include "Index.h"
 
+#include "FieldIndexer.h"
+#include "Hash.h"
+#include "IndexParser.h"
+#include "KeySummary.h"
 #include "LineFinder.h"
+#include "NewlineCounter.h"
+#include "Parallel.h"
+#include "PostingCodec.h"
+#include "Query.h"
+#include "RegExp.h"
+#include "StatementCache.h"
+#include "Trigrams.h"
 #include "LineSink.h"
 #include "LineIndexer.h"
 #include "Sqlite.h"
+#include "ZlibError.h"
 
 #include <zlib.h>
 
@@ -11,6 +23,9 @@
 #include <cstdint>
 #include <cstring>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <tuple>
 #include <vector>
@@ -28,20 +43,11 @@ namespace {
 constexpr auto DefaultIndexEvery = 32 * 1024 * 1024u;
 constexpr auto WindowSize = 32768u;
 constexpr auto ChunkSize = 16384u;
+// The range of sizes of the blocks Index::cat decompresses at a time.
+constexpr uint64_t MinCatBlock = 1024 * 1024u;
+constexpr uint64_t MaxCatBlock = 32 * 1024 * 1024u;
 constexpr auto Version = 1;
 
-void seek(File &f, uint64_t pos) {
-    auto err = ::fseek(f.get(), pos, SEEK_SET);
-    if (err != 0)
-        throw std::runtime_error("Error seeking in file"); // todo errno
-}
-
-struct ZlibError : std::runtime_error {
-    explicit ZlibError(int result) :
-            std::runtime_error(
-                    std::string("Error from zlib : ") + zError(result)) {}
-};
-
 void X(int zlibErr) {
     if (zlibErr != Z_OK) throw ZlibError(zlibErr);
 }
@@ -79,10 +85,11 @@ size_t makeWindow(uint8_t *out, size_t outSize, const uint8_t *in,
     return destLen;
 }
 
-void uncompress(const std::vector<uint8_t> &compressed, uint8_t *to,
-                size_t len) {
+void uncompress(StringView compressed, uint8_t *to, size_t len) {
     uLongf destLen = len;
-    X(::uncompress(to, &len, &compressed[0], compressed.size()));
+    X(::uncompress(to, &destLen,
+                   reinterpret_cast<const uint8_t *>(compressed.begin()),
+                   compressed.length()));
     if (destLen != len)
         throw std::runtime_error("Unable to decompress a full window");
 }
@@ -111,21 +118,97 @@ struct ZStream {
     ZStream &operator=(ZStream &) = delete;
 };
 
+int64_t parseNumeric(StringView key) {
+    auto index = key.begin();
+    auto indexLength = key.length();
+    int64_t val = 0;
+    bool negative = false;
+    if (indexLength > 0 && *index == '-') {
+        negative = true;
+        indexLength--;
+        index++;
+    }
+    if (indexLength == 0)
+        throw std::invalid_argument("Non-numeric: empty string");
+    while (indexLength) {
+        val *= 10;
+        if (*index < '0' || *index > '9')
+            throw std::invalid_argument("Non-numeric: '" + key.str() + "'");
+        val += *index - '0';
+        index++;
+        indexLength--;
+    }
+    return negative ? -val : val;
+}
+
+// The key stored for a key of a hashed index.
+int64_t hashKey(StringView key) {
+    return static_cast<int64_t>(mix64(fnv1a(key)));
+}
+
+// The smallest string greater than every string starting with the given prefix,
+// or the empty string if there is no such string.
+std::string prefixEnd(std::string prefix) {
+    while (!prefix.empty()) {
+        auto &last = prefix.back();
+        if (static_cast<uint8_t>(last) != 0xff) {
+            ++last;
+            return prefix;
+        }
+        prefix.pop_back();
+    }
+    return prefix;
+}
+
+// A key as the index tables order them: numerically for numeric indexes, and
+// otherwise byte by byte.
+struct SortKey {
+    bool numeric;
+    int64_t number = 0;
+    std::string text;
+
+    SortKey(bool numeric, StringView key) : numeric(numeric) {
+        if (numeric) number = parseNumeric(key);
+        else text = key.str();
+    }
+
+    // Returns less than, equal to or greater than zero as the given key is
+    // less than, equal to or greater than this one.
+    int compare(StringView key) const {
+        if (numeric) {
+            auto value = parseNumeric(key);
+            return value < number ? -1 : value > number ? 1 : 0;
+        }
+        auto length = std::min(key.length(), text.size());
+        auto result = memcmp(key.begin(), text.data(), length);
+        if (result) return result;
+        return key.length() < text.size() ? -1
+                                          : key.length() > text.size() ? 1 : 0;
+    }
+};
+
 struct IndexHandler : IndexSink {
     Log &log;
     std::unique_ptr<LineIndexer> indexer;
     uint64_t currentLine;
+    uint64_t currentOffset;
     bool indexed = false;
 
     IndexHandler(Log &log, std::unique_ptr<LineIndexer> indexer) :
-            log(log), indexer(std::move(indexer)), currentLine(0) {}
+            log(log), indexer(std::move(indexer)), currentLine(0),
+            currentOffset(0) {}
 
     ~IndexHandler() override = default;
 
-    bool onLine(uint64_t lineNumber, const char *line, size_t length) {
+    // Called once every line has been indexed.
+    virtual void finish() {}
+
+    bool onLine(uint64_t lineNumber, uint64_t fileOffset, const char *line,
+                size_t length) {
         try {
             indexed = false;
             currentLine = lineNumber;
+            currentOffset = fileOffset;
             StringView stringView(line, length);
             log.debug("Indexing line '", stringView, "'");
             indexer->index(*this, stringView);
@@ -159,6 +242,87 @@ struct AlphaHandler : IndexHandler {
     }
 };
 
+// Gives each distinct key an integer id, stored once in the keys table, and
+// stores just the id against each line.
+struct DictionaryHandler : IndexHandler {
+    // Past this many keys, the ids of keys seen are forgotten and looked up
+    // in the database again, so memory use doesn't grow with the number of
+    // distinct keys.
+    static constexpr size_t MaxCachedIds = 1024 * 1024;
+
+    Sqlite::Statement insert;
+    Sqlite::Statement addKey;
+    Sqlite::Statement findKey;
+    std::unordered_map<std::string, int64_t> ids;
+    int64_t nextId = 1;
+    // Each key is copied here to be looked up, reusing the one allocation.
+    std::string scratch;
+
+    DictionaryHandler(Log &log, std::unique_ptr<LineIndexer> indexer,
+                      Sqlite::Statement &&insert, Sqlite::Statement &&addKey,
+                      Sqlite::Statement &&findKey)
+            : IndexHandler(log, std::move(indexer)),
+              insert(std::move(insert)), addKey(std::move(addKey)),
+              findKey(std::move(findKey)) {}
+
+    int64_t idOf(StringView key) {
+        scratch.assign(key.begin(), key.length());
+        auto it = ids.find(scratch);
+        if (it != ids.end()) return it->second;
+        int64_t id = 0;
+        // Only once the cache has filled can a key not in it have an id.
+        if (nextId > static_cast<int64_t>(MaxCachedIds)) {
+            findKey.reset().bindString(":key", key);
+            if (!findKey.step()) id = findKey.columnInt64(0);
+        }
+        if (!id) {
+            id = nextId++;
+            addKey
+                    .reset()
+                    .bindInt64(":id", id)
+                    .bindString(":key", key)
+                    .step();
+        }
+        if (ids.size() >= MaxCachedIds) ids.clear();
+        ids.emplace(scratch, id);
+        return id;
+    }
+
+    void add(StringView key, size_t offset) override {
+        indexed = true;
+        log.debug("Found key '", key, "'");
+        insert
+                .reset()
+                .bindInt64(":key", idOf(key))
+                .bindInt64(":line", currentLine)
+                .bindInt64(":offset", offset)
+                .step();
+    }
+};
+
+constexpr size_t DictionaryHandler::MaxCachedIds;
+
+// Stores the hash of each key in place of the key.
+struct HashedHandler : IndexHandler {
+    Sqlite::Statement insert;
+
+    HashedHandler(Log &log, std::unique_ptr<LineIndexer> indexer,
+                  Sqlite::Statement &&insert)
+            : IndexHandler(log, std::move(indexer)),
+              insert(std::move(insert)) {}
+
+    void add(StringView key, size_t offset) override {
+        indexed = true;
+        log.debug("Found key '", key, "'");
+        insert
+                .reset()
+                .bindInt64(":key", hashKey(key))
+                .bindInt64(":line", currentLine)
+                .bindInt64(":offset", offset)
+                .step();
+    }
+};
+
 struct NumericHandler : IndexHandler {
     Sqlite::Statement insert;
 
@@ -169,30 +333,7 @@ struct NumericHandler : IndexHandler {
 
     void add(StringView key, size_t offset) override {
         indexed = true;
-        auto index = key.begin();
-        auto initIndex = key.begin();
-        auto indexLength = key.length();
-        auto initLen = indexLength;
-        int64_t val = 0;
-        bool negative = false;
-        if (indexLength > 0 && *index == '-') {
-            negative = true;
-            indexLength--;
-            index++;
-        }
-        if (indexLength == 0)
-            throw std::invalid_argument("Non-numeric: empty string");
-        while (indexLength) {
-            val *= 10;
-            if (*index < '0' || *index > '9')
-                throw std::invalid_argument("Non-numeric: '"
-                                            + std::string(initIndex, initLen) +
-                                            "'");
-            val += *index - '0';
-            index++;
-            indexLength--;
-        }
-        if (negative) val = -val;
+        auto val = parseNumeric(key);
         log.debug("Found key ", val);
         insert
                 .reset()
@@ -203,17 +344,296 @@ struct NumericHandler : IndexHandler {
     }
 };
 
+// Stores a sample of the keys of an index whose keys never decrease through the
+// file: the first key at or after every sampleEvery lines, or after each
+// checkpoint if sampleEvery is zero, and the very last key.
+struct SampledHandler : IndexHandler {
+    Sqlite::Statement insert;
+    const bool numeric;
+    const uint64_t sampleEvery;
+    // The uncompressed offsets of the checkpoints found so far.
+    const std::vector<uint64_t> &checkpoints;
+    size_t nextCheckpoint = 0;
+    uint64_t nextSampleLine = 0;
+    std::unique_ptr<SortKey> lastKey;
+    uint64_t lastLine = 0;
+    uint64_t lastOffset = 0;
+    bool lastSampled = false;
+    size_t numKeys = 0;
+
+    SampledHandler(Log &log, std::unique_ptr<LineIndexer> indexer,
+                   Sqlite::Statement &&insert, bool numeric,
+                   uint64_t sampleEvery,
+                   const std::vector<uint64_t> &checkpoints)
+            : IndexHandler(log, std::move(indexer)),
+              insert(std::move(insert)), numeric(numeric),
+              sampleEvery(sampleEvery), checkpoints(checkpoints) {}
+
+    void add(StringView key, size_t offset) override {
+        indexed = true;
+        log.debug("Found key '", key, "'");
+        auto order = lastKey ? lastKey->compare(key) : 1;
+        if (order < 0)
+            throw std::runtime_error(
+                    "Key '" + key.str() + "' is less than the one before it;"
+                    " a sampled index needs keys which never decrease");
+        if (order > 0) {
+            ++numKeys;
+            lastKey.reset(new SortKey(numeric, key));
+        }
+        if (lastLine != currentLine) {
+            lastLine = currentLine;
+            lastOffset = offset;
+            lastSampled = false;
+            if (sampleDue()) sample(*lastKey);
+        }
+    }
+
+    bool sampleDue() {
+        if (sampleEvery) return currentLine >= nextSampleLine;
+        bool due = nextSampleLine == 0;
+        while (nextCheckpoint < checkpoints.size()
+               && checkpoints[nextCheckpoint] <= currentOffset) {
+            ++nextCheckpoint;
+            due = true;
+        }
+        return due;
+    }
+
+    void sample(const SortKey &key) {
+        if (numeric)
+            insert.reset().bindInt64(":key", key.number);
+        else
+            insert.reset().bindString(":key", key.text);
+        insert
+                .bindInt64(":line", currentLine)
+                .bindInt64(":offset", lastOffset)
+                .step();
+        nextSampleLine = currentLine + std::max<uint64_t>(sampleEvery, 1);
+        lastSampled = true;
+    }
+
+    // Sample the last key, so the samples cover every key there is.
+    void finish() override {
+        if (!lastKey || lastSampled) return;
+        currentLine = lastLine;
+        sample(*lastKey);
+    }
+};
+
+// Stores a compressed posting list of the lines with each key, rather than a
+// row per line, which suits keys shared by many lines. Long lists are split
+// into blocks so no one key's lines need be held in memory all at once.
+struct PostingHandler : IndexHandler {
+    static constexpr size_t BlockLines = 8192;
+
+    struct Posting {
+        PostingEncoder lines;
+        // The last line added, which is kept when a block is written out.
+        uint64_t lastLine = 0;
+    };
+
+    Sqlite::Statement insert;
+    const bool numeric;
+    std::unordered_map<std::string, Posting> postings;
+
+    PostingHandler(Log &log, std::unique_ptr<LineIndexer> indexer,
+                   Sqlite::Statement &&insert, bool numeric)
+            : IndexHandler(log, std::move(indexer)),
+              insert(std::move(insert)), numeric(numeric) {}
+
+    void add(StringView key, size_t /*offset*/) override {
+        indexed = true;
+        log.debug("Found key '", key, "'");
+        // Numeric keys are gathered in their canonical form, so "07" and "7"
+        // share a list.
+        auto canonical = numeric ? std::to_string(parseNumeric(key))
+                                 : key.str();
+        auto &posting = postings[canonical];
+        if (posting.lastLine == currentLine) return;
+        posting.lastLine = currentLine;
+        posting.lines.add(currentLine);
+        if (posting.lines.size() == BlockLines)
+            flush(canonical, posting.lines);
+    }
+
+    void flush(const std::string &key, PostingEncoder &encoder) {
+        if (numeric) insert.reset().bindInt64(":key", parseNumeric(key));
+        else insert.reset().bindString(":key", key);
+        insert
+                .bindInt64(":firstLine", encoder.first())
+                .bindInt64(":lastLine", encoder.last())
+                .bindInt64(":numLines", encoder.size())
+                .bindBlob(":lines", encoder.bytes().data(),
+                          encoder.bytes().size())
+                .step();
+        encoder.clear();
+    }
+
+    void finish() override {
+        for (auto &posting : postings) {
+            if (!posting.second.lines.empty())
+                flush(posting.first, posting.second.lines);
+        }
+        postings.clear();
+    }
+};
+
+// Passes on the lines matching a regex, or with a field matching it, to
+// another sink.
+struct GrepSink : LineSink, IndexSink {
+    RegExp re;
+    std::unique_ptr<FieldIndexer> fields;
+    LineSink *sink = nullptr;
+    // The text to match, NUL terminated for the regex library.
+    std::string text;
+    bool matched = false;
+    size_t matches = 0;
+    bool stopped = false;
+
+    GrepSink(const std::string &regex, const Index::GrepOptions &options)
+            : re(regex),
+              fields(options.field ? new FieldIndexer(options.delimiter,
+                                                      options.field)
+                                   : nullptr) {
+        if (options.field < 0)
+            throw std::invalid_argument("Fields are numbered from 1, not "
+                                        + std::to_string(options.field));
+    }
+
+    void add(StringView item, size_t) override {
+        if (matched) return;
+        text.assign(item.begin(), item.length());
+        matched = re.matches(text.c_str());
+    }
+
+    bool onLine(size_t lineNumber, size_t fileOffset, const char *line,
+                size_t length) override {
+        matched = false;
+        if (fields) fields->index(*this, StringView(line, length));
+        else add(StringView(line, length), 0);
+        if (!matched) return true;
+        ++matches;
+        stopped = !sink->onLine(lineNumber, fileOffset, line, length);
+        return !stopped;
+    }
+};
+
+// Decodes lines of a sampled index and indexes them again, collecting those
+// with keys matching a term. As the keys never decrease, it stops at the first
+// key past the term's.
+struct SampleScanner : LineSink, IndexSink {
+    LineIndexer &indexer;
+    SortKey from;
+    std::unique_ptr<SortKey> to;
+    // Prefix terms end just before the first key past the prefix.
+    bool toExclusive;
+    PostingList lines;
+    bool matched = false;
+    bool past = false;
+
+    SampleScanner(LineIndexer &indexer, bool numeric, const Query::Term &term)
+            : indexer(indexer), from(numeric, term.key),
+              toExclusive(term.type == Query::Term::Type::Prefix) {
+        if (term.type == Query::Term::Type::Exact) {
+            to.reset(new SortKey(numeric, term.key));
+        } else if (term.type == Query::Term::Type::Range) {
+            to.reset(new SortKey(numeric, term.to));
+        } else {
+            auto end = prefixEnd(term.key);
+            if (!end.empty()) to.reset(new SortKey(numeric, end));
+        }
+    }
+
+    bool onLine(size_t lineNumber, size_t /*fileOffset*/, const char *line,
+                size_t length) override {
+        matched = past = false;
+        indexer.index(*this, StringView(line, length));
+        if (matched) lines.push_back(lineNumber);
+        return !past;
+    }
+
+    void add(StringView key, size_t /*offset*/) override {
+        if (from.compare(key) < 0) return;
+        if (to) {
+            auto order = to->compare(key);
+            if (order > 0 || (order == 0 && toExclusive)) {
+                past = true;
+                return;
+            }
+        }
+        matched = true;
+    }
+};
+
+// A point in the compressed file from which decompression can start. The
+// window needed to prime the decompressor is only loaded when it's used.
+struct AccessPoint {
+    uint64_t uncompressedOffset;
+    uint64_t uncompressedEndOffset;
+    uint64_t compressedOffset;
+    int bitOffset;
+};
+
+// What we know about each sub-index.
+struct IndexInfo {
+    bool numeric = false;
+    bool sampled = false;
+    // For a sampled index, the configuration to make its indexer from.
+    std::string indexerConfig;
+    bool postingLists = false;
+    bool hashed = false;
+};
+
+// A decompression context, positioned at a particular uncompressed offset.
+// Decompressed data is buffered, so callers can consume exactly as much as they
+// need and leave the remainder for whoever comes next.
 struct CachedContext {
+    // The offset of the next byte to be consumed.
     size_t uncompressedOffset_;
     size_t blockSize_;
+    // The offset in the compressed file of the next input to be read. Each
+    // context reads with pread(), so contexts never disturb one another.
+    uint64_t compressedOffset_;
+    // The number of the line starting at uncompressedOffset_, or 0 if unknown.
+    uint64_t line_;
+    bool streamEnded_;
     uint8_t input_[ChunkSize];
+    uint8_t output_[WindowSize];
+    const uint8_t *outputBegin_;
+    const uint8_t *outputEnd_;
     ZStream zs_;
 
     explicit CachedContext(size_t uncompressedOffset, size_t blockSize)
             : uncompressedOffset_(uncompressedOffset),
               blockSize_(blockSize),
+              compressedOffset_(0),
+              line_(0),
+              streamEnded_(false),
+              outputBegin_(output_),
+              outputEnd_(output_),
               zs_(ZStream::Type::Raw) {}
 
+    // Reposition a previously-used context, ready to start decompressing
+    // afresh.
+    void reset(size_t uncompressedOffset, size_t blockSize) {
+        uncompressedOffset_ = uncompressedOffset;
+        blockSize_ = blockSize;
+        compressedOffset_ = 0;
+        line_ = 0;
+        streamEnded_ = false;
+        outputBegin_ = outputEnd_ = output_;
+        zs_.reset();
+        zs_.stream.avail_in = 0;
+    }
+
+    size_t available() const { return outputEnd_ - outputBegin_; }
+
+    void consume(size_t bytes) {
+        outputBegin_ += bytes;
+        uncompressedOffset_ += bytes;
+    }
+
     bool offsetWithinRange(size_t offset) const {
         if (offset < uncompressedOffset_) return false; // can't seek backwards
         size_t jumpAhead = offset - uncompressedOffset_;
@@ -221,228 +641,1691 @@ struct CachedContext {
     }
 };
 
+// The parts of a loaded index which don't change, shared between an Index and
+// any readers made from it.
+struct SharedIndex {
+    File compressed;
+    std::string indexFilename;
+    Index::Metadata metadata;
+    std::unordered_map<std::string, IndexInfo> indexes;
+    bool lineCheckpoints = false;
+    // Whether the LineCheckpoints table is there to scan from, as it is in
+    // all but the oldest indexes, whichever way lines are looked up.
+    bool scannable = false;
+    bool zoneMaps = false;
+    // The number of lines in each block of the trigram index, or 0 if none.
+    uint64_t trigramBlockLines = 0;
+    // The access point directory is loaded on first use.
+    std::once_flag accessPointsLoaded;
+    std::vector<AccessPoint> accessPoints;
+    size_t blockSize = DefaultIndexEvery;
+
+    SharedIndex(File &&compressed, const std::string &indexFilename)
+            : compressed(std::move(compressed)),
+              indexFilename(indexFilename) {}
+};
+
 }
 
+// A cursor reads its matches either from a statement, stepping it as each line
+// is asked for, or from a list of lines already worked out. The statement can
+// give either line numbers, or encoded posting lists to decode in turn.
+struct Index::Cursor::Impl {
+    std::unique_ptr<StatementCache::Lease> statement;
+    bool postings = false;
+    PostingDecoder decoder;
+    PostingList lines;
+    size_t position = 0;
+    size_t toSkip = 0;
+    size_t remaining = NoLimit;
+
+    bool fetch(uint64_t &line) {
+        if (statement && postings) {
+            while (!decoder.next(line)) {
+                if ((*statement)->step()) {
+                    statement.reset();
+                    return false;
+                }
+                decoder = PostingDecoder((*statement)->columnBlobView(0));
+            }
+            return true;
+        }
+        if (statement) {
+            if ((*statement)->step()) {
+                statement.reset();
+                return false;
+            }
+            line = static_cast<uint64_t>((*statement)->columnInt64(0));
+            return true;
+        }
+        if (position == lines.size()) return false;
+        line = lines[position++];
+        return true;
+    }
+
+    bool next(uint64_t &line) {
+        if (remaining == 0) {
+            // Give the statement back as soon as we're done with it.
+            statement.reset();
+            return false;
+        }
+        if (!statement) {
+            position += std::min(toSkip, lines.size() - position);
+            toSkip = 0;
+        }
+        for (; toSkip; --toSkip)
+            if (!fetch(line)) return false;
+        if (!fetch(line)) return false;
+        if (remaining != NoLimit) --remaining;
+        return true;
+    }
+};
+
 struct Index::Impl {
+    static constexpr auto MaxLineLength = 64u * 1024 * 1024;
+    static constexpr auto MaxSpareContexts = 2u;
+
+    // How an index's queries are answered, which depends on how it's
+    // stored. Each index is queried through the one of these that suits it,
+    // so the query methods needn't check how each is stored themselves.
+    struct Storage {
+        Impl &impl;
+        const std::string index;
+
+        Storage(Impl &impl, std::string index)
+                : impl(impl), index(std::move(index)) {}
+
+        virtual ~Storage() = default;
+
+        // The lines with the key, in order.
+        virtual Index::Cursor cursor(const std::string &key) = 0;
+        // The lines with any of the keys, in order and without duplicates.
+        virtual Index::Cursor cursorAny(
+                const std::vector<std::string> &keys) = 0;
+        virtual size_t count(const std::string &key) = 0;
+        virtual size_t countAny(const std::vector<std::string> &keys) = 0;
+        // The lines matching a term, in order and without duplicates.
+        virtual PostingList lines(const Query::Term &term) = 0;
+        // The number of entries matching a term, or with distinct set, the
+        // number of lines they're on.
+        virtual size_t count(const Query::Term &term, bool distinct) = 0;
+        // Look up each line's smallest key in a numeric index.
+        virtual size_t lineKeys(const std::vector<uint64_t> &lines,
+                                LineKeyFunction lineKeyFunction) = 0;
+        // The number of entries in the index.
+        virtual size_t size() = 0;
+    };
+    struct TableStorage;
+    struct SampledStorage;
+    struct PostingStorage;
+    struct HashedStorage;
+
     Log &log_;
-    File compressed_;
+    std::shared_ptr<SharedIndex> shared_;
+    // The compressed file, read only with pread() so it can be shared.
+    int fd_;
     Sqlite db_;
     Sqlite::Statement lineQuery_;
-    Index::Metadata metadata_;
-    size_t blockSize_;
+    Sqlite::Statement checkpointQuery_;
+    Sqlite::Statement windowQuery_;
     std::unique_ptr<CachedContext> cachedContext_;
-
-    Impl(Log &log, File &&fromCompressed, Sqlite &&db)
-            : log_(log), compressed_(std::move(fromCompressed)),
+    // Contexts no longer in use, kept to save reallocating them.
+    std::vector<std::unique_ptr<CachedContext>> spareContexts_;
+    // Scratch space for the line being decoded, reused between lines.
+    std::vector<uint8_t> lineBuffer_;
+    // Statements for index queries, which vary by index name and query shape.
+    mutable StatementCache statements_;
+    // The indexers of sampled and hashed indexes, made when first needed.
+    std::unordered_map<std::string, std::unique_ptr<LineIndexer>>
+            lineIndexers_;
+    // How each index is queried, made when first needed.
+    std::unordered_map<std::string, std::unique_ptr<Storage>> storages_;
+
+    Impl(Log &log, std::shared_ptr<SharedIndex> shared, Sqlite &&db)
+            : log_(log), shared_(std::move(shared)),
+              fd_(fileno(shared_->compressed.get())),
               db_(std::move(db)),
-              lineQuery_(db_.prepare(R"(
-SELECT line, offset, compressedOffset, uncompressedOffset, length, bitOffset, window
-FROM LineOffsets, AccessPoints
-WHERE offset >= uncompressedOffset AND offset <= uncompressedEndOffset
-AND line = :line
-LIMIT 1)")) {
+              lineQuery_(log),
+              checkpointQuery_(log),
+              windowQuery_(db_.prepare(R"(
+SELECT window FROM AccessPoints WHERE uncompressedOffset = :offset)")),
+              statements_(db_) {
+        if (shared_->scannable) {
+            checkpointQuery_ = db_.prepare(R"(
+SELECT line, offset FROM LineCheckpoints
+WHERE line <= :line
+ORDER BY line DESC
+LIMIT 1)");
+        }
+        if (!shared_->lineCheckpoints) {
+            lineQuery_ = db_.prepare(R"(
+SELECT offset, length FROM LineOffsets WHERE line = :line)");
+        }
+    }
+
+    // Read the metadata and the index directory into the shared state. Only
+    // called once, before any readers are made.
+    static void loadShared(Log &log, Sqlite &db, SharedIndex &shared) {
         try {
-            auto queryMeta = db_.prepare("SELECT key, value FROM Metadata");
+            auto queryMeta = db.prepare("SELECT key, value FROM Metadata");
             for (;;) {
                 if (queryMeta.step()) break;
                 auto key = queryMeta.columnString(0);
                 auto value = queryMeta.columnString(1);
-                log_.debug("Metadata: ", key, " = ", value);
-                metadata_.emplace(key, value);
+                log.debug("Metadata: ", key, " = ", value);
+                shared.metadata.emplace(key, value);
             }
         } catch (const std::exception &e) {
             log.warn("Caught exception reading metadata: ", e.what());
         }
-        auto stmt = db_.prepare(
-                "SELECT MAX(uncompressedEndOffset)/COUNT(*) FROM AccessPoints");
-        if (stmt.step()) {
-            blockSize_ = 32 * 1024 * 1024;
-        } else {
-            blockSize_ = stmt.columnInt64(0);
+        auto stmt = db.prepare("SELECT * FROM Indexes");
+        while (!stmt.step()) {
+            IndexInfo info;
+            std::string name;
+            for (auto column = 0; column < stmt.columnCount(); ++column) {
+                auto columnName = stmt.columnName(column);
+                if (columnName == "name")
+                    name = stmt.columnString(column);
+                else if (columnName == "isNumeric")
+                    info.numeric = stmt.columnInt64(column) != 0;
+                else if (columnName == "isSampled")
+                    info.sampled = stmt.columnInt64(column) != 0;
+                else if (columnName == "indexerConfig")
+                    info.indexerConfig = stmt.columnString(column);
+                else if (columnName == "isPostingList")
+                    info.postingLists = stmt.columnInt64(column) != 0;
+                else if (columnName == "isHashed")
+                    info.hashed = stmt.columnInt64(column) != 0;
+            }
+            log.debug("Index '", name, "'", info.numeric ? " (numeric)" : "",
+                      info.sampled ? " (sampled)" : "",
+                      info.postingLists ? " (posting lists)" : "",
+                      info.hashed ? " (hashed)" : "");
+            shared.indexes.emplace(name, info);
         }
-        log_.debug("Average block size ", PrettyBytes(blockSize_));
+        auto lineIndex = shared.metadata.find("lineIndex");
+        shared.lineCheckpoints = lineIndex != shared.metadata.end()
+                                 && lineIndex->second == "checkpoints";
+        if (shared.lineCheckpoints)
+            log.debug("Finding lines by scanning from line checkpoints");
+        auto hasTable = [&](const std::string &table) {
+            auto stmt = db.prepare(R"(
+SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = :name)");
+            stmt.bindString(":name", table);
+            return !stmt.step() && stmt.columnInt64(0) != 0;
+        };
+        shared.scannable = shared.lineCheckpoints
+                           || hasTable("LineCheckpoints");
+        shared.zoneMaps = hasTable("ZoneMaps");
+        auto trigrams = shared.metadata.find("trigramBlockLines");
+        if (trigrams != shared.metadata.end())
+            shared.trigramBlockLines = std::stoull(trigrams->second);
     }
 
+    // Load the access point directory the first time we need to decompress
+    // anything, so queries answered purely from the index tables never read
+    // it. Readers share the one copy.
+    void loadAccessPoints() {
+        std::call_once(shared_->accessPointsLoaded, [this] {
+            std::vector<AccessPoint> accessPoints;
+            auto stmt = db_.prepare(R"(
+SELECT uncompressedOffset, uncompressedEndOffset, compressedOffset, bitOffset
+FROM AccessPoints
+ORDER BY uncompressedOffset)");
+            while (!stmt.step()) {
+                accessPoints.push_back(AccessPoint{
+                        static_cast<uint64_t>(stmt.columnInt64(0)),
+                        static_cast<uint64_t>(stmt.columnInt64(1)),
+                        static_cast<uint64_t>(stmt.columnInt64(2)),
+                        static_cast<int>(stmt.columnInt64(3))});
+            }
+            if (!accessPoints.empty()) {
+                shared_->blockSize = accessPoints.back().uncompressedEndOffset
+                                     / accessPoints.size();
+            }
+            shared_->accessPoints = std::move(accessPoints);
+            log_.debug("Loaded ", shared_->accessPoints.size(),
+                       " access points, average block size ",
+                       PrettyBytes(shared_->blockSize));
+        });
+    }
+
+    const IndexInfo &indexInfo(const std::string &index) const {
+        auto it = shared_->indexes.find(index);
+        if (it == shared_->indexes.end())
+            throw std::runtime_error("No index named '" + index + "'");
+        return it->second;
+    }
+
+    // The Storage answering an index's queries.
+    Storage &storage(const std::string &index);
+
     void init(bool force) {
         struct stat stats;
-        if (fstat(fileno(compressed_.get()), &stats) != 0) {
+        if (fstat(fd_, &stats) != 0) {
             throw std::runtime_error("Unable to get file stats"); // todo errno
         }
         auto sizeStr = std::to_string(stats.st_size);
         auto timeStr = std::to_string(stats.st_mtime);
         log_.debug("Opened compressed file of size ", sizeStr, " mtime ",
                    timeStr);
-        if (metadata_.find("compressedSize") != metadata_.end()
-            && sizeStr != metadata_.at("compressedSize")) {
+        if (shared_->metadata.find("compressedSize") != shared_->metadata.end()
+            && sizeStr != shared_->metadata.at("compressedSize")) {
             if (force) {
                 log_.warn("Expected compressed size mismatched, "
                                   "continuing anyway (", stats.st_size,
                           " vs expected ",
-                          metadata_.at("compressedSize"), ")");
+                          shared_->metadata.at("compressedSize"), ")");
             } else {
                 throw std::runtime_error(
                         "Compressed size changed since index was built");
             }
         }
-        if (metadata_.find("compressedModTime") != metadata_.end()
-            && timeStr != metadata_.at("compressedModTime")) {
+        if (shared_->metadata.find("compressedModTime") != shared_->metadata.end()
+            && timeStr != shared_->metadata.at("compressedModTime")) {
             if (force) {
                 log_.warn("Expected compressed timestamp, continuing anyway");
             } else {
-                throw std::runtime_error(
-                        "Compressed file has been modified since index was built");
+                throw std::runtime_error(
+                        "Compressed file has been modified since index was built");
+            }
+        }
+    }
+
+    bool getLine(uint64_t line, LineSink &sink) {
+        if (shared_->lineCheckpoints) return scanLine(line, sink);
+        lineQuery_.reset();
+        lineQuery_.bindInt64(":line", line);
+        if (lineQuery_.step()) return false;
+        auto offset = static_cast<size_t>(lineQuery_.columnInt64(0));
+        auto length = static_cast<size_t>(lineQuery_.columnInt64(1));
+        readLineAt(line, offset, length, sink);
+        return true;
+    }
+
+    size_t getLineRange(uint64_t first, uint64_t last, LineSink &sink) {
+        if (first > last) return 0;
+        if (shared_->lineCheckpoints) return scanLineRange(first, last, sink);
+        // Lines may be missing from a sparse index, so rather than assume the
+        // range is contiguous we look up all its offsets in one go. Each line
+        // then carries on decoding from where the previous one finished.
+        auto stmt = statements_.get(R"(
+SELECT line, offset, length FROM LineOffsets
+WHERE line BETWEEN :first AND :last
+ORDER BY line)");
+        stmt->bindInt64(":first", first);
+        stmt->bindInt64(":last", last);
+        size_t numLines = 0;
+        while (!stmt->step()) {
+            ++numLines;
+            if (!readLineAt(static_cast<uint64_t>(stmt->columnInt64(0)),
+                            static_cast<size_t>(stmt->columnInt64(1)),
+                            static_cast<size_t>(stmt->columnInt64(2)), sink))
+                break;
+        }
+        return numLines;
+    }
+
+    // Decode a line whose offset and length (including the newline) are
+    // known, and pass it to the sink. Returns whatever the sink returns.
+    bool readLineAt(uint64_t line, size_t offset, size_t length,
+                    LineSink &sink) {
+        if (length >= MaxLineLength) throw std::runtime_error("Line too long!");
+        if (lineBuffer_.size() < length) lineBuffer_.resize(length);
+
+        // We use and update context while in here. Only if we successfully
+        // decode a line do we save it in the cachedContext_ for a subsequent
+        // call.
+        auto context = contextFor(offset);
+        auto numRead = read(context, lineBuffer_.data(), length);
+        context->line_ = line + 1;
+        cachedContext_ = std::move(context);
+        // The last line in the file may not have a trailing newline.
+        return sink.onLine(line, offset,
+                    reinterpret_cast<const char *>(lineBuffer_.data()),
+                    numRead == length ? length - 1 : numRead);
+    }
+
+    // Find a line by scanning forward from the closest line checkpoint, or from
+    // the previous line fetched if that's closer.
+    bool scanLine(uint64_t line, LineSink &sink) {
+        return scanLineRange(line, line, sink) != 0;
+    }
+
+    // Find the first line as for scanLine, then split each following line
+    // out of the same decompressed stream.
+    size_t scanLineRange(uint64_t first, uint64_t last, LineSink &sink) {
+        auto context = contextForLine(first);
+        if (!context) return 0;
+        size_t numLines = 0;
+        for (auto line = first; line <= last; ++line) {
+            auto offset = context->uncompressedOffset_;
+            if (!readLine(context)) break; // past the last line
+            context->line_ = line + 1;
+            ++numLines;
+            if (!sink.onLine(line, offset,
+                             reinterpret_cast<const char *>(lineBuffer_.data()),
+                             lineBuffer_.size()))
+                break;
+        }
+        recycle(std::move(cachedContext_));
+        cachedContext_ = std::move(context);
+        return numLines;
+    }
+
+    // Return a context positioned at the start of the given line, or nullptr if
+    // there's no such line.
+    std::unique_ptr<CachedContext> contextForLine(uint64_t line) {
+        checkpointQuery_.reset();
+        checkpointQuery_.bindInt64(":line", line);
+        if (checkpointQuery_.step()) return nullptr;
+        auto checkpointLine = static_cast<uint64_t>(
+                checkpointQuery_.columnInt64(0));
+        auto checkpointOffset = static_cast<size_t>(
+                checkpointQuery_.columnInt64(1));
+
+        std::unique_ptr<CachedContext> context;
+        if (cachedContext_ && cachedContext_->line_ >= checkpointLine
+            && cachedContext_->line_ <= line) {
+            log_.debug("Scanning on from line ", cachedContext_->line_);
+            context = std::move(cachedContext_);
+        } else {
+            log_.debug("Scanning from checkpoint line ", checkpointLine);
+            context = contextFor(checkpointOffset);
+            context->line_ = checkpointLine;
+        }
+        if (!skipLines(context, line - context->line_)) {
+            recycle(std::move(context));
+            return nullptr;
+        }
+        return context;
+    }
+
+    // Read the line at the context's position into the lineBuffer_, without
+    // its newline. Returns false if there are no more lines.
+    bool readLine(std::unique_ptr<CachedContext> &context) {
+        auto &lineBuf = lineBuffer_;
+        lineBuf.clear();
+        bool complete = false;
+        while (!complete && fill(context)) {
+            auto begin = context->outputBegin_;
+            auto newline = static_cast<const uint8_t *>(
+                    memchr(begin, '\n', context->available()));
+            auto end = newline ? newline : context->outputEnd_;
+            lineBuf.insert(lineBuf.end(), begin, end);
+            if (lineBuf.size() >= MaxLineLength)
+                throw std::runtime_error("Line too long!");
+            complete = newline != nullptr;
+            context->consume(end - begin + (complete ? 1 : 0));
+        }
+        return complete || !lineBuf.empty();
+    }
+
+    Index::Cursor cursorIndex(const std::string &index,
+                              const std::string &query) {
+        return storage(index).cursor(query);
+    }
+
+    Index::Cursor cursorIndexMulti(const std::string &index,
+                                   const std::vector<std::string> &queries) {
+        return storage(index).cursorAny(queries);
+    }
+
+    static Index::Cursor statementCursor(StatementCache::Lease &&statement) {
+        std::unique_ptr<Index::Cursor::Impl> impl(new Index::Cursor::Impl);
+        impl->statement.reset(new StatementCache::Lease(std::move(statement)));
+        return Index::Cursor(std::move(impl));
+    }
+
+    // A cursor decoding the posting lists of a single key in turn.
+    Index::Cursor postingCursor(const std::string &index,
+                                const std::string &key) {
+        auto stmt = statements_.get("SELECT lines FROM index_" + index
+                                    + " WHERE key = :key ORDER BY firstLine");
+        stmt->bindString(":key", key);
+        std::unique_ptr<Index::Cursor::Impl> impl(new Index::Cursor::Impl);
+        impl->statement.reset(new StatementCache::Lease(std::move(stmt)));
+        impl->postings = true;
+        return Index::Cursor(std::move(impl));
+    }
+
+    // Decode all the posting lists a statement gives, in order and without
+    // duplicates.
+    static PostingList decodePostings(StatementCache::Lease &&stmt) {
+        PostingList lines;
+        while (!stmt->step())
+            PostingDecoder(stmt->columnBlobView(0)).decodeInto(lines);
+        std::sort(lines.begin(), lines.end());
+        lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+        return lines;
+    }
+
+    PostingList postingLines(const std::string &index,
+                             const std::vector<std::string> &queries) {
+        loadQueryKeys(index, queries);
+        return decodePostings(statements_.get(
+                "SELECT lines FROM index_" + index
+                + " AS i JOIN QueryKeys AS q ON i.key = q.key"));
+    }
+
+    // Find the lines of a hashed index with any of the keys. The index gives
+    // the lines with a key of the same hash, so each is decoded, in file
+    // order, to check it has the key itself. Lines are indexed again to find
+    // their keys; indexes built without an indexer config are checked for the
+    // key at the offset stored for it instead.
+    PostingList hashedLines(const std::string &index,
+                            const std::vector<std::string> &queries) {
+        struct Candidate {
+            uint64_t line;
+            size_t keyOffset;
+            size_t offset;
+            size_t length;
+            const std::string *key;
+        };
+        std::vector<Candidate> candidates;
+        // Each line's offset comes along with it, unless there are only
+        // checkpoints to find it from.
+        auto stmt = statements_.get(
+                shared_->lineCheckpoints
+                ? "SELECT line, offset, 0, 0 FROM index_" + index
+                  + " WHERE key = :key"
+                : "SELECT i.line, i.offset, l.offset, l.length FROM index_"
+                  + index + " AS i JOIN LineOffsets AS l ON l.line = i.line"
+                  + " WHERE i.key = :key");
+        for (auto &query : queries) {
+            stmt->reset();
+            stmt->bindInt64(":key", hashKey(query));
+            while (!stmt->step()) {
+                candidates.push_back(Candidate{
+                        static_cast<uint64_t>(stmt->columnInt64(0)),
+                        static_cast<size_t>(stmt->columnInt64(1)),
+                        static_cast<size_t>(stmt->columnInt64(2)),
+                        static_cast<size_t>(stmt->columnInt64(3)), &query});
+            }
+        }
+        std::sort(candidates.begin(), candidates.end(),
+                  [](const Candidate &lhs, const Candidate &rhs) {
+                      return lhs.line < rhs.line;
+                  });
+        struct LineKeys : LineSink, IndexSink {
+            LineIndexer *indexer;
+            std::string text;
+            std::vector<std::string> keys;
+
+            explicit LineKeys(LineIndexer *indexer) : indexer(indexer) {}
+
+            bool onLine(size_t, size_t, const char *line,
+                        size_t length) override {
+                text.assign(line, length);
+                keys.clear();
+                if (indexer) indexer->index(*this, StringView(line, length));
+                return true;
+            }
+
+            void add(StringView item, size_t) override {
+                keys.push_back(item.str());
+            }
+
+            bool has(const std::string &key, size_t offset) const {
+                if (indexer)
+                    return std::find(keys.begin(), keys.end(), key)
+                           != keys.end();
+                return offset <= text.size()
+                       && text.compare(offset, key.size(), key) == 0;
+            }
+        } lineKeys(indexInfo(index).indexerConfig.empty()
+                   ? nullptr : &lineIndexer(index));
+        PostingList lines;
+        for (auto it = candidates.begin(); it != candidates.end();) {
+            auto line = it->line;
+            auto read = true;
+            if (shared_->lineCheckpoints)
+                read = getLine(line, lineKeys);
+            else
+                readLineAt(line, it->offset, it->length, lineKeys);
+            bool found = false;
+            for (; it != candidates.end() && it->line == line; ++it)
+                found |= read && lineKeys.has(*it->key, it->keyOffset);
+            if (found) lines.push_back(line);
+        }
+        return lines;
+    }
+
+    static Index::Cursor listCursor(PostingList &&lines) {
+        std::unique_ptr<Index::Cursor::Impl> impl(new Index::Cursor::Impl);
+        impl->lines = std::move(lines);
+        return Index::Cursor(std::move(impl));
+    }
+
+    size_t countIndex(const std::string &index, const std::string &query) {
+        return storage(index).count(query);
+    }
+
+    size_t countIndexMulti(const std::string &index,
+                           const std::vector<std::string> &queries) {
+        return storage(index).countAny(queries);
+    }
+
+    // Load all the keys into a temporary table so they can be joined against
+    // in a single statement, rather than preparing and running a query per key.
+    void loadQueryKeys(const std::string &index,
+                       const std::vector<std::string> &queries) {
+        indexInfo(index);
+        db_.exec(R"(
+CREATE TEMP TABLE IF NOT EXISTS QueryKeys(key PRIMARY KEY) WITHOUT ROWID)");
+        db_.exec("BEGIN");
+        try {
+            db_.exec("DELETE FROM QueryKeys");
+            auto addKey = statements_.get(
+                    "INSERT OR IGNORE INTO QueryKeys VALUES(:key)");
+            for (auto &query : queries) {
+                addKey->reset();
+                addKey->bindString(":key", query);
+                addKey->step();
+            }
+        } catch (...) {
+            db_.exec("ROLLBACK");
+            throw;
+        }
+        db_.exec("COMMIT");
+    }
+
+    size_t lineKeys(const std::string &index,
+                    const std::vector<uint64_t> &lines,
+                    LineKeyFunction lineKeyFunction) {
+        if (!indexInfo(index).numeric)
+            throw std::invalid_argument("Index '" + index
+                                        + "' isn't numeric");
+        return storage(index).lineKeys(lines, lineKeyFunction);
+    }
+
+    // Look up each line's smallest key in an index of posting lists, by
+    // searching every list for them. Such indexes have few keys.
+    size_t postingLineKeys(const std::string &index,
+                           std::vector<uint64_t> lines,
+                           LineKeyFunction lineKeyFunction) {
+        std::sort(lines.begin(), lines.end());
+        lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+        std::vector<int64_t> keys(lines.size());
+        std::vector<bool> found(lines.size());
+        auto stmt = statements_.get("SELECT key, lines FROM index_" + index);
+        while (!stmt->step()) {
+            auto key = stmt->columnInt64(0);
+            PostingList keyLines;
+            PostingDecoder(stmt->columnBlobView(1)).decodeInto(keyLines);
+            for (auto line : intersect(lines, keyLines)) {
+                auto i = std::lower_bound(lines.begin(), lines.end(), line)
+                         - lines.begin();
+                if (!found[i] || key < keys[i]) keys[i] = key;
+                found[i] = true;
+            }
+        }
+        size_t matches = 0;
+        for (size_t i = 0; i < lines.size(); ++i) {
+            if (!found[i]) continue;
+            lineKeyFunction(lines[i], keys[i]);
+            ++matches;
+        }
+        return matches;
+    }
+
+    Index::Cursor cursorIndexRange(const std::string &index,
+                                   const std::string &from,
+                                   const std::string &to) {
+        Query::Term term{Query::Term::Type::Range, index, from, to};
+        return listCursor(termLines(term));
+    }
+
+    Index::Cursor cursorIndexPrefix(const std::string &index,
+                                    const std::string &prefix) {
+        Query::Term term{Query::Term::Type::Prefix, index, prefix, ""};
+        return listCursor(termLines(term));
+    }
+
+    size_t countIndexRange(const std::string &index, const std::string &from,
+                           const std::string &to) {
+        Query::Term term{Query::Term::Type::Range, index, from, to};
+        return termCount(term, true);
+    }
+
+    size_t countIndexPrefix(const std::string &index,
+                            const std::string &prefix) {
+        Query::Term term{Query::Term::Type::Prefix, index, prefix, ""};
+        return termCount(term, true);
+    }
+
+    size_t countExpression(const std::string &expression,
+                           const std::string &defaultIndex) {
+        Query query(expression, defaultIndex);
+        QuerySource source(*this);
+        return query.evaluate(source).size();
+    }
+
+    Index::Cursor cursorExpression(const std::string &expression,
+                                   const std::string &defaultIndex) {
+        Query query(expression, defaultIndex);
+        log_.debug("Evaluating query ", query.toString());
+        QuerySource source(*this);
+        return listCursor(query.evaluate(source));
+    }
+
+    // Prepare a statement selecting the given columns from the rows of an index
+    // matching the term.
+    StatementCache::Lease termStatement(const std::string &columns,
+                                    const Query::Term &term) const {
+        const auto &info = indexInfo(term.index);
+        std::string end;
+        std::string where;
+        switch (term.type) {
+            case Query::Term::Type::Exact:
+                where = "key = :key";
+                break;
+            case Query::Term::Type::Range:
+                where = "key BETWEEN :key AND :to";
+                break;
+            case Query::Term::Type::Prefix:
+                checkPrefix(info, term);
+                end = prefixEnd(term.key);
+                where = end.empty() ? "key >= :key" : "key >= :key AND key < :to";
+                break;
+        }
+        auto stmt = statements_.get("SELECT " + columns + " FROM index_"
+                                    + term.index + " WHERE " + where);
+        if (term.type == Query::Term::Type::Range && info.numeric) {
+            stmt->bindInt64(":key", parseNumeric(term.key));
+            stmt->bindInt64(":to", parseNumeric(term.to));
+        } else {
+            stmt->bindString(":key", term.key);
+            if (term.type == Query::Term::Type::Range)
+                stmt->bindString(":to", term.to);
+            else if (!end.empty())
+                stmt->bindString(":to", end);
+        }
+        return stmt;
+    }
+
+    static void checkPrefix(const IndexInfo &info, const Query::Term &term) {
+        if (info.numeric)
+            throw std::invalid_argument(
+                    "Prefix queries aren't supported on numeric index '"
+                    + term.index + "'");
+    }
+
+    // Return the lines matching a term, in order and without duplicates, so
+    // they can be decoded sequentially.
+    PostingList termLines(const Query::Term &term) {
+        return storage(term.index).lines(term);
+    }
+
+    // Find the lines matching a numeric range term zone by zone, using the
+    // zone maps. Zones whose keys all lie in the range need no searching at
+    // all, and the others are only searched for the keys they could hold.
+    // Returns false, having done nothing, if there are no zone maps or the
+    // keys are too jumbled for them to help.
+    bool zoneLines(const Query::Term &term, PostingList &lines) const {
+        if (!shared_->zoneMaps || term.type != Query::Term::Type::Range
+            || !indexInfo(term.index).numeric)
+            return false;
+        auto from = parseNumeric(term.key);
+        auto to = parseNumeric(term.to);
+        struct Zone {
+            uint64_t firstLine;
+            uint64_t lastLine;
+            int64_t minKey;
+            int64_t maxKey;
+            uint64_t keyedLines;
+        };
+        std::vector<Zone> zones;
+        auto stmt = statements_.get(R"(
+SELECT firstLine, lastLine, minKey, maxKey, keyedLines FROM ZoneMaps
+WHERE name = :name AND maxKey >= :from AND minKey <= :to
+ORDER BY firstLine)");
+        stmt->bindString(":name", term.index);
+        stmt->bindInt64(":from", from);
+        stmt->bindInt64(":to", to);
+        while (!stmt->step()) {
+            zones.push_back(Zone{
+                    static_cast<uint64_t>(stmt->columnInt64(0)),
+                    static_cast<uint64_t>(stmt->columnInt64(1)),
+                    stmt->columnInt64(2), stmt->columnInt64(3),
+                    static_cast<uint64_t>(stmt->columnInt64(4))});
+        }
+        // Searching zone by zone only pays if each zone holds its own part of
+        // the range, as when keys mostly increase through the file.
+        double covered = 0;
+        auto lowest = std::numeric_limits<int64_t>::max();
+        auto highest = std::numeric_limits<int64_t>::min();
+        for (auto &zone : zones) {
+            auto zoneFrom = std::max(from, zone.minKey);
+            auto zoneTo = std::min(to, zone.maxKey);
+            covered += static_cast<double>(zoneTo) - zoneFrom + 1;
+            lowest = std::min(lowest, zoneFrom);
+            highest = std::max(highest, zoneTo);
+        }
+        if (!zones.empty()
+            && covered > 2 * (static_cast<double>(highest) - lowest + 1)) {
+            log_.debug("Zone maps overlap too much to use for ", term.index);
+            return false;
+        }
+        log_.debug("Range touches ", zones.size(), " zones");
+        auto search = statements_.get(R"(
+SELECT line FROM index_)" + term.index + R"(
+WHERE key BETWEEN :from AND :to AND line BETWEEN :firstLine AND :lastLine)");
+        for (auto &zone : zones) {
+            if (zone.minKey >= from && zone.maxKey <= to
+                && zone.keyedLines == zone.lastLine - zone.firstLine + 1) {
+                for (auto line = zone.firstLine; line <= zone.lastLine; ++line)
+                    lines.push_back(line);
+                continue;
+            }
+            search->reset();
+            search->bindInt64(":from", std::max(from, zone.minKey));
+            search->bindInt64(":to", std::min(to, zone.maxKey));
+            search->bindInt64(":firstLine", zone.firstLine);
+            search->bindInt64(":lastLine", zone.lastLine);
+            while (!search->step())
+                lines.emplace_back(search->columnInt64(0));
+        }
+        return true;
+    }
+
+    // Count the index entries matching a term, or with distinct set, the
+    // lines they're on.
+    size_t termCount(const Query::Term &term, bool distinct) {
+        return storage(term.index).count(term, distinct);
+    }
+
+    // The indexer an index was built with, made again from its config.
+    LineIndexer &lineIndexer(const std::string &index) {
+        auto &indexer = lineIndexers_[index];
+        if (!indexer) {
+            indexer = IndexParser::makeIndexer(indexInfo(index).indexerConfig,
+                                               log_);
+        }
+        return *indexer;
+    }
+
+    // Find the lines of a sampled index which could have keys matching a
+    // term: those from the last sample with a key before the term's keys to
+    // the first with a key after them. Returns false if there are none.
+    bool sampledSpan(const Query::Term &term, uint64_t &first,
+                     uint64_t &last) {
+        const auto &info = indexInfo(term.index);
+        if (term.type == Query::Term::Type::Prefix) checkPrefix(info, term);
+        SampleScanner bounds(lineIndexer(term.index), info.numeric, term);
+        auto bindKey = [](StatementCache::Lease &stmt, const SortKey &key) {
+            if (key.numeric) stmt->bindInt64(":key", key.number);
+            else stmt->bindString(":key", key.text);
+        };
+        auto before = statements_.get("SELECT line FROM index_" + term.index
+                                      + " WHERE key < :key"
+                                      + " ORDER BY key DESC, line DESC LIMIT 1");
+        bindKey(before, bounds.from);
+        first = before->step() ? 1
+                               : static_cast<uint64_t>(before->columnInt64(0));
+        last = numLines();
+        if (bounds.to) {
+            auto after = statements_.get(
+                    "SELECT line FROM index_" + term.index + " WHERE key "
+                    + (bounds.toExclusive ? ">=" : ">")
+                    + " :key ORDER BY key, line LIMIT 1");
+            bindKey(after, *bounds.to);
+            if (!after->step())
+                last = static_cast<uint64_t>(after->columnInt64(0));
+        }
+        return first <= last;
+    }
+
+    // Find the lines matching a term in a sampled index by decoding the lines
+    // between its samples.
+    PostingList sampledLines(const Query::Term &term) {
+        const auto &info = indexInfo(term.index);
+        uint64_t first, last;
+        if (!sampledSpan(term, first, last)) return PostingList();
+        log_.debug("Scanning lines ", first, " to ", last, " of sampled index ",
+                   term.index);
+        SampleScanner scanner(lineIndexer(term.index), info.numeric, term);
+        getLineRange(first, last, scanner);
+        return std::move(scanner.lines);
+    }
+
+    PostingList sampledLines(const std::string &index,
+                             const std::vector<std::string> &queries) {
+        PostingList lines;
+        for (auto &query : queries) {
+            lines = unite(lines, sampledLines(Query::Term{
+                    Query::Term::Type::Exact, index, query, ""}));
+        }
+        return lines;
+    }
+
+    // Look up each line's smallest key in a sampled index by decoding it.
+    size_t sampledLineKeys(const std::string &index,
+                           std::vector<uint64_t> lines,
+                           LineKeyFunction lineKeyFunction) {
+        struct KeyReader : LineSink, IndexSink {
+            LineIndexer &indexer;
+            bool found = false;
+            int64_t key = 0;
+
+            explicit KeyReader(LineIndexer &indexer) : indexer(indexer) {}
+
+            bool onLine(size_t, size_t, const char *line,
+                        size_t length) override {
+                found = false;
+                indexer.index(*this, StringView(line, length));
+                return true;
+            }
+
+            void add(StringView item, size_t) override {
+                auto value = parseNumeric(item);
+                if (!found || value < key) key = value;
+                found = true;
+            }
+        } reader(lineIndexer(index));
+        std::sort(lines.begin(), lines.end());
+        lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+        size_t matches = 0;
+        for (auto line : lines) {
+            if (!getLine(line, reader) || !reader.found) continue;
+            lineKeyFunction(line, reader.key);
+            ++matches;
+        }
+        return matches;
+    }
+
+    uint64_t numLines() const {
+        auto numLines = shared_->metadata.find("numLines");
+        if (numLines != shared_->metadata.end()) return std::stoull(numLines->second);
+        // Indexes built before numLines was recorded always have line offsets.
+        auto stmt = db_.prepare("SELECT MAX(line) FROM LineOffsets");
+        if (stmt.step()) return 0;
+        return static_cast<uint64_t>(stmt.columnInt64(0));
+    }
+
+    struct QuerySource : Query::Source {
+        Impl &impl;
+
+        explicit QuerySource(Impl &impl) : impl(impl) {}
+
+        size_t estimate(const Query::Term &term) override {
+            return impl.termCount(term, false);
+        }
+
+        PostingList lines(const Query::Term &term) override {
+            return impl.termLines(term);
+        }
+
+        uint64_t numLines() override {
+            return impl.numLines();
+        }
+    };
+
+    Index::Cursor cursorCustom(const std::string &customQuery) {
+        return statementCursor(statements_.get(customQuery));
+    }
+
+    size_t grep(const std::string &regex, LineSink &sink,
+                const Index::GrepOptions &options) {
+        auto spans = grepSpans(regex);
+        if (options.jobs > 1 && shared_->scannable)
+            return grepInParallel(regex, sink, options,
+                                  splitAtCheckpoints(spans));
+        GrepSink matcher(regex, options);
+        matcher.sink = &sink;
+        for (auto &span : spans) {
+            scanRange(span.first, span.second, matcher);
+            if (matcher.stopped) break;
+        }
+        return matcher.matches;
+    }
+
+    // Search spans of the file on several threads at once, each with a reader
+    // of its own, and pass the matches to the sink in order. Each span's
+    // matches are held until those before have been passed on.
+    size_t grepInParallel(
+            const std::string &regex, LineSink &sink,
+            const Index::GrepOptions &options,
+            const std::vector<std::pair<uint64_t, uint64_t>> &spans) {
+        struct Found : LineSink {
+            std::vector<uint64_t> lines;
+            std::vector<size_t> offsets;
+            // The lines' text, one after another, and where each ends.
+            std::string text;
+            std::vector<size_t> ends;
+            std::string error;
+
+            bool onLine(size_t lineNumber, size_t fileOffset, const char *line,
+                        size_t length) override {
+                lines.push_back(lineNumber);
+                offsets.push_back(fileOffset);
+                text.append(line, length);
+                ends.push_back(text.size());
+                return true;
+            }
+        };
+        auto jobs = std::min<size_t>(options.jobs, spans.size());
+        std::vector<std::unique_ptr<Impl>> readers;
+        std::vector<std::unique_ptr<GrepSink>> matchers;
+        for (size_t i = 0; i < jobs; ++i) {
+            readers.emplace_back(reader());
+            matchers.emplace_back(new GrepSink(regex, options));
+        }
+        log_.debug("Searching ", spans.size(), " spans on ", jobs,
+                   " threads");
+        std::vector<Found> found(spans.size());
+        size_t matches = 0;
+        forEachInParallel(spans.size(), jobs, [&](size_t worker, size_t i) {
+            try {
+                matchers[worker]->sink = &found[i];
+                readers[worker]->scanRange(spans[i].first, spans[i].second,
+                                           *matchers[worker]);
+            } catch (const std::exception &e) {
+                found[i].error = e.what();
+            }
+        }, [&](size_t i) {
+            Found done;
+            std::swap(done, found[i]);
+            if (!done.error.empty()) throw std::runtime_error(done.error);
+            size_t begin = 0;
+            for (size_t j = 0; j < done.lines.size(); ++j) {
+                ++matches;
+                if (!sink.onLine(done.lines[j], done.offsets[j],
+                                 done.text.data() + begin,
+                                 done.ends[j] - begin))
+                    return false;
+                begin = done.ends[j];
+            }
+            return true;
+        });
+        return matches;
+    }
+
+    // Split spans of lines at the line checkpoints, so each part starts at or
+    // after an access point and can be decoded independently.
+    std::vector<std::pair<uint64_t, uint64_t>> splitAtCheckpoints(
+            const std::vector<std::pair<uint64_t, uint64_t>> &spans) {
+        std::vector<uint64_t> checkpoints;
+        auto stmt = statements_.get(
+                "SELECT line FROM LineCheckpoints ORDER BY line");
+        while (!stmt->step())
+            checkpoints.push_back(static_cast<uint64_t>(stmt->columnInt64(0)));
+        std::vector<std::pair<uint64_t, uint64_t>> parts;
+        for (auto &span : spans) {
+            auto first = span.first;
+            auto checkpoint = std::upper_bound(checkpoints.begin(),
+                                               checkpoints.end(), first);
+            for (; checkpoint != checkpoints.end() && *checkpoint <= span.second;
+                   ++checkpoint) {
+                parts.emplace_back(first, *checkpoint - 1);
+                first = *checkpoint;
+            }
+            parts.emplace_back(first, span.second);
+        }
+        return parts;
+    }
+
+    Index::Cursor cursorGrep(const std::string &regex,
+                             const Index::GrepOptions &options) {
+        struct LineNumbers : LineSink {
+            PostingList lines;
+
+            bool onLine(size_t lineNumber, size_t, const char *,
+                        size_t) override {
+                lines.push_back(lineNumber);
+                return true;
+            }
+        } lineNumbers;
+        grep(regex, lineNumbers, options);
+        return listCursor(std::move(lineNumbers.lines));
+    }
+
+    // Make another reader on the same files, as Index::reader does.
+    std::unique_ptr<Impl> reader() const {
+        Sqlite db(log_);
+        db.open(shared_->indexFilename.c_str(), true);
+        return std::unique_ptr<Impl>(new Impl(log_, shared_, std::move(db)));
+    }
+
+    // The spans of lines a regex could match: with a trigram index, the blocks
+    // of lines with all the trigrams of any one of its alternatives, and
+    // otherwise the whole file.
+    std::vector<std::pair<uint64_t, uint64_t>> grepSpans(
+            const std::string &regex) {
+        auto numLines = this->numLines();
+        auto blockLines = shared_->trigramBlockLines;
+        std::vector<std::pair<uint64_t, uint64_t>> spans;
+        std::vector<std::vector<Trigram>> alternatives;
+        if (!blockLines || !requiredTrigrams(regex, alternatives)) {
+            if (numLines) spans.emplace_back(1, numLines);
+            return spans;
+        }
+        auto stmt = statements_.get(
+                "SELECT blocks FROM Trigrams WHERE trigram = :trigram");
+        PostingList blocks;
+        for (auto &alternative : alternatives) {
+            PostingList found;
+            for (size_t i = 0; i < alternative.size(); ++i) {
+                stmt->reset();
+                stmt->bindInt64(":trigram", alternative[i]);
+                PostingList trigramBlocks;
+                if (!stmt->step())
+                    PostingDecoder(stmt->columnBlobView(0))
+                            .decodeInto(trigramBlocks);
+                found = i ? intersect(found, trigramBlocks)
+                          : std::move(trigramBlocks);
+                if (found.empty()) break;
+            }
+            blocks = unite(blocks, found);
+        }
+        log_.debug("Trigrams narrow the search to ", blocks.size(),
+                   " blocks of ", blockLines, " lines");
+        for (auto block : blocks) {
+            auto first = block * blockLines + 1;
+            auto last = std::min(first + blockLines - 1, numLines);
+            if (!spans.empty() && spans.back().second + 1 == first)
+                spans.back().second = last;
+            else
+                spans.emplace_back(first, last);
+        }
+        return spans;
+    }
+
+    // Decode a range of lines in one pass, splitting them out of the stream
+    // from the nearest line checkpoint if we can, so even lines missing from
+    // a sparse index are found.
+    size_t scanRange(uint64_t first, uint64_t last, LineSink &sink) {
+        if (shared_->scannable) return scanLineRange(first, last, sink);
+        return getLineRange(first, last, sink);
+    }
+
+    // Decompress lines first to last as they are in the file, as
+    // Index::cat does.
+    uint64_t cat(uint64_t first, uint64_t last,
+                 const Index::BlockFunction &output, unsigned jobs) {
+        loadAccessPoints();
+        auto &accessPoints = shared_->accessPoints;
+        auto numLines = this->numLines();
+        first = std::max<uint64_t>(first, 1);
+        if (accessPoints.empty() || first > last || first > numLines) return 0;
+        auto fileEnd = accessPoints.back().uncompressedEndOffset + 1;
+        auto from = first == 1 ? 0 : lineOffset(first);
+        auto to = last >= numLines ? fileEnd : lineOffset(last + 1);
+        auto parts = catParts(from, to);
+        uint64_t bytes = 0;
+        auto emit = [&](const std::vector<uint8_t> &buffer) {
+            output(reinterpret_cast<const char *>(buffer.data()),
+                   buffer.size());
+            bytes += buffer.size();
+        };
+        std::vector<uint8_t> buffer;
+        if (jobs <= 1 || parts.size() <= 1) {
+            for (auto &part : parts) streamBytes(part.first, part.second,
+                                                 buffer, emit);
+            return bytes;
+        }
+        jobs = static_cast<unsigned>(std::min<size_t>(jobs, parts.size()));
+        std::vector<std::unique_ptr<Impl>> readers;
+        for (unsigned i = 0; i < jobs; ++i) readers.emplace_back(reader());
+        log_.debug("Decompressing on ", jobs, " threads");
+        // No more parts than this are in hand at once, so their buffers are
+        // reused in turn rather than allocated afresh for each.
+        auto inFlight = jobs * 2u;
+        std::vector<std::vector<uint8_t>> buffers(inFlight);
+        std::vector<std::string> errors(inFlight);
+        auto oversized = [&](size_t i) {
+            return parts[i].second - parts[i].first > MaxCatBlock;
+        };
+        forEachInParallel(parts.size(), jobs, [&](size_t worker, size_t i) {
+            // A gap too big to hold at once is streamed out in turn instead,
+            // while the workers get on with the parts after it.
+            if (oversized(i)) return;
+            try {
+                readers[worker]->readBytes(parts[i].first, parts[i].second,
+                                           buffers[i % inFlight]);
+            } catch (const std::exception &e) {
+                errors[i % inFlight] = e.what();
+            }
+        }, [&](size_t i) {
+            if (oversized(i)) {
+                streamBytes(parts[i].first, parts[i].second, buffer, emit);
+                return true;
+            }
+            if (!errors[i % inFlight].empty())
+                throw std::runtime_error(errors[i % inFlight]);
+            emit(buffers[i % inFlight]);
+            return true;
+        });
+        return bytes;
+    }
+
+    // Split the bytes from offset from up to to into parts to be decompressed
+    // independently, each starting at an access point (bar the first, which
+    // starts at from). Runs of small gaps between access points are merged
+    // into parts up to the size of the largest gap, but at least MinCatBlock
+    // long where they can be, so they're written out without being copied,
+    // and at most MaxCatBlock long, bounding the memory they take. Gaps
+    // bigger than that are parts of their own, as starting a part part-way
+    // through one would mean decompressing everything before it again.
+    std::vector<std::pair<uint64_t, uint64_t>> catParts(uint64_t from,
+                                                        uint64_t to) {
+        std::vector<std::pair<uint64_t, uint64_t>> gaps;
+        uint64_t largest = 0;
+        for (auto &accessPoint : shared_->accessPoints) {
+            auto begin = std::max(from, accessPoint.uncompressedOffset);
+            auto end = std::min(to, accessPoint.uncompressedEndOffset + 1);
+            if (begin >= end) continue;
+            gaps.emplace_back(begin, end);
+            largest = std::max(largest, end - begin);
+        }
+        auto blockSize = std::min(std::max(largest, MinCatBlock), MaxCatBlock);
+        std::vector<std::pair<uint64_t, uint64_t>> parts;
+        for (auto &gap : gaps) {
+            // Decompression carries straight on from one gap into the next.
+            if (!parts.empty() && parts.back().second == gap.first
+                && gap.second - parts.back().first <= blockSize)
+                parts.back().second = gap.second;
+            else
+                parts.push_back(gap);
+        }
+        log_.debug("Decompressing ", PrettyBytes(to - from), " in ",
+                   parts.size(), " parts, merging gaps up to ",
+                   PrettyBytes(blockSize));
+        return parts;
+    }
+
+    // The offset at which a line starts.
+    uint64_t lineOffset(uint64_t line) {
+        if (!shared_->lineCheckpoints) {
+            lineQuery_.reset();
+            lineQuery_.bindInt64(":line", line);
+            if (!lineQuery_.step())
+                return static_cast<uint64_t>(lineQuery_.columnInt64(0));
+        }
+        auto context = shared_->scannable ? contextForLine(line) : nullptr;
+        if (!context)
+            throw std::runtime_error("Line " + std::to_string(line)
+                                     + " is not in the index");
+        auto offset = context->uncompressedOffset_;
+        recycle(std::move(cachedContext_));
+        cachedContext_ = std::move(context);
+        return offset;
+    }
+
+    // Decompress the bytes from offset up to end in a single pass, passing
+    // them to the function in turn in blocks of no more than MaxCatBlock,
+    // each read into the buffer.
+    template<typename Emit>
+    void streamBytes(uint64_t offset, uint64_t end,
+                     std::vector<uint8_t> &buffer, Emit emit) {
+        auto context = contextFor(offset);
+        context->line_ = 0;
+        while (offset < end) {
+            buffer.resize(std::min(end - offset, MaxCatBlock));
+            auto numRead = read(context, buffer.data(), buffer.size());
+            if (numRead != buffer.size())
+                throw std::runtime_error("Unexpected end of compressed data");
+            emit(buffer);
+            offset += numRead;
+        }
+        cachedContext_ = std::move(context);
+    }
+
+    // Decompress the bytes from offset up to end into the buffer.
+    void readBytes(uint64_t offset, uint64_t end,
+                   std::vector<uint8_t> &buffer) {
+        buffer.resize(end - offset);
+        auto context = contextFor(offset);
+        auto numRead = read(context, buffer.data(), buffer.size());
+        context->line_ = 0;
+        cachedContext_ = std::move(context);
+        if (numRead != buffer.size())
+            throw std::runtime_error("Unexpected end of compressed data");
+    }
+
+    size_t indexSize(const std::string &index) {
+        return storage(index).size();
+    }
+
+    // Return a context positioned at the given offset, reusing the cached
+    // context if it's close enough.
+    std::unique_ptr<CachedContext> contextFor(size_t offset) {
+        std::unique_ptr<CachedContext> context;
+        if (cachedContext_ && cachedContext_->offsetWithinRange(offset)) {
+            // We can reuse the previous context.
+            log_.debug("Reusing previous context");
+            context = std::move(cachedContext_);
+        } else {
+            recycle(std::move(cachedContext_));
+            context = newContext(offset);
+            if (!context)
+                throw std::runtime_error(
+                        "No access point for offset " + std::to_string(offset));
+        }
+        if (offset != context->uncompressedOffset_) {
+            skip(context, offset - context->uncompressedOffset_);
+            context->line_ = 0;
+        }
+        return context;
+    }
+
+    // Find the closest access point at or before the given offset, or return
+    // nullptr if there isn't one.
+    const AccessPoint *accessPointFor(size_t offset) {
+        loadAccessPoints();
+        auto it = std::upper_bound(
+                shared_->accessPoints.begin(), shared_->accessPoints.end(), offset,
+                [](size_t offset, const AccessPoint &ap) {
+                    return offset < ap.uncompressedOffset;
+                });
+        if (it == shared_->accessPoints.begin()) return nullptr;
+        return &*--it;
+    }
+
+    // Create a context at the closest access point at or before the given
+    // offset, or return nullptr if there isn't one.
+    std::unique_ptr<CachedContext> newContext(size_t offset) {
+        auto accessPoint = accessPointFor(offset);
+        if (!accessPoint) return nullptr;
+        auto compressedOffset = accessPoint->compressedOffset;
+        auto bitOffset = accessPoint->bitOffset;
+        log_.debug("Creating new context at offset ", compressedOffset, ":",
+                   bitOffset);
+        std::unique_ptr<CachedContext> context;
+        if (spareContexts_.empty()) {
+            context.reset(new CachedContext(accessPoint->uncompressedOffset,
+                                            shared_->blockSize));
+        } else {
+            context = std::move(spareContexts_.back());
+            spareContexts_.pop_back();
+            context->reset(accessPoint->uncompressedOffset, shared_->blockSize);
+        }
+
+        context->compressedOffset_ = compressedOffset;
+        context->zs_.stream.avail_in = 0;
+        if (bitOffset) {
+            uint8_t c;
+            auto numRead = ::pread(fd_, &c, 1, compressedOffset - 1);
+            if (numRead != 1)
+                throw ZlibError(numRead < 0 ? Z_ERRNO : Z_DATA_ERROR);
+            X(inflatePrime(&context->zs_.stream,
+                           bitOffset, c >> (8 - bitOffset)));
+        }
+        // Access points at the start of a gzip member have no window: nothing
+        // before them can be referred to.
+        windowQuery_.reset();
+        windowQuery_.bindInt64(":offset", accessPoint->uncompressedOffset);
+        if (windowQuery_.step())
+            throw std::runtime_error("Unable to find access point window");
+        auto compressedWindow = windowQuery_.columnBlobView(0);
+        if (compressedWindow.length()) {
+            uint8_t window[WindowSize];
+            uncompress(compressedWindow, window, WindowSize);
+            X(inflateSetDictionary(&context->zs_.stream,
+                                   &window[0], WindowSize));
+        }
+        return context;
+    }
+
+    // Return a context no longer needed to the pool for reuse.
+    void recycle(std::unique_ptr<CachedContext> &&context) {
+        if (context && spareContexts_.size() < MaxSpareContexts)
+            spareContexts_.emplace_back(std::move(context));
+        context.reset();
+    }
+
+    // Ensure the context has some decompressed data available, decompressing
+    // more if needed. Returns false at the end of the file.
+    bool fill(std::unique_ptr<CachedContext> &context) {
+        if (context->available()) return true;
+        if (context->streamEnded_) {
+            // gzip allows for multiple gzip files to be concatenated together
+            // and says they should be treated as a single file. As we opened
+            // the stream in RAW mode we can't continue decoding from here: the
+            // decoder doesn't know if there's a trailing CRC or similar here.
+            // The indexer always puts an access point at the start of each
+            // stream though, so we carry on from there (if there is one).
+            auto offset = context->uncompressedOffset_;
+            auto line = context->line_;
+            auto accessPoint = accessPointFor(offset);
+            if (!accessPoint || accessPoint->uncompressedOffset != offset)
+                return false;
+            auto next = newContext(offset);
+            log_.debug("Moving to the next stream at offset ", offset);
+            next->line_ = line;
+            recycle(std::move(context));
+            context = std::move(next);
+        }
+        auto &zs = context->zs_;
+        zs.stream.next_out = context->output_;
+        zs.stream.avail_out = WindowSize;
+        while (zs.stream.avail_out) {
+            if (zs.stream.avail_in == 0) {
+                auto numRead = ::pread(fd_, context->input_,
+                                       sizeof(context->input_),
+                                       context->compressedOffset_);
+                if (numRead < 0) throw ZlibError(Z_ERRNO);
+                if (numRead == 0) throw ZlibError(Z_DATA_ERROR);
+                context->compressedOffset_ += numRead;
+                zs.stream.avail_in = numRead;
+                zs.stream.next_in = context->input_;
+            }
+            auto ret = inflate(&zs.stream, Z_NO_FLUSH);
+            if (ret == Z_NEED_DICT) throw ZlibError(Z_DATA_ERROR);
+            if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
+                throw ZlibError(ret);
+            if (ret == Z_STREAM_END) {
+                context->streamEnded_ = true;
+                break;
+            }
+        }
+        context->outputBegin_ = context->output_;
+        context->outputEnd_ = zs.stream.next_out;
+        return context->available() || fill(context);
+    }
+
+    // Skip over the given number of bytes, which must exist.
+    void skip(std::unique_ptr<CachedContext> &context, size_t bytes) {
+        while (bytes) {
+            if (!fill(context))
+                throw std::runtime_error("Unexpected end of compressed data");
+            auto toSkip = std::min(bytes, context->available());
+            context->consume(toSkip);
+            bytes -= toSkip;
+        }
+    }
+
+    // Skip over the given number of lines. Returns false if the end of the file
+    // is reached first.
+    bool skipLines(std::unique_ptr<CachedContext> &context, uint64_t lines) {
+        while (lines) {
+            if (!fill(context)) return false;
+            auto begin = context->outputBegin_;
+            auto available = context->available();
+            auto numNewlines = countNewlines(begin, available);
+            if (numNewlines < lines) {
+                context->consume(available);
+                context->line_ += numNewlines;
+                lines -= numNewlines;
+            } else {
+                auto newline = findNewline(begin, available, lines);
+                context->consume(newline + 1 - begin);
+                context->line_ += lines;
+                lines = 0;
             }
         }
+        return true;
     }
 
-    bool getLine(uint64_t line, LineSink &sink) {
-        lineQuery_.reset();
-        lineQuery_.bindInt64(":line", line);
-        if (lineQuery_.step()) return false;
-        print(lineQuery_, sink);
-        return true;
+    // Read up to the given number of bytes, returning the number read, which
+    // will only be fewer than asked for at the end of the file.
+    size_t read(std::unique_ptr<CachedContext> &context, uint8_t *to,
+                size_t bytes) {
+        size_t numRead = 0;
+        while (numRead < bytes && fill(context)) {
+            auto toRead = std::min(bytes - numRead, context->available());
+            memcpy(to + numRead, context->outputBegin_, toRead);
+            context->consume(toRead);
+            numRead += toRead;
+        }
+        return numRead;
     }
+};
+
+// A table with a row for each key on each line, which may be clustered, or a
+// view of one whose keys are dictionary encoded.
+struct Index::Impl::TableStorage : Storage {
+    using Storage::Storage;
 
-    size_t queryIndex(const std::string &index, const std::string &query,
-                      LineFunction lineFunc) {
-        auto stmt = db_.prepare(R"(
+    Index::Cursor cursor(const std::string &key) override {
+        auto stmt = impl.statements_.get(R"(
 SELECT line FROM index_)" + index + R"(
 WHERE key = :query
 )");
-        stmt.bindString(":query", query);
-        size_t matches = 0;
-        for (;;) {
-            if (stmt.step()) return matches;
-            lineFunc(stmt.columnInt64(0));
-            ++matches;
+        stmt->bindString(":query", key);
+        return statementCursor(std::move(stmt));
+    }
+
+    Index::Cursor cursorAny(const std::vector<std::string> &keys) override {
+        impl.loadQueryKeys(index, keys);
+        return statementCursor(impl.statements_.get(R"(
+SELECT DISTINCT line FROM index_)" + index + R"( AS i
+JOIN QueryKeys AS q ON i.key = q.key
+ORDER BY line
+)"));
+    }
+
+    size_t count(const std::string &key) override {
+        auto stmt = impl.statements_.get(R"(
+SELECT COUNT(*) FROM index_)" + index + R"(
+WHERE key = :query
+)");
+        stmt->bindString(":query", key);
+        if (stmt->step()) return 0;
+        return static_cast<size_t>(stmt->columnInt64(0));
+    }
+
+    size_t countAny(const std::vector<std::string> &keys) override {
+        impl.loadQueryKeys(index, keys);
+        auto stmt = impl.statements_.get(R"(
+SELECT COUNT(DISTINCT line) FROM index_)" + index + R"( AS i
+JOIN QueryKeys AS q ON i.key = q.key
+)");
+        if (stmt->step()) return 0;
+        return static_cast<size_t>(stmt->columnInt64(0));
+    }
+
+    PostingList lines(const Query::Term &term) override {
+        PostingList lines;
+        if (!impl.zoneLines(term, lines)) {
+            auto stmt = impl.termStatement("line", term);
+            while (!stmt->step())
+                lines.emplace_back(stmt->columnInt64(0));
         }
+        std::sort(lines.begin(), lines.end());
+        lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+        return lines;
+    }
+
+    size_t count(const Query::Term &term, bool distinct) override {
+        auto stmt = impl.termStatement(
+                distinct ? "COUNT(DISTINCT line)" : "COUNT(*)", term);
+        if (stmt->step()) return 0;
+        return static_cast<size_t>(stmt->columnInt64(0));
     }
 
-    size_t customQuery(const std::string &customQuery, LineFunction lineFunc) {
-        auto stmt = db_.prepare(customQuery);
+    size_t lineKeys(const std::vector<uint64_t> &lines,
+                    LineKeyFunction lineKeyFunction) override {
+        auto &db = impl.db_;
+        db.exec(R"(
+CREATE TEMP TABLE IF NOT EXISTS QueryLines(line PRIMARY KEY) WITHOUT ROWID)");
+        db.exec("BEGIN");
+        try {
+            db.exec("DELETE FROM QueryLines");
+            auto addLine = impl.statements_.get(
+                    "INSERT OR IGNORE INTO QueryLines VALUES(:line)");
+            for (auto line : lines) {
+                addLine->reset();
+                addLine->bindInt64(":line", line);
+                addLine->step();
+            }
+        } catch (...) {
+            db.exec("ROLLBACK");
+            throw;
+        }
+        db.exec("COMMIT");
+        auto stmt = impl.statements_.get(R"(
+SELECT q.line, MIN(i.key) FROM QueryLines AS q
+JOIN index_)" + index + R"( AS i ON i.line = q.line
+GROUP BY q.line
+ORDER BY q.line
+)");
         size_t matches = 0;
-        for (;;) {
-            if (stmt.step()) return matches;
-            lineFunc(stmt.columnInt64(0));
+        while (!stmt->step()) {
+            lineKeyFunction(static_cast<uint64_t>(stmt->columnInt64(0)),
+                            stmt->columnInt64(1));
             ++matches;
         }
         return matches;
     }
 
-    size_t indexSize(const std::string &index) const {
-        auto stmt = db_.prepare("SELECT COUNT(*) FROM index_" + index);
-        if (stmt.step()) return 0;
-        return static_cast<size_t>(stmt.columnInt64(0));
+    size_t size() override {
+        auto stmt = impl.statements_.get("SELECT COUNT(*) FROM index_" + index);
+        if (stmt->step()) return 0;
+        return static_cast<size_t>(stmt->columnInt64(0));
     }
+};
 
-    void print(Sqlite::Statement &q, LineSink &sink) {
-        auto line = static_cast<size_t>(q.columnInt64(0));
-        auto offset = static_cast<size_t>(q.columnInt64(1));
-        // We use and update context while in here. Only if we successfully
-        // decode a line do we save it in the cachedContext_ for a subsequent
-        // call.
-        std::unique_ptr<CachedContext> context;
-        if (cachedContext_ && cachedContext_->offsetWithinRange(offset)) {
-            // We can reuse the previous context.
-            log_.debug("Reusing previous context");
-            context = std::move(cachedContext_);
-        } else {
-            auto compressedOffset = static_cast<size_t>(q.columnInt64(2));
-            auto uncompressedOffset = static_cast<size_t>(q.columnInt64(3));
-            auto bitOffset = static_cast<int>(q.columnInt64(5));
-            log_.debug("Creating new context at offset ", compressedOffset, ":",
-                       bitOffset);
-            context.reset(new CachedContext(uncompressedOffset, blockSize_));
-            uint8_t window[WindowSize];
-            uncompress(q.columnBlob(6), window, WindowSize);
-
-            seek(compressed_, bitOffset ? compressedOffset - 1
-                                        : compressedOffset);
-            context->zs_.stream.avail_in = 0;
-            if (bitOffset) {
-                auto c = fgetc(compressed_.get());
-                if (c == -1)
-                    throw ZlibError(ferror(compressed_.get()) ?
-                                    Z_ERRNO : Z_DATA_ERROR);
-                X(inflatePrime(&context->zs_.stream,
-                               bitOffset, c >> (8 - bitOffset)));
-            }
-            X(inflateSetDictionary(&context->zs_.stream,
-                                   &window[0], WindowSize));
-        }
-        uint8_t discardBuffer[WindowSize];
+// A table of the keys on every so many lines, in order, the lines between
+// which are scanned for the keys.
+struct Index::Impl::SampledStorage : TableStorage {
+    using TableStorage::TableStorage;
 
-        auto length = q.columnInt64(4);
-        constexpr auto MaxLength = 64u * 1024 * 1024;
-        if (length >= MaxLength) throw std::runtime_error("Line too long!");
-        std::unique_ptr<uint8_t[]> lineBuf(new uint8_t[length]);
+    Index::Cursor cursor(const std::string &key) override {
+        return listCursor(impl.sampledLines(index, {key}));
+    }
 
-        auto numToSkip = offset - context->uncompressedOffset_;
-        bool skipping = true;
-        auto &zs = context->zs_;
-        do {
-            if (numToSkip == 0 && skipping) {
-                zs.stream.avail_out = static_cast<uInt>(length);
-                zs.stream.next_out = lineBuf.get();
-                skipping = false;
-            }
-            if (numToSkip > WindowSize) {
-                zs.stream.avail_out = WindowSize;
-                zs.stream.next_out = discardBuffer;
-                numToSkip -= WindowSize;
-            } else if (numToSkip) {
-                zs.stream.avail_out = (uInt)numToSkip;
-                zs.stream.next_out = discardBuffer;
-                numToSkip = 0;
-            }
-            do {
-                if (zs.stream.avail_in == 0) {
-                    zs.stream.avail_in = ::fread(context->input_, 1,
-                                                 sizeof(context->input_),
-                                                 compressed_.get());
-                    if (ferror(compressed_.get())) throw ZlibError(Z_ERRNO);
-                    if (zs.stream.avail_in == 0) throw ZlibError(Z_DATA_ERROR);
-                    zs.stream.next_in = context->input_;
-                }
-                auto availBefore = zs.stream.avail_out;
-                auto ret = inflate(&zs.stream, Z_NO_FLUSH);
-                if (ret == Z_NEED_DICT) throw ZlibError(Z_DATA_ERROR);
-                if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
-                    throw ZlibError(ret);
-                auto numUncompressed = availBefore - zs.stream.avail_out;
-                context->uncompressedOffset_ += numUncompressed;
-                if (ret == Z_STREAM_END) {
-                    // The end of the stream; but is it the end of the file?
-                    if (zs.stream.avail_in == 0 && feof(compressed_.get()))
-                        break; // yes: we're done
-                    // Else, we're going to restart the decompressor: gzip
-                    // allows for multiple gzip files to be concatenated
-                    // together and says they should be treated as a single
-                    // file.
-                    log_.debug("Resetting stream at EOS at offset ",
-                               context->uncompressedOffset_);
-                    // As we opened the stream in RAW mode we can't continue
-                    // decoding from here: the decoder doesn't know if there's
-                    // a trailing CRC or similar here. So we have to throw away
-                    // state at this point. We know the indexer always stops us
-                    // from crossing a divide here. We check we weren't skipping
-                    // still (which we ought not to be...) and then chuck the
-                    // whole context out.  Ideally we'd skip the (optional?)
-                    // trailer and reset the zlib state back in normal, non-raw
-                    // mode and play on.
-                    if (skipping)
-                        throw std::runtime_error(
-                                "Tried to cross a gzip stream boundary");
-                    context.reset();
-                }
-            } while (zs.stream.avail_out);
-        } while (skipping);
-        // Save the context for next time.
-        cachedContext_ = std::move(context);
-        sink.onLine(line, offset, reinterpret_cast<const char *>(lineBuf.get()),
-                    length - 1);
+    Index::Cursor cursorAny(const std::vector<std::string> &keys) override {
+        return listCursor(impl.sampledLines(index, keys));
+    }
+
+    size_t count(const std::string &key) override {
+        return impl.sampledLines(index, {key}).size();
+    }
+
+    size_t countAny(const std::vector<std::string> &keys) override {
+        return impl.sampledLines(index, keys).size();
+    }
+
+    PostingList lines(const Query::Term &term) override {
+        return impl.sampledLines(term);
+    }
+
+    size_t count(const Query::Term &term, bool distinct) override {
+        if (distinct) return impl.sampledLines(term).size();
+        uint64_t first, last;
+        return impl.sampledSpan(term, first, last) ? last - first + 1 : 0;
+    }
+
+    size_t lineKeys(const std::vector<uint64_t> &lines,
+                    LineKeyFunction lineKeyFunction) override {
+        return impl.sampledLineKeys(index, lines, lineKeyFunction);
+    }
+};
+
+// A compressed list of lines for each key in each block of lines.
+struct Index::Impl::PostingStorage : Storage {
+    using Storage::Storage;
+
+    Index::Cursor cursor(const std::string &key) override {
+        return impl.postingCursor(index, key);
+    }
+
+    Index::Cursor cursorAny(const std::vector<std::string> &keys) override {
+        if (keys.size() == 1) return impl.postingCursor(index, keys[0]);
+        return listCursor(impl.postingLines(index, keys));
+    }
+
+    size_t count(const std::string &key) override {
+        auto stmt = impl.statements_.get("SELECT SUM(numLines) FROM index_"
+                                         + index + " WHERE key = :query");
+        stmt->bindString(":query", key);
+        if (stmt->step()) return 0;
+        return static_cast<size_t>(stmt->columnInt64(0));
+    }
+
+    size_t countAny(const std::vector<std::string> &keys) override {
+        return impl.postingLines(index, keys).size();
+    }
+
+    PostingList lines(const Query::Term &term) override {
+        return decodePostings(impl.termStatement("lines", term));
+    }
+
+    size_t count(const Query::Term &term, bool distinct) override {
+        // A line may be in the lists of several keys, so only a single key's
+        // count is exact without decoding the lists.
+        if (distinct && term.type != Query::Term::Type::Exact)
+            return lines(term).size();
+        auto stmt = impl.termStatement("SUM(numLines)", term);
+        if (stmt->step()) return 0;
+        return static_cast<size_t>(stmt->columnInt64(0));
+    }
+
+    size_t lineKeys(const std::vector<uint64_t> &lines,
+                    LineKeyFunction lineKeyFunction) override {
+        return impl.postingLineKeys(index, lines, lineKeyFunction);
+    }
+
+    size_t size() override {
+        auto stmt = impl.statements_.get("SELECT SUM(numLines) FROM index_"
+                                         + index);
+        if (stmt->step()) return 0;
+        return static_cast<size_t>(stmt->columnInt64(0));
+    }
+};
+
+// A table of the hash of each key on each line, the lines of which are
+// checked for the key itself.
+struct Index::Impl::HashedStorage : TableStorage {
+    using TableStorage::TableStorage;
+
+    Index::Cursor cursor(const std::string &key) override {
+        return listCursor(impl.hashedLines(index, {key}));
+    }
+
+    Index::Cursor cursorAny(const std::vector<std::string> &keys) override {
+        return listCursor(impl.hashedLines(index, keys));
+    }
+
+    size_t count(const std::string &key) override {
+        return impl.hashedLines(index, {key}).size();
+    }
+
+    size_t countAny(const std::vector<std::string> &keys) override {
+        return impl.hashedLines(index, keys).size();
+    }
+
+    PostingList lines(const Query::Term &term) override {
+        checkExact(term);
+        return impl.hashedLines(index, {term.key});
+    }
+
+    size_t count(const Query::Term &term, bool distinct) override {
+        // Lines with keys of the same hash only drop out once decoded.
+        if (distinct) return lines(term).size();
+        checkExact(term);
+        auto stmt = impl.statements_.get("SELECT COUNT(*) FROM index_" + index
+                                         + " WHERE key = :key");
+        stmt->bindInt64(":key", hashKey(term.key));
+        if (stmt->step()) return 0;
+        return static_cast<size_t>(stmt->columnInt64(0));
+    }
+
+    void checkExact(const Query::Term &term) const {
+        if (term.type != Query::Term::Type::Exact)
+            throw std::invalid_argument(
+                    "Only exact keys can be looked up in hashed index '"
+                    + index + "'");
     }
 };
+
+Index::Impl::Storage &Index::Impl::storage(const std::string &index) {
+    auto it = storages_.find(index);
+    if (it != storages_.end()) return *it->second;
+    const auto &info = indexInfo(index);
+    std::unique_ptr<Storage> storage;
+    if (info.sampled)
+        storage.reset(new SampledStorage(*this, index));
+    else if (info.postingLists)
+        storage.reset(new PostingStorage(*this, index));
+    else if (info.hashed)
+        storage.reset(new HashedStorage(*this, index));
+    else
+        storage.reset(new TableStorage(*this, index));
+    return *storages_.emplace(index, std::move(storage)).first->second;
+}
+
 Index::Index() { }
 
 Index::~Index() {}
@@ -462,13 +2345,18 @@ struct Index::Builder::Impl : LineSink {
     Sqlite::Statement addMetaSql;
     uint64_t indexEvery = DefaultIndexEvery;
     std::unordered_map<std::string, std::unique_ptr<IndexHandler>> indexers;
+    std::unordered_map<std::string, SampledHandler *> sampledIndexers;
+    // The uncompressed offset of each access point made so far.
+    std::vector<uint64_t> accessPoints;
     bool saveAllLines_;
+    bool storeLineOffsets = true;
+    std::unique_ptr<TrigramBlocks> trigrams;
 
     Impl(Log &log, File &&from, const std::string &fromPath,
          const std::string &indexFilename)
             : log(log), from(std::move(from)), fromPath(fromPath),
               indexFilename(indexFilename), skipFirst(0), db(log),
-              addIndexSql(log), addMetaSql(log), saveAllLines_{false} {}
+              addIndexSql(log), addMetaSql(log), saveAllLines_{true} {}
 
     void init() {
         auto file = db.toFile(indexFilename);
@@ -504,23 +2392,20 @@ CREATE TABLE Metadata(
         }
         addMeta("compressedSize", std::to_string(stats.st_size));
         addMeta("compressedModTime", std::to_string(stats.st_mtime));
-        addMeta("sparse", std::to_string(!saveAllLines_));
-
-        db.exec(R"(
-CREATE TABLE LineOffsets(
-    line INTEGER PRIMARY KEY,
-    offset INTEGER,
-    length INTEGER
-))");
 
         db.exec(R"(
 CREATE TABLE Indexes(
     name TEXT PRIMARY KEY,
     creationString TEXT,
-    isNumeric INTEGER
+    isNumeric INTEGER,
+    isSampled INTEGER,
+    indexerConfig TEXT,
+    isPostingList INTEGER,
+    isHashed INTEGER
 ))");
         addIndexSql = db.prepare(R"(
-INSERT INTO Indexes VALUES(:name, :creationString, :isNumeric)
+INSERT INTO Indexes VALUES(:name, :creationString, :isNumeric, :isSampled,
+                           :indexerConfig, :isPostingList, :isHashed)
 )");
     }
 
@@ -530,15 +2415,36 @@ INSERT INTO Indexes VALUES(:name, :creationString, :isNumeric)
         struct stat compressedStat;
         if (fstat(fileno(from.get()), &compressedStat) != 0)
             throw ZlibError(Z_DATA_ERROR);
+        if (!storeLineOffsets && !saveAllLines_)
+            throw std::runtime_error(
+                    "Sparse indexes need line offsets to be stored");
 
         db.exec(R"(BEGIN TRANSACTION)");
 
+        if (storeLineOffsets) {
+            db.exec(R"(
+CREATE TABLE LineOffsets(
+    line INTEGER PRIMARY KEY,
+    offset INTEGER,
+    length INTEGER
+))");
+        }
+        // The first line starting in each access point.
+        db.exec(R"(
+CREATE TABLE LineCheckpoints(
+    line INTEGER PRIMARY KEY,
+    offset INTEGER
+))");
+        addMeta("lineIndex", storeLineOffsets ? "offsets" : "checkpoints");
+        // Only known once the indexers have been added.
+        addMeta("sparse", std::to_string(!saveAllLines_));
+
         auto addIndex = db.prepare(R"(
 INSERT INTO AccessPoints VALUES(
 :uncompressedOffset, :uncompressedEndOffset,
 :compressedOffset, :bitOffset, :window))");
-        auto addLine = db.prepare(R"(
-INSERT INTO LineOffsets VALUES(:line, :offset, :length))");
+        auto addCheckpoint = db.prepare(R"(
+INSERT OR IGNORE INTO LineCheckpoints VALUES(:line, :offset))");
 
         ZStream zs(ZStream::Type::ZlibOrGzip);
         uint8_t input[ChunkSize];
@@ -551,6 +2457,7 @@ INSERT INTO LineOffsets VALUES(:line, :offset, :length))");
         uint64_t totalIn = 0;
         uint64_t totalOut = 0;
         uint64_t last = 0;
+        uint64_t streamStart = 0;
         bool first = true;
         bool emitInitialAccessPoint = true;
         LineFinder finder(*this);
@@ -605,14 +2512,21 @@ INSERT INTO LineOffsets VALUES(:line, :offset, :length))");
                                 .step();
                         addIndex.reset();
                     }
-                    uint8_t apWindow[compressBound(WindowSize)];
-                    auto size = makeWindow(apWindow, sizeof(apWindow), window,
-                                           zs.stream.avail_out);
                     addIndex
                             .bindInt64(":uncompressedOffset", totalOut)
                             .bindInt64(":compressedOffset", totalIn)
-                            .bindInt64(":bitOffset", zs.stream.data_type & 0x7)
-                            .bindBlob(":window", apWindow, size);
+                            .bindInt64(":bitOffset", zs.stream.data_type & 0x7);
+                    if (totalOut == streamStart) {
+                        // Nothing in this stream precedes us, so there's no
+                        // need for a window.
+                        addIndex.bindBlob(":window", nullptr, 0);
+                    } else {
+                        uint8_t apWindow[compressBound(WindowSize)];
+                        auto size = makeWindow(apWindow, sizeof(apWindow),
+                                               window, zs.stream.avail_out);
+                        addIndex.bindBlob(":window", apWindow, size);
+                    }
+                    accessPoints.emplace_back(totalOut);
                     last = totalOut;
                     emitInitialAccessPoint = false;
                 }
@@ -630,6 +2544,7 @@ INSERT INTO LineOffsets VALUES(:line, :offset, :length))");
                 // and it can use RAW mode in all cases.
                 ret = 0;
                 zs.reset();
+                streamStart = totalOut;
                 emitInitialAccessPoint = true;
                 clearWindow();
             }
@@ -646,22 +2561,188 @@ INSERT INTO LineOffsets VALUES(:line, :offset, :length))");
 
         finder.add(window, WindowSize - zs.stream.avail_out, true);
         const auto &lineOffsets = finder.lineOffsets();
-        for (size_t line = 0; line < lineOffsets.size() - 1; ++line) {
-            addLine
+        if (storeLineOffsets) {
+            auto addLine = db.prepare(R"(
+INSERT INTO LineOffsets VALUES(:line, :offset, :length))");
+            for (size_t line = 0; line < lineOffsets.size() - 1; ++line) {
+                addLine
+                        .reset()
+                        .bindInt64(":line", line + 1)
+                        .bindInt64(":offset", lineOffsets[line])
+                        .bindInt64(":length",
+                                   lineOffsets[line + 1] - lineOffsets[line])
+                        .step();
+                progress.update<size_t>(line, lineOffsets.size() - 1);
+            }
+        }
+        auto linesEnd = lineOffsets.end() - 1;
+        std::vector<uint64_t> checkpointLines;
+        for (auto accessPoint : accessPoints) {
+            auto firstLine = std::lower_bound(lineOffsets.begin(), linesEnd,
+                                              accessPoint);
+            if (firstLine == linesEnd) break;
+            uint64_t line = firstLine - lineOffsets.begin() + 1;
+            addCheckpoint
                     .reset()
-                    .bindInt64(":line", line + 1)
-                    .bindInt64(":offset", lineOffsets[line])
-                    .bindInt64(":length",
-                               lineOffsets[line + 1] - lineOffsets[line])
+                    .bindInt64(":line", line)
+                    .bindInt64(":offset", *firstLine)
                     .step();
-            progress.update<size_t>(line, lineOffsets.size() - 1);
+            if (checkpointLines.empty() || checkpointLines.back() != line)
+                checkpointLines.push_back(line);
         }
 
+        addMeta("numLines", std::to_string(lineOffsets.size() - 1));
+        for (auto &indexer : indexers) indexer.second->finish();
+        if (trigrams) addTrigrams();
+        summariseKeys();
+        buildZoneMaps(checkpointLines, lineOffsets.size() - 1);
+
         log.info("Flushing");
         db.exec(R"(END TRANSACTION)");
         log.info("Done");
     }
 
+    // Store the blocks of lines each trigram is in, so grep can skip blocks
+    // which can't match.
+    void addTrigrams() {
+        log.info("Storing trigrams");
+        trigrams->finish();
+        db.exec(R"(
+CREATE TABLE Trigrams(
+    trigram INTEGER PRIMARY KEY,
+    blocks BLOB
+))");
+        addMeta("trigramBlockLines", std::to_string(trigrams->blockLines()));
+        auto addTrigram = db.prepare(
+                "INSERT INTO Trigrams VALUES(:trigram, :blocks)");
+        for (auto &entry : trigrams->blocks()) {
+            addTrigram
+                    .reset()
+                    .bindInt64(":trigram", entry.first)
+                    .bindBlob(":blocks", entry.second.bytes().data(),
+                              entry.second.bytes().size())
+                    .step();
+        }
+    }
+
+    // Summarise the keys of each sub-index, so whole files can be ruled out of
+    // a query without searching their indexes.
+    void summariseKeys() {
+        log.info("Summarising keys");
+        db.exec(R"(
+CREATE TABLE KeySummaries(
+    name TEXT PRIMARY KEY,
+    numKeys INTEGER,
+    minKey TEXT,
+    maxKey TEXT,
+    bloomHashes INTEGER,
+    bloom BLOB
+))");
+        auto addSummary = db.prepare(R"(
+INSERT INTO KeySummaries VALUES(:name, :numKeys, :minKey, :maxKey,
+                                :bloomHashes, :bloom))");
+        // A hashed index has no keys to summarise, only their hashes, so is
+        // left out and never ruled out.
+        auto indexes = db.prepare("SELECT name FROM Indexes WHERE NOT isHashed");
+        while (!indexes.step()) {
+            auto table = "index_" + indexes.columnString(0);
+            auto range = db.prepare(R"(
+SELECT COUNT(DISTINCT key), COALESCE(MIN(key), ''), COALESCE(MAX(key), '')
+FROM )" + table);
+            range.step();
+            auto numKeys = static_cast<size_t>(range.columnInt64(0));
+            auto sampled = sampledIndexers.find(indexes.columnString(0));
+            // A sampled index has only its smallest and largest keys to go
+            // on; its empty filter rules nothing out.
+            BloomFilter filter("", 0);
+            if (sampled != sampledIndexers.end()) {
+                numKeys = sampled->second->numKeys;
+            } else {
+                filter = BloomFilter(numKeys, KeySummary::FalsePositiveRate);
+                // Numeric keys come back in their canonical decimal form.
+                auto keys = db.prepare("SELECT DISTINCT key FROM " + table);
+                while (!keys.step()) filter.add(keys.columnString(0));
+            }
+            addSummary
+                    .reset()
+                    .bindString(":name", indexes.columnString(0))
+                    .bindInt64(":numKeys", numKeys)
+                    .bindString(":minKey", range.columnString(1))
+                    .bindString(":maxKey", range.columnString(2))
+                    .bindInt64(":bloomHashes", filter.numHashes())
+                    .bindBlob(":bloom", filter.bits().data(),
+                              filter.bits().size())
+                    .step();
+        }
+    }
+
+    // Record the smallest and largest key of each numeric sub-index in each
+    // zone of lines between checkpoints, so range queries can tell which
+    // zones they need without searching the index row by row.
+    void buildZoneMaps(const std::vector<uint64_t> &checkpointLines,
+                       uint64_t numLines) {
+        log.info("Building zone maps");
+        db.exec(R"(
+CREATE TABLE ZoneMaps(
+    name TEXT,
+    firstLine INTEGER,
+    lastLine INTEGER,
+    minKey INTEGER,
+    maxKey INTEGER,
+    keyedLines INTEGER,
+    PRIMARY KEY(name, firstLine)
+))");
+        if (checkpointLines.empty()) return;
+        auto addZone = db.prepare(R"(
+INSERT INTO ZoneMaps VALUES(:name, :firstLine, :lastLine, :minKey, :maxKey,
+                            :keyedLines))");
+        auto indexes = db.prepare(
+                "SELECT name FROM Indexes WHERE isNumeric AND NOT isSampled"
+                " AND NOT isPostingList");
+        while (!indexes.step()) {
+            auto name = indexes.columnString(0);
+            size_t zone = 0;
+            int64_t minKey = 0, maxKey = 0;
+            uint64_t keyedLines = 0, prevLine = 0;
+            auto zoneEnd = [&](size_t zone) {
+                return zone + 1 < checkpointLines.size()
+                       ? checkpointLines[zone + 1] - 1 : numLines;
+            };
+            auto flush = [&] {
+                if (!keyedLines) return;
+                addZone
+                        .reset()
+                        .bindString(":name", name)
+                        .bindInt64(":firstLine",
+                                   zone ? checkpointLines[zone] : 1)
+                        .bindInt64(":lastLine", zoneEnd(zone))
+                        .bindInt64(":minKey", minKey)
+                        .bindInt64(":maxKey", maxKey)
+                        .bindInt64(":keyedLines", keyedLines)
+                        .step();
+                keyedLines = 0;
+            };
+            auto rows = db.prepare("SELECT line, key FROM index_" + name
+                                   + " ORDER BY line");
+            while (!rows.step()) {
+                auto line = static_cast<uint64_t>(rows.columnInt64(0));
+                auto key = rows.columnInt64(1);
+                if (line > zoneEnd(zone)) {
+                    flush();
+                    while (line > zoneEnd(zone)
+                           && zone + 1 < checkpointLines.size())
+                        ++zone;
+                }
+                if (!keyedLines) minKey = maxKey = key;
+                minKey = std::min(minKey, key);
+                maxKey = std::max(maxKey, key);
+                if (!keyedLines || line != prevLine) ++keyedLines;
+                prevLine = line;
+            }
+            flush();
+        }
+    }
+
     void addMeta(const std::string &key, const std::string &value) {
         log.debug("Adding metadata ", key, " = ", value);
         addMetaSql
@@ -675,34 +2756,109 @@ INSERT INTO LineOffsets VALUES(:line, :offset, :length))");
                     Index::IndexConfig config,
                     std::unique_ptr<LineIndexer> indexer) {
         saveAllLines_ = !config.sparse;
-        auto table = "index_" + name;
-        std::string type = config.numeric ? "INTEGER" : "TEXT";
-        if (config.unique) type += " PRIMARY KEY";
-        db.exec(R"(
+        if (config.dictionary
+            && (config.numeric || config.sampled || config.postingLists))
+            throw std::invalid_argument(
+                    "Index '" + name + "' can't be dictionary encoded: only "
+                    "plain non-numeric indexes can be");
+        if (config.hashed
+            && (config.numeric || config.sampled || config.postingLists
+                || config.dictionary))
+            throw std::invalid_argument(
+                    "Index '" + name + "' can't be hashed: only plain "
+                    "non-numeric indexes can be");
+        // A dictionary encoded index stores each line's key ids in a table of
+        // their own, and gives the usual index table as a view.
+        auto table = (config.dictionary ? "ids_" : "index_") + name;
+        std::string keyColumn = config.dictionary ? "keyId" : "key";
+        std::string type = config.numeric || config.dictionary || config.hashed
+                           ? "INTEGER" : "TEXT";
+        if (config.postingLists) {
+            if (config.sampled)
+                throw std::invalid_argument(
+                        "Index '" + name
+                        + "' can't be both sampled and stored as posting lists");
+            addPostingIndexer(name, creation, config, std::move(indexer));
+            return;
+        }
+        // A sampled table has at most one row per sampled line, so never
+        // needs a unique key constraint, even when samples share a key.
+        if (config.sampled) config.unique = false;
+        if (config.clustered) {
+            // The rows are stored in key order in the table's own B-tree, so
+            // a key lookup is a single range scan giving its lines in order.
+            // A key found twice on the same line is only stored once.
+            db.exec(R"(
+CREATE TABLE )" + table + R"((
+    )" + keyColumn + " " + type + R"(,
+    line INTEGER,
+    offset INTEGER,
+    PRIMARY KEY()" + keyColumn + (config.unique ? ")" : ", line)") + R"(
+) WITHOUT ROWID)");
+        } else {
+            if (config.unique) type += " PRIMARY KEY";
+            db.exec(R"(
 CREATE TABLE )" + table + R"((
-    key )" + type + R"(,
+    )" + keyColumn + " " + type + R"(,
     line INTEGER,
     offset INTEGER
 ))");
+        }
+        if (config.dictionary) {
+            db.exec(R"(
+CREATE TABLE keys_)" + name + R"((
+    id INTEGER PRIMARY KEY,
+    key TEXT UNIQUE
+))");
+            db.exec(R"(
+CREATE VIEW index_)" + name + R"( AS
+SELECT k.key AS key, i.line AS line, i.offset AS offset
+FROM )" + table + R"( AS i JOIN keys_)" + name + R"( AS k ON k.id = i.keyId)");
+        }
         addIndexSql
                 .reset()
                 .bindString(":name", name)
                 .bindString(":creationString", creation)
                 .bindInt64(":isNumeric", config.numeric ? 1 : 0)
+                .bindInt64(":isSampled", config.sampled ? 1 : 0)
+                .bindString(":indexerConfig", config.indexerConfig)
+                .bindInt64(":isPostingList", 0)
+                .bindInt64(":isHashed", config.hashed ? 1 : 0)
                 .step();
 
-        auto inserter = db.prepare(R"(
-INSERT INTO )" + table + R"( VALUES(:key, :line, :offset)
-)");
+        auto inserter = db.prepare(
+                std::string(config.clustered && !config.unique
+                            ? "INSERT OR IGNORE INTO " : "INSERT INTO ")
+                + table + " VALUES(:key, :line, :offset)");
         if (config.indexLineOffsets) {
             db.exec(R"(CREATE INDEX )" + table + R"(_line_index ON )"
                     + table + R"((line))");
         }
-        if (!config.unique) {
+        if (!config.unique && !config.clustered) {
             db.exec(R"(CREATE INDEX )" + table + R"(_key_index ON )"
-                    + table + R"((key))");
+                    + table + "(" + keyColumn + ")");
         }
-        if (config.numeric) {
+        if (config.dictionary) {
+            indexers.emplace(name, std::unique_ptr<IndexHandler>(
+                    new DictionaryHandler(log, std::move(indexer),
+                                          std::move(inserter), db.prepare(
+                                    "INSERT INTO keys_" + name
+                                    + " VALUES(:id, :key)"), db.prepare(
+                                    "SELECT id FROM keys_" + name
+                                    + " WHERE key = :key"))));
+        } else if (config.sampled) {
+            auto handler = new SampledHandler(log, std::move(indexer),
+                                              std::move(inserter),
+                                              config.numeric,
+                                              config.sampleEvery,
+                                              accessPoints);
+            indexers.emplace(name, std::unique_ptr<IndexHandler>(handler));
+            sampledIndexers.emplace(name, handler);
+        } else if (config.hashed) {
+            indexers.emplace(name, std::unique_ptr<IndexHandler>(
+                    new HashedHandler(log, std::move(indexer),
+                                      std::move(inserter))));
+        } else if (config.numeric) {
             indexers.emplace(name, std::unique_ptr<IndexHandler>(
                     new NumericHandler(log, std::move(indexer),
                                        std::move(inserter))));
@@ -713,14 +2869,47 @@ INSERT INTO )" + table + R"( VALUES(:key, :line, :offset)
         }
     }
 
+    // Add an index stored as a posting list per key, for each block of lines.
+    void addPostingIndexer(const std::string &name,
+                           const std::string &creation,
+                           Index::IndexConfig config,
+                           std::unique_ptr<LineIndexer> indexer) {
+        auto table = "index_" + name;
+        db.exec(R"(
+CREATE TABLE )" + table + R"((
+    key )" + (config.numeric ? "INTEGER" : "TEXT") + R"(,
+    firstLine INTEGER,
+    lastLine INTEGER,
+    numLines INTEGER,
+    lines BLOB,
+    PRIMARY KEY(key, firstLine)
+))");
+        addIndexSql
+                .reset()
+                .bindString(":name", name)
+                .bindString(":creationString", creation)
+                .bindInt64(":isNumeric", config.numeric ? 1 : 0)
+                .bindInt64(":isSampled", 0)
+                .bindString(":indexerConfig", "")
+                .bindInt64(":isPostingList", 1)
+                .bindInt64(":isHashed", 0)
+                .step();
+        indexers.emplace(name, std::unique_ptr<IndexHandler>(
+                new PostingHandler(log, std::move(indexer), db.prepare(R"(
+INSERT INTO )" + table + R"( VALUES(:key, :firstLine, :lastLine, :numLines,
+                                   :lines))"), config.numeric)));
+    }
+
     bool onLine(
             size_t lineNumber,
-            size_t /*fileOffset*/,
+            size_t fileOffset,
             const char *line, size_t length) override {
+        if (trigrams) trigrams->add(lineNumber, line, length);
         if (lineNumber <= skipFirst) return true;
         bool consumed = false;
         for (auto &&pair : indexers) {
-            consumed |= pair.second->onLine(lineNumber, line, length);
+            consumed |= pair.second->onLine(lineNumber, fileOffset, line,
+                                            length);
         }
         return consumed || saveAllLines_;
     }
@@ -751,6 +2940,16 @@ Index::Builder &Index::Builder::skipFirst(uint64_t skipFirst) {
     return *this;
 }
 
+Index::Builder &Index::Builder::storeLineOffsets(bool store) {
+    impl_->storeLineOffsets = store;
+    return *this;
+}
+
+Index::Builder &Index::Builder::indexTrigrams(uint64_t blockLines) {
+    impl_->trigrams.reset(blockLines ? new TrigramBlocks(blockLines) : nullptr);
+    return *this;
+}
+
 void Index::Builder::build() {
     impl_->build();
 }
@@ -761,13 +2960,18 @@ Index Index::load(Log &log, File &&fromCompressed,
     Sqlite db(log);
     db.open(indexFilename.c_str(), true);
 
-    std::unique_ptr<Impl> impl(new Impl(log,
-                                        std::move(fromCompressed),
-                                        std::move(db)));
+    std::shared_ptr<SharedIndex> shared(
+            new SharedIndex(std::move(fromCompressed), indexFilename));
+    Impl::loadShared(log, db, *shared);
+    std::unique_ptr<Impl> impl(new Impl(log, shared, std::move(db)));
     impl->init(forceLoad);
     return Index(std::move(impl));
 }
 
+Index Index::reader() const {
+    return Index(impl_->reader());
+}
+
 bool Index::getLine(uint64_t line, LineSink &sink) {
     return impl_->getLine(line, sink);
 }
@@ -778,34 +2982,191 @@ size_t Index::getLines(const std::vector<uint64_t> &lines, LineSink &sink) {
     return matched;
 }
 
+size_t Index::getLineRange(uint64_t first, uint64_t last, LineSink &sink) {
+    return impl_->getLineRange(first, last, sink);
+}
+
 size_t Index::queryIndex(const std::string &index, const std::string &query,
                          LineFunction lineFunction) {
-    return impl_->queryIndex(index, query, lineFunction);
+    return impl_->cursorIndex(index, query).forEach(lineFunction);
 }
 
 size_t Index::queryIndexMulti(const std::string &index,
                               const std::vector<std::string> &queries,
                               LineFunction lineFunction) {
-    size_t result = 0;
-    for (auto query : queries)
-        result += impl_->queryIndex(index, query, lineFunction);
-    return result;
+    return impl_->cursorIndexMulti(index, queries).forEach(lineFunction);
+}
+
+size_t Index::countIndex(const std::string &index,
+                         const std::string &query) const {
+    return impl_->countIndex(index, query);
+}
+
+size_t Index::countIndexMulti(const std::string &index,
+                              const std::vector<std::string> &queries) const {
+    return impl_->countIndexMulti(index, queries);
+}
+
+size_t Index::countIndexRange(const std::string &index,
+                              const std::string &from,
+                              const std::string &to) const {
+    return impl_->countIndexRange(index, from, to);
+}
+
+size_t Index::countIndexPrefix(const std::string &index,
+                               const std::string &prefix) const {
+    return impl_->countIndexPrefix(index, prefix);
+}
+
+size_t Index::countExpression(const std::string &expression,
+                              const std::string &defaultIndex) const {
+    return impl_->countExpression(expression, defaultIndex);
+}
+
+size_t Index::queryIndexRange(const std::string &index,
+                              const std::string &from, const std::string &to,
+                              LineFunction lineFunction) {
+    return impl_->cursorIndexRange(index, from, to).forEach(lineFunction);
+}
+
+size_t Index::queryIndexPrefix(const std::string &index,
+                               const std::string &prefix,
+                               LineFunction lineFunction) {
+    return impl_->cursorIndexPrefix(index, prefix).forEach(lineFunction);
+}
+
+size_t Index::queryExpression(const std::string &expression,
+                              const std::string &defaultIndex,
+                              LineFunction lineFunction) {
+    return impl_->cursorExpression(expression, defaultIndex)
+            .forEach(lineFunction);
 }
 
 size_t
 Index::queryCustom(const std::string &customQuery, LineFunction lineFunc) {
-    return impl_->customQuery(customQuery, lineFunc);
+    return impl_->cursorCustom(customQuery).forEach(lineFunc);
+}
+
+Index::Cursor Index::cursorIndex(const std::string &index,
+                                 const std::string &query) {
+    return impl_->cursorIndex(index, query);
+}
+
+Index::Cursor Index::cursorIndexMulti(const std::string &index,
+                                      const std::vector<std::string> &queries) {
+    return impl_->cursorIndexMulti(index, queries);
+}
+
+Index::Cursor Index::cursorIndexRange(const std::string &index,
+                                      const std::string &from,
+                                      const std::string &to) {
+    return impl_->cursorIndexRange(index, from, to);
+}
+
+Index::Cursor Index::cursorIndexPrefix(const std::string &index,
+                                       const std::string &prefix) {
+    return impl_->cursorIndexPrefix(index, prefix);
+}
+
+Index::Cursor Index::cursorExpression(const std::string &expression,
+                                      const std::string &defaultIndex) {
+    return impl_->cursorExpression(expression, defaultIndex);
+}
+
+Index::Cursor Index::cursorCustom(const std::string &customQuery) {
+    return impl_->cursorCustom(customQuery);
+}
+
+size_t Index::grep(const std::string &regex, LineSink &sink,
+                   const GrepOptions &options) {
+    return impl_->grep(regex, sink, options);
+}
+
+Index::Cursor Index::cursorGrep(const std::string &regex,
+                                const GrepOptions &options) {
+    return impl_->cursorGrep(regex, options);
+}
+
+uint64_t Index::cat(uint64_t first, uint64_t last, BlockFunction output,
+                    unsigned jobs) {
+    return impl_->cat(first, last, output, jobs);
+}
+
+constexpr size_t Index::Cursor::NoLimit;
+
+Index::Cursor::Cursor(std::unique_ptr<Impl> &&impl) : impl_(std::move(impl)) {
+}
+
+Index::Cursor::Cursor(Cursor &&other) : impl_(std::move(other.impl_)) {
+}
+
+Index::Cursor::~Cursor() {
+}
+
+Index::Cursor &Index::Cursor::offset(size_t count) {
+    impl_->toSkip = count;
+    return *this;
+}
+
+Index::Cursor &Index::Cursor::limit(size_t count) {
+    impl_->remaining = count;
+    return *this;
+}
+
+bool Index::Cursor::next(uint64_t &line) {
+    return impl_->next(line);
+}
+
+size_t Index::Cursor::forEachRun(
+        std::function<void(uint64_t, uint64_t)> runFunction) {
+    size_t matches = 0;
+    uint64_t first = 0, last = 0, line;
+    while (impl_->next(line)) {
+        if (matches++ && line == last + 1) {
+            last = line;
+            continue;
+        }
+        if (first) runFunction(first, last);
+        first = last = line;
+    }
+    if (first) runFunction(first, last);
+    return matches;
+}
+
+size_t Index::Cursor::forEach(LineFunction lineFunction) {
+    size_t matches = 0;
+    uint64_t line;
+    while (impl_->next(line)) {
+        lineFunction(line);
+        ++matches;
+    }
+    return matches;
 }
 
 Index::Builder::~Builder() {
 }
 
+size_t Index::lineKeys(const std::string &index,
+                       const std::vector<uint64_t> &lines,
+                       LineKeyFunction lineKeyFunction) {
+    return impl_->lineKeys(index, lines, lineKeyFunction);
+}
+
 size_t Index::indexSize(const std::string &index) const {
     return impl_->indexSize(index);
 }
 
 const Index::Metadata &Index::getMetadata() const {
-    return impl_->metadata_;
+    return impl_->shared_->metadata;
+}
+
+size_t Index::sinkFetch(Cursor &&cursor, LineSink &sink) {
+    return cursor.forEachRun([this, &sink](uint64_t first, uint64_t last) {
+        if (first == last)
+            getLine(first, sink);
+        else
+            getLineRange(first, last, sink);
+    });
 }
 
 Index::LineFunction Index::sinkFetch(LineSink &sink) {
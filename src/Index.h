@@ -7,6 +7,7 @@
 #include <memory>
 #include <unordered_map>
 #include <functional>
+#include <string>
 
 class Log;
 
@@ -32,19 +33,84 @@ public:
     Index(Index &&other);
     ~Index();
 
+    struct GrepOptions {
+        // Match just this field (numbered from 1) of each line against the
+        // regex, fields being separated by delimiter, rather than the whole
+        // line.
+        int field;
+        std::string delimiter;
+        // Search up to this many parts of the file at once, each starting at
+        // an access point, on threads of their own. Matches are still passed
+        // on in order.
+        unsigned jobs;
+
+        GrepOptions() : field{0}, delimiter{" "}, jobs{1} {};
+
+        GrepOptions withField(int f, std::string d) {
+            field = f;
+            delimiter = std::move(d);
+            return *this;
+        };
+        GrepOptions withJobs(unsigned j) { jobs = j; return *this; };
+    };
+
     struct IndexConfig {
         bool numeric;
         bool unique;
         bool sparse;
         bool indexLineOffsets;
+        // A sampled index is for keys which never decrease through the file,
+        // such as timestamps. Rather than every key, only the first key every
+        // sampleEvery lines (or at each checkpoint, if sampleEvery is zero) is
+        // stored, and queries scan the lines between samples, indexing them
+        // again with an indexer made from indexerConfig.
+        bool sampled;
+        uint64_t sampleEvery;
+        // The JSON configuration of the indexer, as IndexParser reads, for
+        // indexes whose lines are indexed again at query time.
+        std::string indexerConfig;
+        // Store a compressed list of the lines with each key, rather than a
+        // row for every line. Far smaller for keys shared by many lines, such
+        // as log levels, but the offset of each key within its line is lost.
+        bool postingLists;
+        // Store the index table clustered by key, with no separate index of
+        // the keys: smaller, and key lookups are a single B-tree scan.
+        bool clustered;
+        // Store each distinct key once, with an integer id to store against
+        // each line. Much smaller for long keys repeated on many lines, such
+        // as URLs. Only for non-numeric indexes.
+        bool dictionary;
+        // Store a 64-bit hash of each key in place of the key itself: a fixed
+        // eight bytes however long the keys are. Queries check each line the
+        // hash finds really has the key, indexing it again with an indexer
+        // made from indexerConfig if there is one, so only exact keys can be
+        // looked up, and counts decompress the lines they count. Only for
+        // non-numeric indexes.
+        bool hashed;
 
         IndexConfig() :
-                numeric{false}, unique{false}, sparse{false}, indexLineOffsets{false} {};
+                numeric{false}, unique{false}, sparse{false}, indexLineOffsets{false},
+                sampled{false}, sampleEvery{0}, postingLists{false},
+                clustered{false}, dictionary{false}, hashed{false} {};
         
         IndexConfig withNumeric(bool b) { numeric = b; return *this; };
         IndexConfig withUnique(bool b) { unique = b; return *this; };
         IndexConfig withSparse(bool b) { sparse = b; return *this; };
         IndexConfig withIndexLineOffsets(bool b) { indexLineOffsets = b; return *this; };
+        IndexConfig withPostingLists(bool b) { postingLists = b; return *this; };
+        IndexConfig withClustered(bool b) { clustered = b; return *this; };
+        IndexConfig withDictionary(bool b) { dictionary = b; return *this; };
+        IndexConfig withHashed(bool b) { hashed = b; return *this; };
+        IndexConfig withIndexerConfig(std::string config) {
+            indexerConfig = std::move(config);
+            return *this;
+        };
+        IndexConfig withSampling(uint64_t everyLines, std::string config) {
+            sampled = true;
+            sampleEvery = everyLines;
+            indexerConfig = std::move(config);
+            return *this;
+        };
     };
 
     // Retrieve a single line by line number, calling the supplied LineSink with
@@ -53,14 +119,60 @@ public:
     // Retrieve multiple lines by line numbers, calling the supplied LinkSink
     // with each matching line, if found. Returns the number of lines matched.
     size_t getLines(const std::vector<uint64_t> &lines, LineSink &sink);
+    // Retrieve all the lines from first to last inclusive, calling the supplied
+    // LineSink with each in order. This decodes the range in a single pass,
+    // so is much quicker than fetching each line in turn. Lines missing from
+    // the index are skipped, and the sink may return false to stop early.
+    // Returns the number of lines passed to the sink.
+    size_t getLineRange(uint64_t first, uint64_t last, LineSink &sink);
 
     // A function type used to be given a series of matching line numbers.
     using LineFunction = std::function<void(uint64_t)>;
 
+    // A cursor over the numbers of the lines matching a query, in order.
+    // Matches are only fetched from the index as they're asked for, so a
+    // caller wanting just the first few can stop early without paying for
+    // the rest. A cursor must not outlive the Index it came from.
+    class Cursor {
+    public:
+        struct Impl;
+
+        static constexpr size_t NoLimit = static_cast<size_t>(-1);
+
+        explicit Cursor(std::unique_ptr<Impl> &&impl);
+        Cursor(Cursor &&other);
+        ~Cursor();
+
+        // Skip the first count matches.
+        Cursor &offset(size_t count);
+        // Stop after count matches (after any skipped by offset).
+        Cursor &limit(size_t count);
+
+        // Fetch the next matching line number into line. Returns false when
+        // there are no more.
+        bool next(uint64_t &line);
+
+        // Pass each remaining matching line number to the supplied
+        // LineFunction. Returns the number of lines passed.
+        size_t forEach(LineFunction lineFunction);
+
+        // Pass each run of consecutive matching lines, first to last
+        // inclusive, to the supplied function. Returns the number of lines.
+        size_t forEachRun(std::function<void(uint64_t, uint64_t)> runFunction);
+
+    private:
+        std::unique_ptr<Impl> impl_;
+    };
+
     // Return a LineFunction which fetches each line in turn and provides them
     // to the supplied LineSink.
     LineFunction sinkFetch(LineSink &sink);
 
+    // Fetch all the lines from the cursor, decoding runs of consecutive lines
+    // in a single pass, and provide them to the supplied LineSink. Returns the
+    // number of matching lines.
+    size_t sinkFetch(Cursor &&cursor, LineSink &sink);
+
     // Query the given sub-index with the supplied query. Each matching line
     // number is passed in turn to the supplied LineFunction. Returns the number
     // of index matches.
@@ -76,19 +188,68 @@ public:
     }
 
     // Query the given sub-index with the supplied array of queries. Each
-    // matching line number is passed to the supplied lineFunction. Returns the
-    // total number of matches.
+    // matching line number is passed to the supplied lineFunction, in order
+    // and without duplicates, even if a line matches several queries. Returns
+    // the number of matching lines.
     size_t queryIndexMulti(const std::string &index,
                            const std::vector<std::string> &queries,
                            LineFunction lineFunction);
 
     // Query the given sub-index with the supplied array of queries. Each
     // matching line is looked up and the line data passed to the supplied
-    // LineSink. Returns the total number of index matches.
+    // LineSink, in order and without duplicates. Returns the number of
+    // matching lines.
     size_t queryIndexMulti(const std::string &index,
                            const std::vector<std::string> &queries,
                            LineSink &sink) {
-        return queryIndexMulti(index, queries, sinkFetch(sink));
+        return sinkFetch(cursorIndexMulti(index, queries), sink);
+    }
+
+    // Query the given sub-index for all keys between from and to inclusive. Each
+    // matching line number is passed to the supplied LineFunction, in order and
+    // without duplicates. Numeric indices compare numerically, others
+    // lexicographically. Returns the number of matching lines.
+    size_t queryIndexRange(const std::string &index, const std::string &from,
+                           const std::string &to, LineFunction lineFunction);
+
+    // Query the given sub-index for all keys between from and to inclusive. Each
+    // matching line is looked up and the line data passed to the supplied
+    // LineSink, in order. Returns the number of matching lines.
+    size_t queryIndexRange(const std::string &index, const std::string &from,
+                           const std::string &to, LineSink &sink) {
+        return sinkFetch(cursorIndexRange(index, from, to), sink);
+    }
+
+    // Query the given (non-numeric) sub-index for all keys starting with the
+    // given prefix. Each matching line number is passed to the supplied
+    // LineFunction, in order and without duplicates. Returns the number of
+    // matching lines.
+    size_t queryIndexPrefix(const std::string &index, const std::string &prefix,
+                            LineFunction lineFunction);
+
+    // Query the given (non-numeric) sub-index for all keys starting with the
+    // given prefix. Each matching line is looked up and the line data passed to
+    // the supplied LineSink, in order. Returns the number of matching lines.
+    size_t queryIndexPrefix(const std::string &index, const std::string &prefix,
+                            LineSink &sink) {
+        return sinkFetch(cursorIndexPrefix(index, prefix), sink);
+    }
+
+    // Query with a boolean expression over one or more sub-indexes, such as
+    // "default:5 AND (secondary:KEY_2 OR secondary:KEY_3) AND NOT other:x".
+    // See Query.h for the full syntax. Terms with no index name are looked up
+    // in the defaultIndex. Each matching line number is passed to the supplied
+    // LineFunction, in order. Returns the number of matching lines.
+    size_t queryExpression(const std::string &expression,
+                           const std::string &defaultIndex,
+                           LineFunction lineFunction);
+
+    // Query with a boolean expression over one or more sub-indexes. Each
+    // matching line is looked up and the line data passed to the supplied
+    // LineSink, in order. Returns the number of matching lines.
+    size_t queryExpression(const std::string &expression,
+                           const std::string &defaultIndex, LineSink &sink) {
+        return sinkFetch(cursorExpression(expression, defaultIndex), sink);
     }
 
     // Query all indexes with the supplied query. Each
@@ -96,7 +257,84 @@ public:
     // the total number of index matches
     size_t queryCustom(const std::string &customQuery, LineFunction lineFunc);
 
-    // Return the number of entries in a particular sub-index.
+    // Cursors over the results of the corresponding query functions. While a
+    // cursor from cursorIndexMulti is in use, no other multi-key query may
+    // be made on this Index.
+    Cursor cursorIndex(const std::string &index, const std::string &query);
+    Cursor cursorIndexMulti(const std::string &index,
+                            const std::vector<std::string> &queries);
+    Cursor cursorIndexRange(const std::string &index, const std::string &from,
+                            const std::string &to);
+    Cursor cursorIndexPrefix(const std::string &index,
+                             const std::string &prefix);
+    Cursor cursorExpression(const std::string &expression,
+                            const std::string &defaultIndex);
+    Cursor cursorCustom(const std::string &customQuery);
+
+    // Find the lines matching a POSIX extended regular expression, passing
+    // each to the sink in order until the sink returns false. If the index
+    // has trigrams (see Builder::indexTrigrams) only the blocks of lines which
+    // could match are decompressed and searched; otherwise the whole file is.
+    // Returns the number of matching lines.
+    size_t grep(const std::string &regex, LineSink &sink,
+                const GrepOptions &options = GrepOptions());
+    // A cursor over the numbers of the lines grep would find.
+    Cursor cursorGrep(const std::string &regex,
+                      const GrepOptions &options = GrepOptions());
+
+    // A function type used to be given a block of decompressed data.
+    using BlockFunction = std::function<void(const char *data, size_t length)>;
+    // Decompress lines first to last inclusive (or to the end of the file, if
+    // last is past it) exactly as they are in the file, newlines and all,
+    // passing the data to the function in large blocks, in order. Blocks are
+    // sized by the gaps between access points, from 1MiB up to 32MiB, and
+    // decompressed on up to jobs threads at once, with no more than two per
+    // thread held in memory. A gap of more than 32MiB can only be decompressed
+    // in one pass, so is output 32MiB at a time as it's decompressed, while
+    // the threads carry on with the blocks after it. Returns the number of
+    // bytes output.
+    uint64_t cat(uint64_t first, uint64_t last, BlockFunction output,
+                 unsigned jobs = 1);
+
+    // The count functions return the same number as the corresponding query,
+    // answered from the index alone without decompressing any of the file
+    // (except for sampled indexes, which have to scan between their samples,
+    // and hashed indexes, which have to check each line has the key).
+
+    // Count the matches for a query on the given sub-index.
+    size_t countIndex(const std::string &index,
+                      const std::string &query) const;
+
+    // Count the lines matching any of the queries on the given sub-index.
+    size_t countIndexMulti(const std::string &index,
+                           const std::vector<std::string> &queries) const;
+
+    // Count the lines with keys between from and to inclusive in the given
+    // sub-index.
+    size_t countIndexRange(const std::string &index, const std::string &from,
+                           const std::string &to) const;
+
+    // Count the lines with keys starting with prefix in the given sub-index.
+    size_t countIndexPrefix(const std::string &index,
+                            const std::string &prefix) const;
+
+    // Count the lines matching a boolean expression over sub-indexes.
+    size_t countExpression(const std::string &expression,
+                           const std::string &defaultIndex) const;
+
+    // A function type used to be given a line number and a numeric key.
+    using LineKeyFunction = std::function<void(uint64_t, int64_t)>;
+
+    // Look up each of the given lines in the given numeric sub-index, passing
+    // each line number and its key to the supplied LineKeyFunction, in line
+    // order. Lines with no key are skipped, and lines with several are given
+    // the smallest. Returns the number of lines with keys.
+    size_t lineKeys(const std::string &index,
+                    const std::vector<uint64_t> &lines,
+                    LineKeyFunction lineKeyFunction);
+
+    // Return the number of entries in a particular sub-index (for a sampled
+    // index, the number of samples).
     size_t indexSize(const std::string &index) const;
 
     // Metadata is a blob of strings that describe aspects of the index. They're
@@ -122,6 +360,16 @@ public:
         Builder &indexEvery(uint64_t bytes);
         // Modify the builder to skip the first few lines.
         Builder &skipFirst(uint64_t skipFirst);
+        // Modify the builder to store (or not) the offset of every line. Without
+        // them, only the first line at each checkpoint is recorded, and lines
+        // are found by scanning forward from there. This makes for a far
+        // smaller index at the cost of slower line lookups.
+        Builder &storeLineOffsets(bool store);
+        // Modify the builder to index the trigrams (three byte substrings) in
+        // each block of the given number of lines, so grep only decompresses
+        // the blocks holding the literal text a regex needs. Zero, the
+        // default, indexes none.
+        Builder &indexTrigrams(uint64_t blockLines);
 
         // Add an indexer to the builder. The indexer will be given each line
         // in turn and asked to provide matches. The name is the name of the
@@ -143,4 +391,12 @@ public:
     // not to match the underlying compressed file.
     static Index load(Log &log, File &&fromCompressed,
                       const std::string &indexFilename, bool forceLoad);
+
+    // Make another Index on the same files, sharing this one's metadata and
+    // access points but with its own database connection and decompression
+    // state. An Index must only be used by one thread at a time; to query
+    // from several threads at once, give each thread its own reader. Readers
+    // all log to this Index's Log, which must outlive them and be safe to
+    // call from several threads.
+    Index reader() const;
 };
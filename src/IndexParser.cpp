@@ -4,6 +4,7 @@
 #include "ExternalIndexer.h"
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <stdexcept>
 
 void IndexParser::buildIndexes(Index::Builder *builder, ConsoleLog &log) {
@@ -35,53 +36,90 @@ void IndexParser::parseIndex(cJSON *index, Index::Builder *builder,
     if (cJSON_HasObjectItem(index, "name")) {
         indexName = cJSON_GetObjectItem(index, "name")->valuestring;
     }
-    std::string type = cJSON_GetObjectItem(index, "type")->valuestring;
     Index::IndexConfig config{};
     config.numeric = getBoolean(index, "numeric");
     config.unique = getBoolean(index, "unique");
     config.sparse = getBoolean(index, "sparse");
     config.indexLineOffsets = getBoolean(index, "indexLineOffsets");
+    config.postingLists = getBoolean(index, "postingLists");
+    config.clustered = getBoolean(index, "clustered");
+    config.dictionary = getBoolean(index, "dictionary");
+    config.hashed = getBoolean(index, "hashed");
+    auto sampled = getBoolean(index, "sampled")
+                   || cJSON_HasObjectItem(index, "sampleEvery");
+    if (sampled || config.hashed) {
+        // Queries make the indexer again from its configuration.
+        auto json = cJSON_PrintUnformatted(index);
+        config.indexerConfig = json;
+        free(json);
+    }
+    if (sampled) {
+        uint64_t sampleEvery = 0;
+        if (cJSON_HasObjectItem(index, "sampleEvery"))
+            sampleEvery = getOrThrowUint(index, "sampleEvery");
+        config = config.withSampling(sampleEvery, config.indexerConfig);
+    }
+
+    std::string creation;
+    auto indexer = makeIndexer(index, log, creation);
+    builder->addIndexer(indexName, creation, config, std::move(indexer));
+}
 
+std::unique_ptr<LineIndexer> IndexParser::makeIndexer(
+        const std::string &config, Log &log) {
+    cJSON *index = cJSON_Parse(config.c_str());
+    if (index == nullptr)
+        throw std::runtime_error("Could not parse indexer config '" + config
+                                 + "'");
+    try {
+        std::string creation;
+        auto indexer = makeIndexer(index, log, creation);
+        cJSON_Delete(index);
+        return indexer;
+    } catch (...) {
+        cJSON_Delete(index);
+        throw;
+    }
+}
+
+std::unique_ptr<LineIndexer> IndexParser::makeIndexer(cJSON *index, Log &log,
+                                                      std::string &creation) {
+    std::string type = getOrThrowStr(index, "type");
     if (type == "regex") {
         auto regex = getOrThrowStr(index, "regex");
+        creation = regex;
         if (cJSON_HasObjectItem(index, "capture")) {
             uint capture = cJSON_GetObjectItem(index, "capture")->valueint;
-            builder->addIndexer(indexName, regex, config,
-                                std::unique_ptr<LineIndexer>(
-                                        new RegExpIndexer(regex, capture)));
-        } else {
-            builder->addIndexer(indexName, regex, config,
-                                std::unique_ptr<LineIndexer>(
-                                        new RegExpIndexer(regex)));
+            return std::unique_ptr<LineIndexer>(
+                    new RegExpIndexer(regex, capture));
         }
+        return std::unique_ptr<LineIndexer>(new RegExpIndexer(regex));
     } else if (type == "field") {
         auto delimiter = getOrThrowStr(index, "delimiter");
         auto fieldNum = getOrThrowUint(index, "fieldNum");
         std::ostringstream name;
         name << "Field " << fieldNum << " delimited by '"
              << delimiter << "'";
-        builder->addIndexer(indexName, name.str(), config,
-                            std::unique_ptr<LineIndexer>(
-                                    new FieldIndexer(delimiter, fieldNum)));
+        creation = name.str();
+        return std::unique_ptr<LineIndexer>(
+                new FieldIndexer(delimiter, fieldNum));
     } else if (type == "pipe") {
         auto pipeCommand = getOrThrowStr(index, "command");
         auto delimiter = getOrThrowStr(index, "delimiter");
-
-        builder->addIndexer(
-                indexName, pipeCommand, config,
-                std::unique_ptr<LineIndexer>(
-                        new ExternalIndexer(log, pipeCommand, delimiter)));
+        creation = pipeCommand;
+        return std::unique_ptr<LineIndexer>(
+                new ExternalIndexer(log, pipeCommand, delimiter));
     } else {
         throw std::runtime_error("unknown index " + type);
     }
 }
 
-bool IndexParser::getBoolean(cJSON *index, const char *field) const {
+bool IndexParser::getBoolean(cJSON *index, const char *field) {
     return cJSON_GetObjectItem(index, field)
            && cJSON_GetObjectItem(index, field)->type == cJSON_True;
 }
 
-std::string IndexParser::getOrThrowStr(cJSON *index, const char *field) const {
+std::string IndexParser::getOrThrowStr(cJSON *index, const char *field) {
     auto *item = cJSON_GetObjectItem(index, field);
     if (!item)
         throw std::runtime_error("Could not parse the json config file. Field '"
@@ -89,7 +127,7 @@ std::string IndexParser::getOrThrowStr(cJSON *index, const char *field) const {
     return item->valuestring;
 }
 
-unsigned IndexParser::getOrThrowUint(cJSON *index, const char *field) const {
+unsigned IndexParser::getOrThrowUint(cJSON *index, const char *field) {
     auto *item = cJSON_GetObjectItem(index, field);
     if (!item)
         throw std::runtime_error("Could not parse the json config file. Field '"
@@ -3,6 +3,7 @@
 #include "LineIndexer.h"
 #include "Index.h"
 #include "ConsoleLog.h"
+#include <memory>
 #include <string>
 #include "cJSON/cJSON.h"
 
@@ -16,9 +17,15 @@ public:
 
     void buildIndexes(Index::Builder *builder, ConsoleLog& log);
 
+    // Make the indexer described by a single index's JSON configuration.
+    static std::unique_ptr<LineIndexer> makeIndexer(const std::string &config,
+                                                    Log &log);
+
 private:
     void parseIndex(cJSON *index, Index::Builder* builder, ConsoleLog& log);
-    bool getBoolean(cJSON *index, const char *field) const;
-    std::string getOrThrowStr(cJSON *index, const char *field) const;
-    unsigned getOrThrowUint(cJSON *index, const char *field) const;
+    static std::unique_ptr<LineIndexer> makeIndexer(cJSON *index, Log &log,
+                                                    std::string &creation);
+    static bool getBoolean(cJSON *index, const char *field);
+    static std::string getOrThrowStr(cJSON *index, const char *field);
+    static unsigned getOrThrowUint(cJSON *index, const char *field);
 };
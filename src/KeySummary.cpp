@@ -0,0 +1,45 @@
+#include "KeySummary.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <utility>
+
+namespace {
+
+bool parse(const std::string &key, int64_t &value) {
+    if (key.empty()) return false;
+    char *end;
+    errno = 0;
+    value = strtoll(key.c_str(), &end, 10);
+    return errno == 0 && *end == '\0';
+}
+
+}
+
+constexpr double KeySummary::FalsePositiveRate;
+
+KeySummary::KeySummary(bool numeric, size_t numKeys, std::string minKey,
+                       std::string maxKey, BloomFilter filter)
+        : numeric_(numeric), numKeys_(numKeys), minKey_(std::move(minKey)),
+          maxKey_(std::move(maxKey)), filter_(std::move(filter)) {}
+
+bool KeySummary::mayContain(const std::string &key) const {
+    if (!numKeys_) return false;
+    if (!numeric_) return filter_.mayContain(key);
+    // A key the index couldn't parse is left to the query to complain about.
+    int64_t value;
+    if (!parse(key, value)) return true;
+    return filter_.mayContain(std::to_string(value));
+}
+
+bool KeySummary::mayContainRange(const std::string &from,
+                                 const std::string &to) const {
+    if (!numKeys_) return false;
+    if (!numeric_) return from <= maxKey_ && to >= minKey_;
+    int64_t fromValue, toValue, minValue, maxValue;
+    if (!parse(from, fromValue) || !parse(to, toValue)
+        || !parse(minKey_, minValue) || !parse(maxKey_, maxValue))
+        return true;
+    return fromValue <= maxValue && toValue >= minValue;
+}
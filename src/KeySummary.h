@@ -0,0 +1,36 @@
+#pragma once
+
+#include "BloomFilter.h"
+
+#include <cstddef>
+#include <string>
+
+// A summary of the keys in a sub-index, small enough to check before opening
+// the index itself: how many distinct keys there are, the smallest and
+// largest, and a Bloom filter of them all. Numeric keys compare numerically,
+// and are filtered in their canonical decimal form.
+class KeySummary {
+    bool numeric_;
+    size_t numKeys_;
+    std::string minKey_;
+    std::string maxKey_;
+    BloomFilter filter_;
+
+public:
+    static constexpr double FalsePositiveRate = 0.01;
+
+    KeySummary(bool numeric, size_t numKeys, std::string minKey,
+               std::string maxKey, BloomFilter filter);
+
+    // Returns false if no key in the sub-index can be equal to key.
+    bool mayContain(const std::string &key) const;
+    // Returns false if no key in the sub-index can be between from and to
+    // inclusive.
+    bool mayContainRange(const std::string &from, const std::string &to) const;
+
+    bool numeric() const { return numeric_; }
+    size_t numKeys() const { return numKeys_; }
+    const std::string &minKey() const { return minKey_; }
+    const std::string &maxKey() const { return maxKey_; }
+    const BloomFilter &filter() const { return filter_; }
+};
@@ -0,0 +1,34 @@
+#include "NewlineCounter.h"
+
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+size_t countNewlines(const uint8_t *data, size_t length) {
+    size_t count = 0;
+#ifdef __SSE2__
+    const auto newline = _mm_set1_epi8('\n');
+    for (; length >= 16; data += 16, length -= 16) {
+        auto block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+        auto mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        count += __builtin_popcount(mask);
+    }
+#endif
+    for (; length; ++data, --length)
+        if (*data == '\n') ++count;
+    return count;
+}
+
+const uint8_t *findNewline(const uint8_t *data, size_t length, size_t n) {
+    auto end = data + length;
+    while (n && data < end) {
+        auto newline = static_cast<const uint8_t *>(
+                memchr(data, '\n', end - data));
+        if (!newline) return nullptr;
+        if (--n == 0) return newline;
+        data = newline + 1;
+    }
+    return nullptr;
+}
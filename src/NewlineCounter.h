@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Counts the newline characters in the given block of memory, using SIMD
+// comparisons where available.
+size_t countNewlines(const uint8_t *data, size_t length);
+
+// Finds the nth (1-based) newline in the given block of memory. Returns the
+// position of the newline, or nullptr if there are fewer than n newlines.
+const uint8_t *findNewline(const uint8_t *data, size_t length, size_t n);
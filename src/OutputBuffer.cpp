@@ -0,0 +1,111 @@
+#include "OutputBuffer.h"
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+// Write out all of the given buffers, coping with partial writes.
+void writeFully(int fd, iovec *iov, int count) {
+    while (count) {
+        auto written = ::writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error(std::string("Error writing output: ")
+                                     + strerror(errno));
+        }
+        auto remaining = static_cast<size_t>(written);
+        while (count && remaining >= iov->iov_len) {
+            remaining -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + remaining;
+            iov->iov_len -= remaining;
+        }
+    }
+}
+
+}
+
+OutputBuffer::OutputBuffer(int fd, size_t capacity)
+        : fd_(fd), into_(nullptr), buffer_(new char[capacity]),
+          capacity_(capacity), size_(0), lineBuffered_(isatty(fd)) {}
+
+OutputBuffer::OutputBuffer(std::string &into, size_t capacity)
+        : fd_(-1), into_(&into), buffer_(new char[capacity]),
+          capacity_(capacity), size_(0), lineBuffered_(false) {}
+
+OutputBuffer::~OutputBuffer() {
+    try {
+        flush();
+    } catch (...) {
+    }
+}
+
+void OutputBuffer::write(const char *data, size_t length) {
+    if (length <= capacity_ - size_) {
+        memcpy(buffer_.get() + size_, data, length);
+        size_ += length;
+    } else {
+        writeAll(data, length, false);
+    }
+}
+
+void OutputBuffer::writeNumber(uint64_t number) {
+    char digits[20];
+    auto end = digits + sizeof(digits);
+    auto begin = end;
+    do {
+        *--begin = static_cast<char>('0' + number % 10);
+        number /= 10;
+    } while (number);
+    write(begin, end - begin);
+}
+
+void OutputBuffer::writeLine(const char *data, size_t length) {
+    if (length < capacity_ - size_) {
+        memcpy(buffer_.get() + size_, data, length);
+        size_ += length;
+        buffer_[size_++] = '\n';
+    } else {
+        writeAll(data, length, true);
+    }
+    if (lineBuffered_) flush();
+}
+
+void OutputBuffer::flush() {
+    if (!size_) return;
+    iovec iov{buffer_.get(), size_};
+    size_ = 0;
+    emit(&iov, 1);
+}
+
+// Write out the pending buffer and then the data in one go, without copying
+// the data.
+void OutputBuffer::writeAll(const char *data, size_t length, bool newline) {
+    char newlineChar = '\n';
+    iovec iov[3];
+    int count = 0;
+    if (size_) iov[count++] = iovec{buffer_.get(), size_};
+    iov[count++] = iovec{const_cast<char *>(data), length};
+    if (newline) iov[count++] = iovec{&newlineChar, 1};
+    size_ = 0;
+    emit(iov, count);
+}
+
+void OutputBuffer::emit(iovec *iov, int count) {
+    if (!into_) {
+        writeFully(fd_, iov, count);
+        return;
+    }
+    for (auto i = 0; i < count; ++i)
+        into_->append(static_cast<const char *>(iov[i].iov_base),
+                      iov[i].iov_len);
+}
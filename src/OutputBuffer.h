@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Buffers output to a file descriptor, writing it out with write()/writev()
+// only when the buffer fills, so bulk output costs a syscall per buffer rather
+// than per line. Writes too big to be worth copying skip the buffer and go
+// straight out alongside whatever is pending. If line buffered (by default,
+// when the descriptor is a terminal) output is flushed after every line.
+// Output can instead be collected in a string, to be written out later.
+struct iovec;
+
+class OutputBuffer {
+    int fd_;
+    std::string *into_;
+    std::unique_ptr<char[]> buffer_;
+    size_t capacity_;
+    size_t size_;
+    bool lineBuffered_;
+
+public:
+    static constexpr size_t DefaultCapacity = 256 * 1024u;
+
+    explicit OutputBuffer(int fd, size_t capacity = DefaultCapacity);
+    // Append all output to the given string instead of writing it.
+    explicit OutputBuffer(std::string &into,
+                          size_t capacity = DefaultCapacity);
+    // Flushes any pending output, ignoring errors.
+    ~OutputBuffer();
+
+    OutputBuffer(const OutputBuffer &) = delete;
+    OutputBuffer &operator=(const OutputBuffer &) = delete;
+
+    void setLineBuffered(bool lineBuffered) { lineBuffered_ = lineBuffered; }
+
+    // Append data to the output.
+    void write(const char *data, size_t length);
+    // Append an unsigned number in decimal.
+    void writeNumber(uint64_t number);
+    // Append data followed by a newline, flushing if line buffered.
+    void writeLine(const char *data, size_t length);
+
+    // Write out all pending output. Throws std::runtime_error on failure.
+    void flush();
+
+private:
+    void writeAll(const char *data, size_t length, bool newline);
+    void emit(iovec *iov, int count);
+};
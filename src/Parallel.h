@@ -0,0 +1,71 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Call work(worker, i) for each i from 0 to count - 1 on a pool of jobs
+// threads, worker being the number of the thread (from 0) doing the work, and
+// done(i) on this thread, in order, as each finishes. Workers only run up to
+// jobs * 2 items ahead of the next to be done, bounding how much output is
+// waiting at once. Stops early, once the work in hand is finished, if done
+// returns false.
+template<typename Work, typename Done>
+void forEachInParallel(size_t count, size_t jobs, Work work, Done done) {
+    std::mutex m;
+    std::condition_variable cv;
+    std::vector<bool> finished(count);
+    size_t next = 0;
+    size_t numDone = 0;
+    auto window = jobs * 2;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < jobs; ++t) {
+        threads.emplace_back([&, t] {
+            for (;;) {
+                size_t i;
+                {
+                    std::unique_lock<std::mutex> lock(m);
+                    cv.wait(lock, [&] {
+                        return next == count || next < numDone + window;
+                    });
+                    if (next == count) return;
+                    i = next++;
+                }
+                work(t, i);
+                {
+                    std::lock_guard<std::mutex> lock(m);
+                    finished[i] = true;
+                }
+                cv.notify_all();
+            }
+        });
+    }
+    auto stop = [&] {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            next = count;
+        }
+        cv.notify_all();
+        for (auto &thread : threads) thread.join();
+    };
+    try {
+        for (size_t i = 0; i < count; ++i) {
+            {
+                std::unique_lock<std::mutex> lock(m);
+                cv.wait(lock, [&] { return finished[i]; });
+            }
+            if (!done(i)) break;
+            {
+                std::lock_guard<std::mutex> lock(m);
+                ++numDone;
+            }
+            cv.notify_all();
+        }
+    } catch (...) {
+        stop();
+        throw;
+    }
+    stop();
+}
@@ -0,0 +1,47 @@
+#include "PostingCodec.h"
+
+#include <stdexcept>
+
+void PostingEncoder::add(uint64_t line) {
+    if (size_ && line <= last_)
+        throw std::invalid_argument("Posting list lines must increase");
+    auto delta = line - last_;
+    while (delta >= 0x80) {
+        bytes_.push_back(static_cast<char>(delta | 0x80));
+        delta >>= 7;
+    }
+    bytes_.push_back(static_cast<char>(delta));
+    if (!size_) first_ = line;
+    last_ = line;
+    ++size_;
+}
+
+void PostingEncoder::clear() {
+    bytes_.clear();
+    first_ = last_ = 0;
+    size_ = 0;
+}
+
+PostingDecoder::PostingDecoder(StringView bytes)
+        : pos_(reinterpret_cast<const uint8_t *>(bytes.begin())),
+          end_(reinterpret_cast<const uint8_t *>(bytes.end())), line_(0) {}
+
+bool PostingDecoder::next(uint64_t &line) {
+    if (pos_ == end_) return false;
+    uint64_t delta = 0;
+    for (unsigned shift = 0;; shift += 7) {
+        if (pos_ == end_ || shift > 63)
+            throw std::runtime_error("Corrupt posting list");
+        auto byte = *pos_++;
+        delta |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) break;
+    }
+    line_ += delta;
+    line = line_;
+    return true;
+}
+
+void PostingDecoder::decodeInto(PostingList &lines) {
+    uint64_t line;
+    while (next(line)) lines.push_back(line);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "PostingList.h"
+#include "StringView.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Posting lists are stored compactly as the difference between each line and
+// the one before it (the first from zero), each written as a little-endian
+// base 128 varint: seven bits to a byte, with the top bit set on all but the
+// last byte. Lines close together, as for keys shared by many lines, mostly
+// take a single byte.
+class PostingEncoder {
+    std::string bytes_;
+    uint64_t first_ = 0;
+    uint64_t last_ = 0;
+    size_t size_ = 0;
+
+public:
+    // Add a line, which must be greater than any added before.
+    void add(uint64_t line);
+    // Forget all the lines added so far, to start a new list.
+    void clear();
+
+    const std::string &bytes() const { return bytes_; }
+    uint64_t first() const { return first_; }
+    uint64_t last() const { return last_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+};
+
+// Decodes the lines of an encoded posting list one at a time. The encoded bytes
+// must outlive the decoder.
+class PostingDecoder {
+    const uint8_t *pos_;
+    const uint8_t *end_;
+    uint64_t line_;
+
+public:
+    PostingDecoder() : pos_(nullptr), end_(nullptr), line_(0) {}
+    explicit PostingDecoder(StringView bytes);
+
+    // Fetch the next line. Returns false at the end of the list.
+    bool next(uint64_t &line);
+
+    // Append all the remaining lines to a posting list.
+    void decodeInto(PostingList &lines);
+};
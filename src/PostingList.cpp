@@ -0,0 +1,67 @@
+#include "PostingList.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace {
+
+using Iterator = PostingList::const_iterator;
+
+// Find the first element not less than value in [from, end), looking at
+// exponentially increasing distances from 'from' before binary searching. Cheap
+// when the element is close to 'from'.
+Iterator gallop(Iterator from, Iterator end, uint64_t value) {
+    size_t step = 1;
+    auto bound = from;
+    while (bound != end && *bound < value) {
+        from = bound + 1;
+        bound = static_cast<size_t>(end - from) > step ? from + step : end;
+        step *= 2;
+    }
+    return std::lower_bound(from, bound, value);
+}
+
+}
+
+PostingList intersect(const PostingList &a, const PostingList &b) {
+    const auto &smaller = a.size() <= b.size() ? a : b;
+    const auto &larger = a.size() <= b.size() ? b : a;
+    PostingList result;
+    auto pos = larger.begin();
+    for (auto line : smaller) {
+        pos = gallop(pos, larger.end(), line);
+        if (pos == larger.end()) break;
+        if (*pos == line) result.emplace_back(line);
+    }
+    return result;
+}
+
+PostingList unite(const PostingList &a, const PostingList &b) {
+    PostingList result;
+    result.reserve(std::max(a.size(), b.size()));
+    std::set_union(a.begin(), a.end(), b.begin(), b.end(),
+                   std::back_inserter(result));
+    return result;
+}
+
+PostingList subtract(const PostingList &a, const PostingList &b) {
+    PostingList result;
+    auto pos = b.begin();
+    for (auto line : a) {
+        pos = gallop(pos, b.end(), line);
+        if (pos == b.end() || *pos != line) result.emplace_back(line);
+    }
+    return result;
+}
+
+PostingList complement(const PostingList &a, uint64_t numLines) {
+    PostingList result;
+    auto pos = a.begin();
+    for (uint64_t line = 1; line <= numLines; ++line) {
+        if (pos != a.end() && *pos == line)
+            ++pos;
+        else
+            result.emplace_back(line);
+    }
+    return result;
+}
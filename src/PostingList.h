@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// A posting list is a sorted list of distinct line numbers, such as the lines
+// matching a query. The set operations here all take and return posting lists.
+using PostingList = std::vector<uint64_t>;
+
+// Return the lines in both a and b. Gallops through the larger list, so is
+// cheap when one list is much smaller than the other.
+PostingList intersect(const PostingList &a, const PostingList &b);
+
+// Return the lines in either a or b.
+PostingList unite(const PostingList &a, const PostingList &b);
+
+// Return the lines in a which aren't in b.
+PostingList subtract(const PostingList &a, const PostingList &b);
+
+// Return the lines from 1 to numLines inclusive which aren't in a.
+PostingList complement(const PostingList &a, uint64_t numLines);
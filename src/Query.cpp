@@ -0,0 +1,316 @@
+#include "Query.h"
+
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+#include <vector>
+
+struct Query::Node {
+    enum class Type {
+        Term, And, Or, Not
+    };
+    Type type;
+    Term term;
+    std::vector<std::unique_ptr<Node>> children;
+
+    explicit Node(Type type) : type(type), term() {}
+};
+
+namespace {
+
+using Node = std::unique_ptr<Query::Node>;
+
+struct Token {
+    enum class Type {
+        Word, LeftParen, RightParen, And, Or, Not, End
+    };
+    Type type;
+    std::string text;
+    // The position of the first unquoted colon within the word, if any.
+    size_t colon;
+    bool quoted;
+};
+
+std::vector<Token> tokenize(const std::string &expression) {
+    std::vector<Token> tokens;
+    size_t pos = 0;
+    auto error = [&](const std::string &what) {
+        return std::invalid_argument(
+                "Bad query '" + expression + "': " + what + " at position "
+                + std::to_string(pos));
+    };
+    while (pos < expression.size()) {
+        auto c = expression[pos];
+        if (isspace(static_cast<unsigned char>(c))) {
+            ++pos;
+        } else if (c == '(') {
+            tokens.push_back(Token{Token::Type::LeftParen, "(", 0, false});
+            ++pos;
+        } else if (c == ')') {
+            tokens.push_back(Token{Token::Type::RightParen, ")", 0, false});
+            ++pos;
+        } else {
+            Token word{Token::Type::Word, "", std::string::npos, false};
+            while (pos < expression.size()) {
+                c = expression[pos];
+                if (isspace(static_cast<unsigned char>(c)) || c == '('
+                    || c == ')')
+                    break;
+                ++pos;
+                if (c == '"') {
+                    word.quoted = true;
+                    for (;;) {
+                        if (pos == expression.size())
+                            throw error("unterminated quote");
+                        c = expression[pos++];
+                        if (c == '"') break;
+                        if (c == '\\' && pos < expression.size())
+                            c = expression[pos++];
+                        word.text += c;
+                    }
+                } else {
+                    if (c == ':' && word.colon == std::string::npos)
+                        word.colon = word.text.size();
+                    word.text += c;
+                }
+            }
+            if (!word.quoted) {
+                if (word.text == "AND") word.type = Token::Type::And;
+                else if (word.text == "OR") word.type = Token::Type::Or;
+                else if (word.text == "NOT") word.type = Token::Type::Not;
+            }
+            tokens.push_back(word);
+        }
+    }
+    tokens.push_back(Token{Token::Type::End, "end of query", 0, false});
+    return tokens;
+}
+
+class Parser {
+    const std::string &expression_;
+    const std::string &defaultIndex_;
+    std::vector<Token> tokens_;
+    size_t pos_;
+
+public:
+    Parser(const std::string &expression, const std::string &defaultIndex)
+            : expression_(expression), defaultIndex_(defaultIndex),
+              tokens_(tokenize(expression)), pos_(0) {}
+
+    Node parse() {
+        auto node = parseOr();
+        if (peek().type != Token::Type::End)
+            throw error("unexpected '" + peek().text + "'");
+        return node;
+    }
+
+private:
+    const Token &peek() const { return tokens_[pos_]; }
+
+    std::invalid_argument error(const std::string &what) const {
+        return std::invalid_argument(
+                "Bad query '" + expression_ + "': " + what);
+    }
+
+    static Node combine(Query::Node::Type type, Node lhs, Node rhs) {
+        if (lhs->type != type) {
+            Node node(new Query::Node(type));
+            node->children.emplace_back(std::move(lhs));
+            lhs = std::move(node);
+        }
+        lhs->children.emplace_back(std::move(rhs));
+        return lhs;
+    }
+
+    Node parseOr() {
+        auto node = parseAnd();
+        while (peek().type == Token::Type::Or) {
+            ++pos_;
+            node = combine(Query::Node::Type::Or, std::move(node), parseAnd());
+        }
+        return node;
+    }
+
+    Node parseAnd() {
+        auto node = parseUnary();
+        for (;;) {
+            auto type = peek().type;
+            if (type == Token::Type::And) {
+                ++pos_;
+            } else if (type != Token::Type::Word && type != Token::Type::Not
+                       && type != Token::Type::LeftParen) {
+                return node;
+            }
+            node = combine(Query::Node::Type::And, std::move(node),
+                           parseUnary());
+        }
+    }
+
+    Node parseUnary() {
+        const auto &token = peek();
+        switch (token.type) {
+            case Token::Type::Not: {
+                ++pos_;
+                Node node(new Query::Node(Query::Node::Type::Not));
+                node->children.emplace_back(parseUnary());
+                return node;
+            }
+            case Token::Type::LeftParen: {
+                ++pos_;
+                auto node = parseOr();
+                if (peek().type != Token::Type::RightParen)
+                    throw error("expected ')' but got '" + peek().text + "'");
+                ++pos_;
+                return node;
+            }
+            case Token::Type::Word:
+                ++pos_;
+                return parseTerm(token);
+            default:
+                throw error("unexpected '" + token.text + "'");
+        }
+    }
+
+    Node parseTerm(const Token &token) {
+        Node node(new Query::Node(Query::Node::Type::Term));
+        auto &term = node->term;
+        term.type = Query::Term::Type::Exact;
+        if (token.colon != std::string::npos) {
+            term.index = token.text.substr(0, token.colon);
+            term.key = token.text.substr(token.colon + 1);
+        } else {
+            term.index = defaultIndex_;
+            term.key = token.text;
+        }
+        if (term.index.empty())
+            throw error("missing index name in '" + token.text + "'");
+        if (token.quoted) return node;
+        auto dots = term.key.find("..");
+        if (dots != std::string::npos) {
+            term.type = Query::Term::Type::Range;
+            term.to = term.key.substr(dots + 2);
+            term.key.resize(dots);
+        } else if (!term.key.empty() && term.key.back() == '*') {
+            term.type = Query::Term::Type::Prefix;
+            term.key.pop_back();
+        }
+        return node;
+    }
+};
+
+size_t estimate(const Query::Node &node, Query::Source &source) {
+    switch (node.type) {
+        case Query::Node::Type::Term:
+            return source.estimate(node.term);
+        case Query::Node::Type::Or: {
+            size_t total = 0;
+            for (auto &child : node.children)
+                total += estimate(*child, source);
+            return total;
+        }
+        case Query::Node::Type::And: {
+            size_t smallest = source.numLines();
+            for (auto &child : node.children)
+                smallest = std::min(smallest, estimate(*child, source));
+            return smallest;
+        }
+        case Query::Node::Type::Not: {
+            auto numLines = source.numLines();
+            auto excluded = estimate(*node.children[0], source);
+            return excluded < numLines ? numLines - excluded : 0;
+        }
+    }
+    return 0;
+}
+
+PostingList evaluate(const Query::Node &node, Query::Source &source) {
+    switch (node.type) {
+        case Query::Node::Type::Term:
+            return source.lines(node.term);
+        case Query::Node::Type::Or: {
+            PostingList result;
+            for (auto &child : node.children)
+                result = unite(result, evaluate(*child, source));
+            return result;
+        }
+        case Query::Node::Type::Not:
+            return complement(evaluate(*node.children[0], source),
+                              source.numLines());
+        case Query::Node::Type::And:
+            break;
+    }
+    // Evaluate the most selective terms first, and only then strip out any
+    // NOTted terms. We can stop as soon as there's nothing left.
+    std::vector<std::pair<size_t, const Query::Node *>> included;
+    std::vector<const Query::Node *> excluded;
+    for (auto &child : node.children) {
+        if (child->type == Query::Node::Type::Not)
+            excluded.emplace_back(child->children[0].get());
+        else
+            included.emplace_back(estimate(*child, source), child.get());
+    }
+    std::stable_sort(included.begin(), included.end(),
+                     [](const std::pair<size_t, const Query::Node *> &lhs,
+                        const std::pair<size_t, const Query::Node *> &rhs) {
+                         return lhs.first < rhs.first;
+                     });
+    PostingList result;
+    if (included.empty()) {
+        result = complement(PostingList(), source.numLines());
+    } else {
+        result = evaluate(*included[0].second, source);
+        for (size_t i = 1; i < included.size() && !result.empty(); ++i)
+            result = intersect(result, evaluate(*included[i].second, source));
+    }
+    for (auto child : excluded) {
+        if (result.empty()) break;
+        result = subtract(result, evaluate(*child, source));
+    }
+    return result;
+}
+
+std::string toString(const Query::Node &node) {
+    switch (node.type) {
+        case Query::Node::Type::Term: {
+            auto result = node.term.index + ":" + node.term.key;
+            if (node.term.type == Query::Term::Type::Range)
+                result += ".." + node.term.to;
+            else if (node.term.type == Query::Term::Type::Prefix)
+                result += "*";
+            return result;
+        }
+        case Query::Node::Type::Not:
+            return "(NOT " + toString(*node.children[0]) + ")";
+        case Query::Node::Type::And:
+        case Query::Node::Type::Or: {
+            std::string result = node.type == Query::Node::Type::And
+                                 ? "(AND" : "(OR";
+            for (auto &child : node.children)
+                result += " " + toString(*child);
+            return result + ")";
+        }
+    }
+    return "";
+}
+
+}
+
+Query::Query(const std::string &expression, const std::string &defaultIndex)
+        : root_(Parser(expression, defaultIndex).parse()) {}
+
+Query::~Query() {}
+
+Query::Query(Query &&other) : root_(std::move(other.root_)) {}
+
+Query &Query::operator=(Query &&other) {
+    root_ = std::move(other.root_);
+    return *this;
+}
+
+PostingList Query::evaluate(Source &source) const {
+    return ::evaluate(*root_, source);
+}
+
+std::string Query::toString() const {
+    return ::toString(*root_);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "PostingList.h"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+// A boolean query over one or more sub-indexes. A query is made of terms
+// combined with AND, OR and NOT, and grouped with parentheses. NOT binds more
+// tightly than AND, which binds more tightly than OR; terms with no operator
+// between them are ANDed. Each term is one of:
+//   key             lines with the given key in the default index
+//   index:key       lines with the given key in the named index
+//   index:from..to  lines with keys between from and to inclusive
+//   index:prefix*   lines with keys starting with prefix
+// Keys may be double-quoted (for example if they contain spaces, colons or
+// parentheses), in which case they're always matched exactly.
+class Query {
+public:
+    struct Term {
+        enum class Type {
+            Exact, Range, Prefix
+        };
+        Type type;
+        std::string index;
+        std::string key;
+        std::string to;
+    };
+
+    // A Source of the lines matching individual terms.
+    class Source {
+    public:
+        virtual ~Source() = default;
+
+        // Estimate the number of lines matching the term.
+        virtual size_t estimate(const Term &term) = 0;
+        // Return the lines matching the term.
+        virtual PostingList lines(const Term &term) = 0;
+        // Return the number of lines in the file, needed to evaluate NOT.
+        virtual uint64_t numLines() = 0;
+    };
+
+    // Parse a query, throwing std::invalid_argument if it's malformed. Terms
+    // without an index are looked up in the defaultIndex.
+    Query(const std::string &expression, const std::string &defaultIndex);
+    ~Query();
+
+    Query(Query &&other);
+    Query &operator=(Query &&other);
+
+    // Evaluate the query, returning the matching lines. Conjunctions are
+    // evaluated most-selective term first, and stop as soon as nothing
+    // matches.
+    PostingList evaluate(Source &source) const;
+
+    // Return a fully-parenthesised representation of the query.
+    std::string toString() const;
+
+    // The parsed form of the query; opaque outside the implementation.
+    struct Node;
+
+private:
+    std::unique_ptr<Node> root_;
+};
@@ -0,0 +1,256 @@
+#include "QueryServer.h"
+
+#include "Log.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+// The wire format of a request is a 32-bit length followed by that many bytes
+// of NUL-terminated arguments. The client's file descriptors ride along with
+// the first byte. The response is a 32-bit exit code.
+
+namespace {
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+constexpr auto NumFds = 3;
+constexpr uint32_t MaxRequestSize = 64 * 1024 * 1024u;
+
+std::runtime_error error(const std::string &what) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return std::runtime_error(what + ": client timed out");
+    return std::runtime_error(what + ": " + strerror(errno));
+}
+
+// Closes a file descriptor on scope exit.
+struct Fd {
+    int fd;
+
+    explicit Fd(int fd) : fd(fd) {}
+
+    ~Fd() {
+        if (fd >= 0) ::close(fd);
+    }
+
+    Fd(const Fd &) = delete;
+
+    Fd &operator=(const Fd &) = delete;
+};
+
+sockaddr_un addressOf(const std::string &path) {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+        throw std::invalid_argument("Socket path too long: " + path);
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+}
+
+void writeFully(int fd, const char *data, size_t length) {
+    while (length) {
+        auto written = ::send(fd, data, length, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            throw error("Unable to send to socket");
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+// Read exactly length bytes, returning false on a clean end of file first.
+bool readFully(int fd, char *data, size_t length) {
+    while (length) {
+        auto numRead = ::read(fd, data, length);
+        if (numRead < 0) {
+            if (errno == EINTR) continue;
+            throw error("Unable to read from socket");
+        }
+        if (numRead == 0) return false;
+        data += numRead;
+        length -= numRead;
+    }
+    return true;
+}
+
+}
+
+constexpr std::chrono::milliseconds QueryServer::DefaultClientTimeout;
+
+QueryServer::QueryServer(Log &log, std::string path,
+                         std::chrono::milliseconds clientTimeout)
+        : log_(log), path_(std::move(path)), clientTimeout_(clientTimeout),
+          fd_(-1) {
+    auto address = addressOf(path_);
+    // If there's a server already listening we mustn't steal its socket.
+    struct stat existing;
+    if (::stat(path_.c_str(), &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode))
+            throw std::runtime_error(path_ + " exists and isn't a socket");
+        Fd probe(::socket(AF_UNIX, SOCK_STREAM, 0));
+        if (::connect(probe.fd, reinterpret_cast<sockaddr *>(&address),
+                      sizeof(address)) == 0)
+            throw std::runtime_error("A server is already listening on "
+                                     + path_);
+        ::unlink(path_.c_str());
+    }
+    fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd_ < 0) throw error("Unable to create socket");
+    // Only the owner can talk to the server.
+    auto oldMask = ::umask(077);
+    auto bound = ::bind(fd_, reinterpret_cast<sockaddr *>(&address),
+                        sizeof(address));
+    ::umask(oldMask);
+    if (bound != 0 || ::listen(fd_, 64) != 0) {
+        auto e = error("Unable to listen on " + path_);
+        ::close(fd_);
+        throw e;
+    }
+    log_.info("Listening on ", path_);
+}
+
+QueryServer::~QueryServer() {
+    ::close(fd_);
+    ::unlink(path_.c_str());
+}
+
+void QueryServer::serve(const Handler &handler) {
+    for (;;) {
+        try {
+            serveOne(handler);
+        } catch (const std::exception &e) {
+            log_.warn("Failed to serve request: ", e.what());
+        }
+    }
+}
+
+void QueryServer::serveOne(const Handler &handler) {
+    Fd client(::accept(fd_, nullptr, nullptr));
+    if (client.fd < 0) throw error("Unable to accept connection");
+    // Don't let a stalled client hold up everyone else.
+    timeval timeout;
+    timeout.tv_sec = clientTimeout_.count() / 1000;
+    timeout.tv_usec = (clientTimeout_.count() % 1000) * 1000;
+    if (::setsockopt(client.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                     sizeof(timeout)) != 0
+        || ::setsockopt(client.fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                        sizeof(timeout)) != 0)
+        throw error("Unable to set client timeout");
+
+    uint32_t length;
+    char control[CMSG_SPACE(sizeof(int) * NumFds)];
+    iovec iov{&length, sizeof(length)};
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    ssize_t received;
+    do {
+        received = ::recvmsg(client.fd, &message, 0);
+    } while (received < 0 && errno == EINTR);
+    if (received < 0) throw error("Unable to receive request");
+
+    // Just probing to see if we're alive.
+    if (received == 0) return;
+
+    int fds[NumFds] = {-1, -1, -1};
+    for (auto cmsg = CMSG_FIRSTHDR(&message); cmsg;
+         cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+            && cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+    Fd in(fds[0]), out(fds[1]), err(fds[2]);
+    if (in.fd < 0 || out.fd < 0 || err.fd < 0)
+        throw std::runtime_error("Request is missing its file descriptors");
+    if (received < static_cast<ssize_t>(sizeof(length))
+        && !readFully(client.fd, reinterpret_cast<char *>(&length) + received,
+                      sizeof(length) - received))
+        throw std::runtime_error("Truncated request");
+    if (length > MaxRequestSize)
+        throw std::runtime_error("Request too large");
+
+    std::string payload(length, '\0');
+    if (!readFully(client.fd, &payload[0], length))
+        throw std::runtime_error("Truncated request");
+    std::vector<std::string> args;
+    for (size_t pos = 0; pos < payload.size();) {
+        auto end = payload.find('\0', pos);
+        if (end == std::string::npos) end = payload.size();
+        args.emplace_back(payload, pos, end - pos);
+        pos = end + 1;
+    }
+
+    int32_t result;
+    try {
+        result = handler(args, in.fd, out.fd, err.fd);
+    } catch (const std::exception &e) {
+        log_.warn("Request failed: ", e.what());
+        result = 1;
+    }
+    writeFully(client.fd, reinterpret_cast<const char *>(&result),
+               sizeof(result));
+}
+
+int QueryServer::request(const std::string &path,
+                         const std::vector<std::string> &args,
+                         int inFd, int outFd, int errFd) {
+    auto address = addressOf(path);
+    Fd server(::socket(AF_UNIX, SOCK_STREAM, 0));
+    if (server.fd < 0) throw error("Unable to create socket");
+    if (::connect(server.fd, reinterpret_cast<sockaddr *>(&address),
+                  sizeof(address)) != 0)
+        throw error("Unable to connect to " + path);
+
+    std::string payload;
+    for (auto &arg : args) {
+        payload += arg;
+        payload += '\0';
+    }
+    if (payload.size() > MaxRequestSize)
+        throw std::runtime_error("Request too large");
+    uint32_t length = payload.size();
+
+    int fds[NumFds] = {inFd, outFd, errFd};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    iovec iov{&length, sizeof(length)};
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    auto cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    ssize_t sent;
+    do {
+        sent = ::sendmsg(server.fd, &message, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    if (sent < 0) throw error("Unable to send request");
+    writeFully(server.fd, reinterpret_cast<const char *>(&length) + sent,
+               sizeof(length) - sent);
+    writeFully(server.fd, payload.data(), payload.size());
+
+    int32_t result;
+    if (!readFully(server.fd, reinterpret_cast<char *>(&result),
+                   sizeof(result)))
+        throw std::runtime_error("Server closed the connection");
+    return result;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+class Log;
+
+// Serves requests over a unix domain socket. A request is a list of arguments,
+// sent along with the client's standard input, output and error file
+// descriptors; the response is the handler's exit code. Requests are handled
+// one at a time, so handlers can keep state such as open indexes and warm
+// decompression contexts between requests without any locking. As one client
+// holds up all the others, a client that stalls sending its request or taking
+// its reply is dropped after a timeout.
+class QueryServer {
+    Log &log_;
+    std::string path_;
+    std::chrono::milliseconds clientTimeout_;
+    int fd_;
+
+public:
+    // Handles a request, reading from and writing to the given file
+    // descriptors, and returning the exit code for the client.
+    using Handler = std::function<int(const std::vector<std::string> &args,
+                                      int inFd, int outFd, int errFd)>;
+
+    static constexpr std::chrono::milliseconds DefaultClientTimeout{10000};
+
+    // Listen on a socket at path, replacing any stale socket left there.
+    QueryServer(Log &log, std::string path,
+                std::chrono::milliseconds clientTimeout = DefaultClientTimeout);
+    // Stop listening and remove the socket.
+    ~QueryServer();
+
+    QueryServer(const QueryServer &) = delete;
+    QueryServer &operator=(const QueryServer &) = delete;
+
+    // Handle requests forever.
+    void serve(const Handler &handler);
+    // Wait for and handle a single request.
+    void serveOne(const Handler &handler);
+
+    // Send a request to the server listening at path, passing it the given
+    // file descriptors. Returns the exit code from the server.
+    static int request(const std::string &path,
+                       const std::vector<std::string> &args,
+                       int inFd, int outFd, int errFd);
+};
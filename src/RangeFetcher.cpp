@@ -22,8 +22,8 @@ void RangeFetcher::operator()(uint64_t line) {
         if (prevEnd_ && prevEnd_ + 1 != beginRange)
             handler_.onSeparator();
     }
-    for (; currentLine <= endRange; ++currentLine)
-        handler_.onLine(currentLine);
+    if (currentLine <= endRange)
+        handler_.onRange(currentLine, endRange);
     prevBegin_ = beginRange;
     prevEnd_ = endRange;
 }
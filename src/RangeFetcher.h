@@ -4,8 +4,8 @@
 
 // A RangeFetcher is usable as an Index::LineFunction, and extends each matching
 // line number into a range from line-linesBefore to line+linesAfter, but with
-// overlapping regions removed. The Handler is called with each line and upon
-// separation of ranges.
+// overlapping regions removed. The Handler is called with each range of lines
+// and upon separation of ranges.
 class RangeFetcher {
     const uint64_t linesBefore_;
     const uint64_t linesAfter_;
@@ -20,6 +20,12 @@ public:
 
         // Called for each line within a group.
         virtual void onLine(uint64_t line) = 0;
+        // Called with each run of consecutive lines, first to last inclusive.
+        // By default calls onLine for each, but handlers able to fetch a range
+        // in one go can override it.
+        virtual void onRange(uint64_t first, uint64_t last) {
+            for (auto line = first; line <= last; ++line) onLine(line);
+        }
         // Called between each group.
         virtual void onSeparator() = 0;
     };
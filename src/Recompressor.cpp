@@ -0,0 +1,153 @@
+#include "Recompressor.h"
+
+#include "Log.h"
+#include "PrettyBytes.h"
+#include "ZlibError.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+constexpr auto ChunkSize = 16384u;
+constexpr auto GzipWindowBits = 15 + 16;
+constexpr auto ZlibOrGzipWindowBits = 15 + 32;
+
+void X(int zlibErr) {
+    if (zlibErr != Z_OK) throw ZlibError(zlibErr);
+}
+
+struct Inflater {
+    z_stream stream;
+
+    Inflater() {
+        memset(&stream, 0, sizeof(stream));
+        X(inflateInit2(&stream, ZlibOrGzipWindowBits));
+    }
+
+    ~Inflater() {
+        (void)inflateEnd(&stream);
+    }
+
+    Inflater(Inflater &) = delete;
+
+    Inflater &operator=(Inflater &) = delete;
+};
+
+struct Deflater {
+    z_stream stream;
+
+    explicit Deflater(int level) {
+        memset(&stream, 0, sizeof(stream));
+        X(deflateInit2(&stream, level, Z_DEFLATED, GzipWindowBits, 8,
+                       Z_DEFAULT_STRATEGY));
+    }
+
+    ~Deflater() {
+        (void)deflateEnd(&stream);
+    }
+
+    Deflater(Deflater &) = delete;
+
+    Deflater &operator=(Deflater &) = delete;
+};
+
+void write(File &to, const uint8_t *data, size_t length) {
+    if (::fwrite(data, 1, length, to.get()) != length)
+        throw std::runtime_error("Error writing recompressed file"); // todo errno
+}
+
+}
+
+Recompressor::Recompressor(Log &log, uint64_t blockSize, int level)
+        : log_(log), blockSize_(blockSize), level_(level) {
+    if (blockSize_ == 0)
+        throw std::invalid_argument("Block size must be non-zero");
+}
+
+uint64_t Recompressor::recompress(File &from, File &to) {
+    log_.info("Recompressing into blocks of ", PrettyBytes(blockSize_));
+    Inflater inflater;
+    Deflater deflater(level_);
+    uint8_t input[ChunkSize];
+    uint8_t output[ChunkSize];
+    std::vector<uint8_t> pending;
+    pending.reserve(blockSize_ + ChunkSize);
+    uint64_t members = 0;
+
+    // Compress the first length bytes of pending data as a complete gzip
+    // member of its own.
+    auto emitMember = [&](size_t length) {
+        auto &zs = deflater.stream;
+        X(deflateReset(&zs));
+        zs.next_in = pending.data();
+        zs.avail_in = static_cast<uInt>(length);
+        int ret;
+        do {
+            zs.next_out = output;
+            zs.avail_out = ChunkSize;
+            ret = deflate(&zs, Z_FINISH);
+            if (ret == Z_STREAM_ERROR) throw ZlibError(ret);
+            write(to, output, ChunkSize - zs.avail_out);
+        } while (ret != Z_STREAM_END);
+        pending.erase(pending.begin(), pending.begin() + length);
+        ++members;
+    };
+    // How much of the pending data is known to have no newline to end a
+    // member at, so a long line isn't searched again with each chunk.
+    size_t searched = 0;
+    // Emit members for as long as we have at least a block's worth of data
+    // ending in a newline.
+    auto emitWholeLines = [&] {
+        while (pending.size() >= blockSize_) {
+            auto searchFrom = pending.data()
+                              + std::max<size_t>(blockSize_ - 1, searched);
+            auto newline = static_cast<const uint8_t *>(
+                    memchr(searchFrom, '\n',
+                           pending.data() + pending.size() - searchFrom));
+            if (!newline) {
+                searched = pending.size();
+                return;
+            }
+            emitMember(newline - pending.data() + 1);
+            searched = 0;
+        }
+    };
+
+    auto &zs = inflater.stream;
+    int ret = Z_OK;
+    bool midStream = false;
+    for (;;) {
+        if (zs.avail_in == 0) {
+            zs.avail_in = ::fread(input, 1, ChunkSize, from.get());
+            if (ferror(from.get())) throw ZlibError(Z_ERRNO);
+            if (zs.avail_in == 0) {
+                if (!midStream) break;
+                throw ZlibError(Z_DATA_ERROR); // truncated input
+            }
+            zs.next_in = input;
+        }
+        if (ret == Z_STREAM_END) {
+            // Concatenated gzip files: carry on with the next one.
+            X(inflateReset(&zs));
+        }
+        midStream = true;
+        zs.next_out = output;
+        zs.avail_out = ChunkSize;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret == Z_NEED_DICT) throw ZlibError(Z_DATA_ERROR);
+        if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR) throw ZlibError(ret);
+        if (ret == Z_STREAM_END) midStream = false;
+        pending.insert(pending.end(), output, output + ChunkSize - zs.avail_out);
+        emitWholeLines();
+    }
+    if (!pending.empty()) emitMember(pending.size());
+    if (fflush(to.get()) != 0)
+        throw std::runtime_error("Error writing recompressed file"); // todo errno
+    log_.info("Recompressed into ", members, " gzip members");
+    return members;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "File.h"
+
+#include <cstdint>
+
+class Log;
+
+// Re-encodes a gzip (or zlib) compressed file as a series of concatenated gzip
+// members, each holding roughly blockSize bytes of whole lines. Each member can
+// be decompressed independently of those before it, so an index built on the
+// result needs no decompression windows, and random access only ever has to
+// inflate from the start of a single member. The output is still a valid gzip
+// file, readable by zcat and friends.
+class Recompressor {
+    Log &log_;
+    uint64_t blockSize_;
+    int level_;
+
+public:
+    static constexpr uint64_t DefaultBlockSize = 1024 * 1024u;
+
+    explicit Recompressor(Log &log, uint64_t blockSize = DefaultBlockSize,
+                          int level = 6);
+
+    // Recompress all of from into to. Returns the number of gzip members
+    // written.
+    uint64_t recompress(File &from, File &to);
+};
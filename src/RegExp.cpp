@@ -40,6 +40,13 @@ bool RegExp::exec(const char *against, RegExp::Matches &result, bool bol) {
     return true;
 }
 
+bool RegExp::matches(const char *against) {
+    auto res = regexec(&re_, against, 0, nullptr, 0);
+    if (res == REG_NOMATCH) return false;
+    R(res);
+    return true;
+}
+
 void RegExp::R(int e) const {
     if (!e) return;
     char error[1024];
@@ -25,6 +25,8 @@ public:
     using Matches = std::vector<Match>;
     bool exec(const std::string &against, Matches &result, size_t offset = 0);
     bool exec(const char *against, Matches &result, bool bol=true);
+    // Just whether there's a match, which is quicker than finding where.
+    bool matches(const char *against);
 
 private:
     void release();
@@ -98,7 +98,8 @@ int64_t Sqlite::Statement::columnInt64(int index) const {
 }
 
 std::string Sqlite::Statement::columnString(int index) const {
-    return (const char *)sqlite3_column_text(statement_, index);
+    auto text = (const char *)sqlite3_column_text(statement_, index);
+    return text ? text : "";
 }
 
 int Sqlite::Statement::columnCount() const {
@@ -126,6 +127,11 @@ std::vector<uint8_t> Sqlite::Statement::columnBlob(int index) const {
     return data;
 }
 
+StringView Sqlite::Statement::columnBlobView(int index) const {
+    auto ptr = static_cast<const char *>(sqlite3_column_blob(statement_, index));
+    return StringView(ptr, sqlite3_column_bytes(statement_, index));
+}
+
 void Sqlite::exec(const std::string &sql) {
     log_->debug("Executing ", sql);
     R(sqlite3_exec(sql_, sql.c_str(), nullptr, nullptr, nullptr), sql);
@@ -149,7 +155,9 @@ void Sqlite::Statement::R(int result) const {
 std::string Sqlite::toFile(const std::string &uri) {
     RegExp uriRegex("^(([^:/?#]+):)?(//([^/?#]*))?([^?#]*)");
     RegExp::Matches matches;
-    if (!uriRegex.exec(uri, matches)) {
+    // Unmatched groups are omitted from matches, so a plain path yields no
+    // protocol group at all.
+    if (!uriRegex.exec(uri, matches) || matches.size() < 3) {
         return uri;
     }
     auto protocol = matches[1];
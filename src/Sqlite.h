@@ -71,8 +71,12 @@ public:
         std::string columnName(int index) const;
 
         int64_t columnInt64(int index) const;
+        // A NULL column reads as an empty string.
         std::string columnString(int index) const;
         std::vector<uint8_t> columnBlob(int index) const;
+        // Return a view of a blob column without copying it. The view is only
+        // valid until the statement is next stepped, reset or destroyed.
+        StringView columnBlobView(int index) const;
 
     private:
         int P(StringView param) const;
@@ -0,0 +1,49 @@
+#include "StatementCache.h"
+
+StatementCache::Lease::Lease(StatementCache &cache, std::string sql,
+                             Sqlite::Statement &&statement)
+        : cache_(&cache), sql_(std::move(sql)),
+          statement_(std::move(statement)) {}
+
+StatementCache::Lease::~Lease() {
+    if (cache_) cache_->release(std::move(sql_), std::move(statement_));
+}
+
+StatementCache::Lease::Lease(Lease &&other)
+        : cache_(other.cache_), sql_(std::move(other.sql_)),
+          statement_(std::move(other.statement_)) {
+    other.cache_ = nullptr;
+}
+
+StatementCache::StatementCache(const Sqlite &db, size_t capacity)
+        : db_(db), capacity_(capacity), prepared_(0) {}
+
+StatementCache::Lease StatementCache::get(const std::string &sql) {
+    auto found = bySql_.find(sql);
+    if (found == bySql_.end()) {
+        auto statement = db_.prepare(sql);
+        ++prepared_;
+        return Lease(*this, sql, std::move(statement));
+    }
+    auto statement = std::move(found->second->second);
+    entries_.erase(found->second);
+    bySql_.erase(found);
+    return Lease(*this, sql, std::move(statement));
+}
+
+void StatementCache::release(std::string &&sql,
+                             Sqlite::Statement &&statement) {
+    // Called from Lease's destructor, so never throws: on any error the
+    // statement is simply finalised rather than cached.
+    try {
+        statement.reset();
+        if (capacity_ == 0 || bySql_.count(sql)) return;
+        entries_.emplace_front(std::move(sql), std::move(statement));
+        bySql_.emplace(entries_.front().first, entries_.begin());
+        if (entries_.size() > capacity_) {
+            bySql_.erase(entries_.back().first);
+            entries_.pop_back();
+        }
+    } catch (...) {
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "Sqlite.h"
+
+#include <cstddef>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+// A bounded cache of prepared statements, keyed by their SQL, so repeated
+// queries skip sqlite's parsing and planning. Statements are lent out for the
+// duration of a query and returned, reset, when the Lease is destroyed; the
+// least recently used are finalised once more than capacity are idle. Nested
+// uses of the same SQL each get their own statement.
+class StatementCache {
+public:
+    static constexpr size_t DefaultCapacity = 64;
+
+    // A statement borrowed from the cache.
+    class Lease {
+        StatementCache *cache_;
+        std::string sql_;
+        Sqlite::Statement statement_;
+
+        friend class StatementCache;
+
+        Lease(StatementCache &cache, std::string sql,
+              Sqlite::Statement &&statement);
+
+    public:
+        ~Lease();
+        Lease(Lease &&other);
+        Lease(const Lease &) = delete;
+        Lease &operator=(const Lease &) = delete;
+
+        Sqlite::Statement &operator*() { return statement_; }
+        Sqlite::Statement *operator->() { return &statement_; }
+    };
+
+    explicit StatementCache(const Sqlite &db,
+                            size_t capacity = DefaultCapacity);
+
+    // Borrow a statement for the given SQL, preparing it if there's no idle
+    // one cached.
+    Lease get(const std::string &sql);
+
+    // The number of idle statements in the cache.
+    size_t size() const { return entries_.size(); }
+    // The number of statements prepared so far.
+    size_t prepared() const { return prepared_; }
+
+private:
+    using Entry = std::pair<std::string, Sqlite::Statement>;
+
+    const Sqlite &db_;
+    size_t capacity_;
+    size_t prepared_;
+    // Most recently used first.
+    std::list<Entry> entries_;
+    std::unordered_map<std::string, std::list<Entry>::iterator> bySql_;
+
+    void release(std::string &&sql, Sqlite::Statement &&statement);
+};
@@ -0,0 +1,206 @@
+#include "Trigrams.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+
+namespace {
+
+using Alternatives = std::vector<std::vector<Trigram>>;
+
+bool parseAlternatives(const std::string &regex, size_t &pos,
+                       Alternatives &result);
+
+void addTrigrams(const std::string &run, std::vector<Trigram> &trigrams) {
+    for (size_t i = 0; i + 3 <= run.size(); ++i)
+        trigrams.push_back(makeTrigram(run.data() + i));
+}
+
+// The smallest number of repeats a bound such as {2,5} at pos allows, or -1 if
+// there's no bound there.
+int boundMinimum(const std::string &regex, size_t pos) {
+    if (pos + 1 >= regex.size() || regex[pos] != '{'
+        || !isdigit(static_cast<unsigned char>(regex[pos + 1])))
+        return -1;
+    return atoi(regex.c_str() + pos + 1);
+}
+
+// Whether the atom before pos may be repeated no times at all.
+bool optional(const std::string &regex, size_t pos) {
+    return pos < regex.size()
+           && (regex[pos] == '*' || regex[pos] == '?'
+               || boundMinimum(regex, pos) == 0);
+}
+
+// Skip a bracket expression such as [^]a-z[:digit:]], from just after its
+// opening '['.
+void skipBracket(const std::string &regex, size_t &pos) {
+    if (pos < regex.size() && regex[pos] == '^') ++pos;
+    if (pos < regex.size() && regex[pos] == ']') ++pos;
+    while (pos < regex.size() && regex[pos] != ']') {
+        if (regex[pos] == '[' && pos + 1 < regex.size()
+            && (regex[pos + 1] == ':' || regex[pos + 1] == '.'
+                || regex[pos + 1] == '=')) {
+            auto close = regex.find(std::string{regex[pos + 1], ']'}, pos + 2);
+            pos = close == std::string::npos ? regex.size() : close + 2;
+        } else {
+            ++pos;
+        }
+    }
+    if (pos < regex.size()) ++pos;
+}
+
+// Gather the trigrams required by a sequence of atoms, up to the end of the
+// regex, a '|' or a ')'.
+void parseSequence(const std::string &regex, size_t &pos,
+                   std::vector<Trigram> &trigrams) {
+    // The current run of literal text, which every match contains.
+    std::string run;
+    // Whether the last atom was a literal character, the last of the run.
+    bool literal = false;
+    auto endRun = [&] {
+        addTrigrams(run, trigrams);
+        run.clear();
+        literal = false;
+    };
+    while (pos < regex.size() && regex[pos] != '|' && regex[pos] != ')') {
+        auto c = regex[pos++];
+        switch (c) {
+            case '\\':
+                // Escaped letters and digits are classes, word boundaries and
+                // back references rather than themselves.
+                if (pos < regex.size()
+                    && !isalnum(static_cast<unsigned char>(regex[pos]))) {
+                    run += regex[pos++];
+                    literal = true;
+                } else {
+                    if (pos < regex.size()) ++pos;
+                    endRun();
+                }
+                break;
+            case '(': {
+                endRun();
+                Alternatives group;
+                auto known = parseAlternatives(regex, pos, group);
+                if (pos < regex.size()) ++pos;
+                // Only a group without alternatives must always match the
+                // same text.
+                if (known && group.size() == 1 && !optional(regex, pos)) {
+                    trigrams.insert(trigrams.end(), group[0].begin(),
+                                    group[0].end());
+                }
+                break;
+            }
+            case '[':
+                endRun();
+                skipBracket(regex, pos);
+                break;
+            case '*':
+            case '?':
+                if (literal) run.pop_back();
+                endRun();
+                break;
+            case '+':
+                // The character is repeated at least once, so starts the next
+                // run as well as ending this one.
+                if (literal) {
+                    auto last = run.back();
+                    endRun();
+                    run += last;
+                    literal = true;
+                }
+                break;
+            case '{': {
+                auto minimum = boundMinimum(regex, pos - 1);
+                if (minimum < 0) {
+                    run += c;
+                    literal = true;
+                    break;
+                }
+                auto close = regex.find('}', pos);
+                pos = close == std::string::npos ? regex.size() : close + 1;
+                if (literal) {
+                    auto last = run.back();
+                    if (minimum == 0) run.pop_back();
+                    endRun();
+                    if (minimum > 0) {
+                        run += last;
+                        literal = true;
+                    }
+                }
+                break;
+            }
+            case '.':
+            case '^':
+            case '$':
+                endRun();
+                break;
+            default:
+                run += c;
+                literal = true;
+                break;
+        }
+    }
+    endRun();
+}
+
+// Gather the alternatives from pos up to the end of the regex, or the ')'
+// closing the group they're in. Returns false if any of them requires no
+// trigrams at all.
+bool parseAlternatives(const std::string &regex, size_t &pos,
+                       Alternatives &result) {
+    auto known = true;
+    for (;;) {
+        std::vector<Trigram> trigrams;
+        parseSequence(regex, pos, trigrams);
+        std::sort(trigrams.begin(), trigrams.end());
+        trigrams.erase(std::unique(trigrams.begin(), trigrams.end()),
+                       trigrams.end());
+        if (trigrams.empty()) known = false;
+        else result.emplace_back(std::move(trigrams));
+        if (pos == regex.size() || regex[pos] != '|') return known;
+        ++pos;
+    }
+}
+
+}
+
+bool requiredTrigrams(const std::string &regex, Alternatives &alternatives) {
+    alternatives.clear();
+    size_t pos = 0;
+    auto known = parseAlternatives(regex, pos, alternatives);
+    // Stopping early means an unmatched ')', which is best left to the regex
+    // library to make sense of.
+    if (!known || pos != regex.size()) {
+        alternatives.clear();
+        return false;
+    }
+    return true;
+}
+
+TrigramBlocks::TrigramBlocks(uint64_t blockLines)
+        : blockLines_(blockLines), seen_((1u << 24) / 64) {}
+
+void TrigramBlocks::add(uint64_t line, const char *text, size_t length) {
+    auto block = (line - 1) / blockLines_;
+    if (block != block_) {
+        finish();
+        block_ = block;
+    }
+    for (size_t i = 0; i + 3 <= length; ++i) {
+        auto trigram = makeTrigram(text + i);
+        auto &word = seen_[trigram / 64];
+        auto bit = uint64_t(1) << (trigram % 64);
+        if (word & bit) continue;
+        word |= bit;
+        inBlock_.push_back(trigram);
+    }
+}
+
+void TrigramBlocks::finish() {
+    for (auto trigram : inBlock_) {
+        blocks_[trigram].add(block_);
+        seen_[trigram / 64] &= ~(uint64_t(1) << (trigram % 64));
+    }
+    inBlock_.clear();
+}
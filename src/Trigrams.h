@@ -0,0 +1,52 @@
+#pragma once
+
+#include "PostingCodec.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A trigram is three consecutive bytes of a line, packed into an integer. An
+// index of the blocks of lines each trigram appears in narrows a regular
+// expression search down to the blocks which could possibly match.
+using Trigram = uint32_t;
+
+inline Trigram makeTrigram(const char *bytes) {
+    return static_cast<Trigram>(static_cast<uint8_t>(bytes[0])) << 16
+           | static_cast<Trigram>(static_cast<uint8_t>(bytes[1])) << 8
+           | static_cast<uint8_t>(bytes[2]);
+}
+
+// Find the trigrams a line must contain to match a POSIX extended regular
+// expression, as a list of alternatives: any matching line has all the
+// trigrams of at least one of them. Returns false if there's no telling, as
+// when part of the regex can match without any literal text.
+bool requiredTrigrams(const std::string &regex,
+                      std::vector<std::vector<Trigram>> &alternatives);
+
+// Collects the distinct trigrams in each block of blockLines lines, as a
+// posting list of the (zero-based) blocks each trigram appears in. Lines must
+// be added in order.
+class TrigramBlocks {
+    const uint64_t blockLines_;
+    uint64_t block_ = 0;
+    // A bit for each possible trigram, set for those in the current block.
+    std::vector<uint64_t> seen_;
+    std::vector<Trigram> inBlock_;
+    std::unordered_map<Trigram, PostingEncoder> blocks_;
+
+public:
+    explicit TrigramBlocks(uint64_t blockLines);
+
+    // Add a line, numbered from 1.
+    void add(uint64_t line, const char *text, size_t length);
+    // Finish the last block. Call once all the lines have been added.
+    void finish();
+
+    uint64_t blockLines() const { return blockLines_; }
+    const std::unordered_map<Trigram, PostingEncoder> &blocks() const {
+        return blocks_;
+    }
+};
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <zlib.h>
+
+// An exception in zlib.
+struct ZlibError : std::runtime_error {
+    explicit ZlibError(int result) :
+            std::runtime_error(
+                    std::string("Error from zlib : ") + zError(result)) {}
+};
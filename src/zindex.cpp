@@ -1,15 +1,19 @@
+#include "Catalog.h"
 #include "File.h"
 #include "Index.h"
 #include "RegExpIndexer.h"
 #include "ConsoleLog.h"
 #include "FieldIndexer.h"
 #include "IndexParser.h"
+#include "Recompressor.h"
 
 #include <tclap/CmdLine.h>
 
 #include <iostream>
 #include <stdexcept>
 #include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "ExternalIndexer.h"
 
 using namespace std;
@@ -24,9 +28,70 @@ string getRealPath(const string &relPath) {
     return string(relPath);
 }
 
+// The JSON of an indexer's config, as IndexParser reads, for indexes which
+// make their indexer again at query time. Takes ownership of the config.
+string toJson(cJSON *config) {
+    auto json = cJSON_PrintUnformatted(config);
+    string result(json);
+    free(json);
+    cJSON_Delete(config);
+    return result;
+}
+
+// Recompress the file at path in place, via a temporary file which replaces
+// the original only once it has been completely written.
+void rewrite(Log &log, File &in, const string &path, uint64_t blockSize) {
+    auto tempPath = path + ".rewrite.tmp";
+    File out(fopen(tempPath.c_str(), "wb"));
+    if (out.get() == nullptr)
+        throw runtime_error("Could not open " + tempPath + " for writing");
+    try {
+        Recompressor(log, blockSize).recompress(in, out);
+        struct stat stats;
+        if (fstat(fileno(in.get()), &stats) == 0)
+            fchmod(fileno(out.get()), stats.st_mode);
+        out.reset();
+        if (rename(tempPath.c_str(), path.c_str()) != 0)
+            throw runtime_error("Unable to replace " + path); // todo errno
+    } catch (...) {
+        unlink(tempPath.c_str());
+        throw;
+    }
+}
+
+}
+
+int CatalogMain(int argc, const char *argv[]) {
+    CmdLine cmd("Gather the key summaries of all the indexes in a directory "
+                "into a catalog, which zq uses to skip files which can't "
+                "match a query");
+    ValueArg<string> catalogArg("", "catalog", "Catalog the indexes in "
+            "<directory>", true, "", "directory", cmd);
+    SwitchArg verbose("v", "verbose", "Be more verbose", cmd);
+    SwitchArg debug("", "debug", "Be even more verbose", cmd);
+    SwitchArg forceColour("", "colour", "Use colour even on non-TTY", cmd);
+    SwitchArg forceColor("", "color", "Use color even on non-TTY", cmd);
+    cmd.parse(argc, argv);
+
+    ConsoleLog log(
+            debug.isSet() ? Log::Severity::Debug : verbose.isSet()
+                                                   ? Log::Severity::Info
+                                                   : Log::Severity::Warning,
+            forceColour.isSet() || forceColor.isSet(), false);
+    try {
+        auto numIndexes = Catalog::build(log, catalogArg.getValue());
+        log.info("Catalogued ", numIndexes, " indexes");
+    } catch (const exception &e) {
+        log.error(e.what());
+        return 1;
+    }
+    return 0;
 }
 
 int Main(int argc, const char *argv[]) {
+    if (argc > 1 && string(argv[1]).compare(0, 9, "--catalog") == 0)
+        return CatalogMain(argc, argv);
+
     CmdLine cmd("Create indices in a compressed text file");
     UnlabeledValueArg<string> inputFile(
             "input-file", "Read input from <file>", true, "", "file", cmd);
@@ -73,6 +138,48 @@ int Main(int argc, const char *argv[]) {
                     "(man stdbuf(1) for one way of doing this).\n"
                     "Example:  --pipe 'jq --raw-output --unbuffered .eventId')",
             false, "", "CMD", cmd);
+    SwitchArg rewriteArg(
+            "", "rewrite",
+            "Recompress the file in place as a series of independently "
+                    "decompressible gzip blocks of whole lines before "
+                    "indexing, for much faster random access. The block size "
+                    "is taken from --checkpoint-every (default 1MiB). "
+                    "The result is still a valid gzip file", cmd);
+    SwitchArg lineCheckpoints(
+            "", "line-checkpoints",
+            "Don't store the offset of every line: only store the first line "
+                    "at each checkpoint, and find lines by scanning forward "
+                    "from there. Makes for much smaller indexes, but slower "
+                    "line lookups", cmd);
+    ValueArg<uint64_t> trigrams(
+            "", "trigrams",
+            "Also index the trigrams (three character substrings) in each "
+                    "block of <lines> lines, so zq --grep only decompresses "
+                    "the blocks which could match. 1000 is a good start",
+            false, 0, "lines", cmd);
+    SwitchArg postingLists(
+            "", "posting-lists",
+            "Store a compressed list of the lines with each key, rather than "
+                    "an entry for every line. Makes for a much smaller index "
+                    "when there are few distinct keys, such as log levels",
+            cmd);
+    SwitchArg clustered(
+            "", "clustered",
+            "Store the index table in key order, without a separate index of "
+                    "the keys. Makes for a smaller index and quicker key "
+                    "lookups", cmd);
+    SwitchArg dictionary(
+            "", "dictionary",
+            "Store each distinct key once, and just a number for it against "
+                    "each line. Makes for a much smaller index when long keys "
+                    "are repeated on many lines. Not for --numeric indexes",
+            cmd);
+    SwitchArg hashed(
+            "", "hashed",
+            "Store a 64-bit hash of each key rather than the key itself. "
+                    "Makes for a much smaller index of long keys, but only "
+                    "exact keys can be looked up. Not for --numeric indexes",
+            cmd);
     ValueArg<string> indexFilename("", "index-file",
                                    "Store index in <index-file> "
                                            "(default <file>.zindex)", false, "",
@@ -95,17 +202,35 @@ int Main(int argc, const char *argv[]) {
             log.error("Could not open ", inputFile.getValue(), " for reading");
             return 1;
         }
+        if (rewriteArg.isSet()) {
+            rewrite(log, in, realPath,
+                    checkpointEvery.isSet() ? checkpointEvery.getValue()
+                                            : Recompressor::DefaultBlockSize);
+            in.reset(fopen(realPath.c_str(), "rb"));
+            if (in.get() == nullptr) {
+                log.error("Could not reopen ", realPath, " after rewriting");
+                return 1;
+            }
+        }
 
         auto outputFile = indexFilename.isSet() ? indexFilename.getValue() :
                           inputFile.getValue() + ".zindex";
         Index::Builder builder(log, move(in), realPath, outputFile);
         if (skipFirst.isSet())
             builder.skipFirst(skipFirst.getValue());
+        if (lineCheckpoints.isSet())
+            builder.storeLineOffsets(false);
+        if (trigrams.isSet())
+            builder.indexTrigrams(trigrams.getValue());
 
         Index::IndexConfig config{};
         config.numeric = numeric.isSet();
         config.unique = unique.isSet();
         config.sparse = sparse.isSet();
+        config.postingLists = postingLists.isSet();
+        config.clustered = clustered.isSet();
+        config.dictionary = dictionary.isSet();
+        config.hashed = hashed.isSet();
         //config.indexLineOffsets = // TODO - add command line flag if desired
 
         auto delimiter = delimiterArg.getValue();
@@ -125,17 +250,40 @@ int Main(int argc, const char *argv[]) {
                         "Sorry; multiple indices must be defined by an "
                                 "indexes file - see '-i' option");
             }
+            // Hashed indexes check their keys with the indexer again.
+            auto withConfig = [&](cJSON *indexerConfig) {
+                if (!config.hashed) {
+                    cJSON_Delete(indexerConfig);
+                    return config;
+                }
+                return Index::IndexConfig(config).withIndexerConfig(
+                        toJson(indexerConfig));
+            };
             if (regex.isSet()) {
+                auto indexerConfig = cJSON_CreateObject();
+                cJSON_AddStringToObject(indexerConfig, "type", "regex");
+                cJSON_AddStringToObject(indexerConfig, "regex",
+                                        regex.getValue().c_str());
+                cJSON_AddNumberToObject(indexerConfig, "capture",
+                                        capture.getValue());
                 auto regexIndexer = new RegExpIndexer(regex.getValue(),
                                                       capture.getValue());
-                builder.addIndexer("default", regex.getValue(), config,
+                builder.addIndexer("default", regex.getValue(),
+                                   withConfig(indexerConfig),
                                    std::unique_ptr<LineIndexer>(regexIndexer));
             }
             if (field.isSet()) {
                 ostringstream name;
                 name << "Field " << field.getValue() << " delimited by '"
                      << delimiter << "'";
-                builder.addIndexer("default", name.str(), config,
+                auto indexerConfig = cJSON_CreateObject();
+                cJSON_AddStringToObject(indexerConfig, "type", "field");
+                cJSON_AddStringToObject(indexerConfig, "delimiter",
+                                        delimiter.c_str());
+                cJSON_AddNumberToObject(indexerConfig, "fieldNum",
+                                        field.getValue());
+                builder.addIndexer("default", name.str(),
+                                   withConfig(indexerConfig),
                                    std::unique_ptr<LineIndexer>(
                                            new FieldIndexer(
                                                    delimiter,
@@ -146,11 +294,20 @@ int Main(int argc, const char *argv[]) {
                         new ExternalIndexer(log,
                                             externalIndexer.getValue(),
                                             delimiter));
+                auto indexerConfig = cJSON_CreateObject();
+                cJSON_AddStringToObject(indexerConfig, "type", "pipe");
+                cJSON_AddStringToObject(indexerConfig, "command",
+                                        externalIndexer.getValue().c_str());
+                cJSON_AddStringToObject(indexerConfig, "delimiter",
+                                        delimiter.c_str());
                 builder.addIndexer("default", externalIndexer.getValue(),
-                                   config, std::move(indexer));
+                                   withConfig(indexerConfig),
+                                   std::move(indexer));
             }
         }
-        if (checkpointEvery.isSet())
+        // A rewritten file gets a window-free checkpoint at the start of every
+        // block; there's no need for any more.
+        if (checkpointEvery.isSet() && !rewriteArg.isSet())
             builder.indexEvery(checkpointEvery.getValue());
         builder.build();
     } catch (const exception &e) {
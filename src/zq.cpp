@@ -1,13 +1,37 @@
+#include "Catalog.h"
 #include "File.h"
 #include "Index.h"
 #include "LineSink.h"
+#include "OutputBuffer.h"
 #include "ConsoleLog.h"
+#include "Parallel.h"
+#include "QueryServer.h"
 
 #include <tclap/CmdLine.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 #include "RangeFetcher.h"
 
 using namespace std;
@@ -16,13 +40,21 @@ using namespace TCLAP;
 namespace {
 
 struct PrintSink : LineSink {
+    OutputBuffer &out;
+    const std::string prefix;
     bool printLineNum;
 
-    explicit PrintSink(bool printLineNum) : printLineNum(printLineNum) { }
+    PrintSink(OutputBuffer &out, std::string prefix, bool printLineNum)
+            : out(out), prefix(std::move(prefix)),
+              printLineNum(printLineNum) { }
 
     bool onLine(size_t l, size_t, const char *line, size_t length) override {
-        if (printLineNum) cout << l << ":";
-        cout << string(line, length) << endl;
+        out.write(prefix.data(), prefix.size());
+        if (printLineNum) {
+            out.writeNumber(l);
+            out.write(":", 1);
+        }
+        out.writeLine(line, length);
         return true;
     }
 };
@@ -30,24 +62,314 @@ struct PrintSink : LineSink {
 struct PrintHandler : RangeFetcher::Handler {
     Index &index;
     LineSink &sink;
+    OutputBuffer &out;
     const bool printSep;
     const std::string sep;
 
-    PrintHandler(Index &index, LineSink &sink, bool printSep,
-                 std::string sep)
-            : index(index), sink(sink), printSep(printSep),
+    PrintHandler(Index &index, LineSink &sink, OutputBuffer &out,
+                 bool printSep, std::string sep)
+            : index(index), sink(sink), out(out), printSep(printSep),
               sep(std::move(sep)) { }
 
     void onLine(uint64_t line) override {
         index.getLine(line, sink);
     }
 
+    void onRange(uint64_t first, uint64_t last) override {
+        if (first == last)
+            index.getLine(first, sink);
+        else
+            index.getLineRange(first, last, sink);
+    }
+
     void onSeparator() override {
         if (printSep)
-            cout << sep << endl;
+            out.writeLine(sep.data(), sep.size());
+    }
+};
+
+// Passes lines on to another sink until it's had its fill.
+struct LimitSink : LineSink {
+    LineSink &sink;
+    size_t remaining;
+
+    LimitSink(LineSink &sink, size_t limit) : sink(sink), remaining(limit) { }
+
+    bool onLine(size_t l, size_t offset, const char *line,
+                size_t length) override {
+        return sink.onLine(l, offset, line, length) && --remaining > 0;
     }
 };
 
+// Prints just the numbers of the matching lines, without decompressing them.
+struct LineNumberHandler : RangeFetcher::Handler {
+    OutputBuffer &out;
+    const std::string prefix;
+    const bool printSep;
+    const std::string sep;
+
+    LineNumberHandler(OutputBuffer &out, std::string prefix, bool printSep,
+                      std::string sep)
+            : out(out), prefix(std::move(prefix)), printSep(printSep),
+              sep(std::move(sep)) { }
+
+    void onLine(uint64_t line) override {
+        out.write(prefix.data(), prefix.size());
+        out.writeNumber(line);
+        out.writeLine("", 0);
+    }
+
+    void onSeparator() override {
+        if (printSep)
+            out.writeLine(sep.data(), sep.size());
+    }
+};
+
+// The matching lines of one file, to be merged with those from other files
+// by their keys. Each line is only fetched as it's output.
+struct KeyedLines {
+    shared_ptr<Index> index;
+    unique_ptr<PrintSink> sink;
+    vector<uint64_t> lines;
+    // Each line's key: lines without one stay with the line before them.
+    vector<int64_t> keys;
+    // The next line to be output.
+    size_t next = 0;
+};
+
+pair<string, string> parseRange(const string &range) {
+    auto sep = range.find("..");
+    if (sep == string::npos)
+        throw runtime_error("Range should be <from>..<to>, not '"
+                            + range + "'");
+    return make_pair(range.substr(0, sep), range.substr(sep + 2));
+}
+
+// A Log which forwards to another. Indexes kept open between server requests
+// log through one of these, pointed at whichever request is using them.
+// Several threads may log at once, so messages are passed on one at a time.
+class ForwardingLog : public Log {
+    Log *target_ = nullptr;
+    std::mutex mutex_;
+
+public:
+    void forwardTo(Log &target, Severity severity) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        target_ = &target;
+        minSeverity_ = severity;
+    }
+
+    // Drop messages until forwarded again, as when the target goes away.
+    void stopForwarding() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        target_ = nullptr;
+    }
+
+    void log(Severity severity, const std::string &message) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (target_) target_->log(severity, message);
+    }
+};
+
+// The indexes loaded so far, keyed by index file. An index is reloaded if
+// either of its files has changed since it was loaded. Only so many are kept
+// loaded, each with its files and database open: past that, the one used
+// least recently is closed. Indexes may be fetched from several threads at
+// once, but each index must only be used by one thread at a time. Callers
+// share ownership, so an index closed by the cache while in use stays open
+// until they're finished with it.
+class IndexCache {
+    struct Entry {
+        shared_ptr<Index> index;
+        string compressedFile;
+        struct stat compressedStat;
+        struct stat indexStat;
+        list<string>::iterator used;
+    };
+    ForwardingLog log_;
+    size_t capacity_;
+    unordered_map<string, Entry> entries_;
+    // The index files, most recently used first.
+    list<string> used_;
+    mutex mutex_;
+
+    static bool sameFile(const struct stat &lhs, const struct stat &rhs) {
+        return lhs.st_dev == rhs.st_dev && lhs.st_ino == rhs.st_ino
+               && lhs.st_size == rhs.st_size && lhs.st_mtime == rhs.st_mtime;
+    }
+
+    // Whether an entry's files are still those it was loaded from.
+    static bool unchanged(const string &indexFile, const Entry &entry) {
+        struct stat compressedStat, indexStat;
+        return stat(entry.compressedFile.c_str(), &compressedStat) == 0
+               && stat(indexFile.c_str(), &indexStat) == 0
+               && sameFile(entry.compressedStat, compressedStat)
+               && sameFile(entry.indexStat, indexStat);
+    }
+
+    // The absolute path of a file, so that entries don't depend on the
+    // working directory of whichever request loaded or later checks them.
+    static string resolve(const string &path) {
+        char resolved[PATH_MAX];
+        return realpath(path.c_str(), resolved) ? string(resolved) : path;
+    }
+
+    void erase(const string &indexFile) {
+        auto it = entries_.find(indexFile);
+        if (it == entries_.end()) return;
+        used_.erase(it->second.used);
+        entries_.erase(it);
+    }
+
+public:
+    static constexpr size_t DefaultCapacity = 64;
+
+    explicit IndexCache(size_t capacity = DefaultCapacity)
+            : capacity_(max<size_t>(capacity, 1u)) {}
+
+    ForwardingLog &log() { return log_; }
+
+    // Return the index for the given files, loading it if needed. Returns
+    // nullptr if the compressed file can't be opened.
+    shared_ptr<Index> get(const string &compressedFile,
+                          const string &indexFile, bool force) {
+        auto compressedPath = resolve(compressedFile);
+        auto indexPath = resolve(indexFile);
+        struct stat compressedStat, indexStat;
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (stat(compressedPath.c_str(), &compressedStat) != 0
+                || stat(indexPath.c_str(), &indexStat) != 0) {
+                erase(indexPath);
+            } else {
+                auto it = entries_.find(indexPath);
+                if (it != entries_.end()
+                    && it->second.compressedFile == compressedPath
+                    && sameFile(it->second.compressedStat, compressedStat)
+                    && sameFile(it->second.indexStat, indexStat)) {
+                    log_.debug("Reusing loaded index ", indexFile);
+                    used_.splice(used_.begin(), used_, it->second.used);
+                    return it->second.index;
+                }
+            }
+        }
+        // Loading doesn't need the lock, so several can load at once.
+        File in(fopen(compressedFile.c_str(), "rb"));
+        if (in.get() == nullptr) return nullptr;
+        auto index = make_shared<Index>(
+                Index::load(log_, move(in), indexFile.c_str(), force));
+        lock_guard<mutex> lock(mutex_);
+        erase(indexPath);
+        used_.push_front(indexPath);
+        entries_.emplace(indexPath, Entry{index, compressedPath, compressedStat,
+                                          indexStat, used_.begin()});
+        while (entries_.size() > capacity_) {
+            auto leastUsed = used_.back();
+            log_.debug("Closing least recently used index ", leastUsed);
+            erase(leastUsed);
+        }
+        return index;
+    }
+
+    // Close the indexes whose files have changed or gone since they were
+    // loaded, rather than keeping them open until they're next asked for.
+    void prune() {
+        lock_guard<mutex> lock(mutex_);
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            if (unchanged(it->first, it->second)) {
+                ++it;
+                continue;
+            }
+            log_.debug("Closing ", it->first, ", which has changed");
+            used_.erase(it->second.used);
+            it = entries_.erase(it);
+        }
+    }
+};
+
+// Redirects the standard file descriptors and working directory to those of a
+// client for the duration of a request.
+class Redirect {
+    int saved_[3];
+    int savedCwd_;
+
+public:
+    Redirect(int inFd, int outFd, int errFd, const string &cwd) {
+        cout.flush();
+        cerr.flush();
+        int fds[3] = {inFd, outFd, errFd};
+        for (auto i = 0; i < 3; ++i) {
+            saved_[i] = dup(i);
+            dup2(fds[i], i);
+        }
+        savedCwd_ = open(".", O_RDONLY);
+        if (chdir(cwd.c_str()) != 0)
+            cerr << "Warning: unable to change to directory " << cwd << ": "
+                 << strerror(errno) << endl;
+    }
+
+    ~Redirect() {
+        cout.flush();
+        cerr.flush();
+        cin.clear();
+        for (auto i = 0; i < 3; ++i) {
+            dup2(saved_[i], i);
+            close(saved_[i]);
+        }
+        if (fchdir(savedCwd_) != 0) { /* nothing more we can do */ }
+        close(savedCwd_);
+    }
+
+    Redirect(const Redirect &) = delete;
+    Redirect &operator=(const Redirect &) = delete;
+};
+
+}
+
+int Main(int argc, const char *argv[], IndexCache &indexes, bool inServer);
+
+namespace {
+
+// Serve requests forwarded by zq --client until killed, keeping up to
+// maxIndexes indexes loaded between them.
+int serve(Log &log, const string &socket, size_t maxIndexes) {
+    // A client going away mid-request mustn't take the server down with it.
+    signal(SIGPIPE, SIG_IGN);
+    IndexCache indexes(maxIndexes);
+    QueryServer server(log, socket);
+    server.serve([&](const vector<string> &args, int inFd, int outFd,
+                     int errFd) {
+        if (args.empty()) return 1;
+        // The first argument is the client's working directory.
+        Redirect redirect(inFd, outFd, errFd, args[0]);
+        vector<const char *> argv{"zq"};
+        for (size_t i = 1; i < args.size(); ++i)
+            argv.push_back(args[i].c_str());
+        return Main(argv.size(), argv.data(), indexes, true);
+    });
+    return 0;
+}
+
+// Forward our arguments, less the --client option itself, to a server.
+int forward(int argc, const char *argv[], const string &socket) {
+    vector<string> args;
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)))
+        throw runtime_error("Unable to get the current directory");
+    args.emplace_back(cwd);
+    for (auto i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--client") {
+            ++i;
+            continue;
+        }
+        if (arg.compare(0, 9, "--client=") == 0) continue;
+        args.emplace_back(arg);
+    }
+    return QueryServer::request(socket, args, STDIN_FILENO, STDOUT_FILENO,
+                                STDERR_FILENO);
+}
+
 uint64_t toInt(const string &s) {
     char *endP;
     auto res = strtoull(&s[0], &endP, 10);
@@ -55,12 +377,92 @@ uint64_t toInt(const string &s) {
     return res;
 }
 
+void readKeys(const string &path, vector<string> &keys) {
+    ifstream file;
+    if (path != "-") {
+        file.open(path);
+        if (!file) throw runtime_error("Could not open " + path);
+    }
+    istream &in = path == "-" ? cin : file;
+    string key;
+    while (getline(in, key)) {
+        if (!key.empty() && key.back() == '\r') key.pop_back();
+        if (!key.empty()) keys.emplace_back(key);
+    }
+    if (in.bad()) throw runtime_error("Error reading keys from " + path);
+}
+
+string dirName(const string &path) {
+    auto slash = path.rfind('/');
+    if (slash == string::npos) return ".";
+    return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+// Add the files matching a glob pattern, in sorted order, to files. Patterns
+// without wildcards are added as they are.
+void expandFiles(const string &pattern, vector<string> &files) {
+    if (pattern.find_first_of("*?[") == string::npos) {
+        files.push_back(pattern);
+        return;
+    }
+    glob_t matches;
+    auto err = glob(pattern.c_str(), 0, nullptr, &matches);
+    if (err != 0) {
+        globfree(&matches);
+        throw runtime_error(err == GLOB_NOMATCH
+                            ? "No files match '" + pattern + "'"
+                            : "Unable to expand '" + pattern + "'");
+    }
+    for (size_t i = 0; i < matches.gl_pathc; ++i)
+        files.emplace_back(matches.gl_pathv[i]);
+    globfree(&matches);
+}
+
+}
+
+int ServeMain(int argc, const char *argv[]) {
+    CmdLine cmd("Serve zq queries sent with zq --client <socket>, keeping "
+                        "indexes loaded between queries");
+    ValueArg<string> serveArg("", "serve", "Listen on the unix socket "
+            "<socket>", true, "", "socket", cmd);
+    ValueArg<unsigned> maxIndexesArg("", "max-indexes", "Keep at most "
+            "<num> indexes loaded, closing the least recently used (default: "
+            + to_string(IndexCache::DefaultCapacity) + ")", false,
+            IndexCache::DefaultCapacity, "num", cmd);
+    SwitchArg verbose("v", "verbose", "Be more verbose", cmd);
+    SwitchArg debug("", "debug", "Be even more verbose", cmd);
+    SwitchArg forceColour("", "colour", "Use colour even on non-TTY", cmd);
+    SwitchArg forceColor("", "color", "Use color even on non-TTY", cmd);
+    cmd.parse(argc, argv);
+
+    ConsoleLog log(
+            debug.isSet() ? Log::Severity::Debug : verbose.isSet()
+                                                   ? Log::Severity::Info
+                                                   : Log::Severity::Warning,
+            forceColour.isSet() || forceColor.isSet(), false);
+    try {
+        return serve(log, serveArg.getValue(), maxIndexesArg.getValue());
+    } catch (const exception &e) {
+        log.error(e.what());
+        return 1;
+    }
 }
 
-int Main(int argc, const char *argv[]) {
+int Main(int argc, const char *argv[], IndexCache &indexes, bool inServer) {
+    // Serving takes options of its own, which may come in any order.
+    for (auto i = 1; i < argc && !inServer; ++i) {
+        string arg = argv[i];
+        if (arg == "--") break;
+        if (arg == "--serve" || arg.compare(0, 8, "--serve=") == 0)
+            return ServeMain(argc, argv);
+    }
+
     CmdLine cmd("Lookup indices in a compressed text file");
+    // We handle exceptions so a server can carry on after a bad request.
+    cmd.setExceptionHandling(false);
     UnlabeledValueArg<string> inputFile(
-            "input-file", "Read input from <file>", true, "", "file", cmd);
+            "input-file", "Read input from <file>, which may be a quoted glob "
+            "pattern matching several files", true, "", "file", cmd);
     UnlabeledMultiArg<string> query(
             "query", "Query for <query>", false, "<query>", cmd);
     SwitchArg lineMode("l", "line",
@@ -96,6 +498,52 @@ int Main(int argc, const char *argv[]) {
     ValueArg<string> queryIndexArg("i", "index", "Use specified index for searching"
                             , false, "", "index", cmd);
 
+    ValueArg<string> rangeArg("", "range", "Find all lines with keys between "
+            "<from> and <to> inclusive, given as '<from>..<to>'", false, "",
+            "from..to", cmd);
+    ValueArg<string> prefixArg("", "prefix", "Find all lines with keys "
+            "starting with <prefix>", false, "", "prefix", cmd);
+
+    ValueArg<string> exprArg("e", "expr", "Find lines matching a boolean "
+            "<expression> of index terms, for example "
+            "'default:5 AND (secondary:KEY_2 OR secondary:KEY_3) AND NOT "
+            "other:x'. Terms without an index use the -i index. Terms may "
+            "also be ranges (index:from..to) or prefixes (index:prefix*)",
+            false, "", "expression", cmd);
+
+    ValueArg<string> grepArg("", "grep", "Find lines matching the extended "
+            "regular expression <regex>. Only the parts of the file which "
+            "could match are decompressed if the index has trigrams (see "
+            "zindex --trigrams); otherwise the whole file is searched. A "
+            "single file is searched on --jobs threads at once", false, "",
+            "regex", cmd);
+    ValueArg<int> grepFieldArg("", "grep-field", "Match --grep against field "
+            "<num> (delimited by -d/--delimiter, 1-based) of each line, "
+            "rather than the whole line", false, 0, "num", cmd);
+    ValueArg<string> delimiterArg("d", "delimiter", "Use <delim> as the "
+            "field delimiter for --grep-field", false, " ", "delim", cmd);
+
+    SwitchArg catArg("", "cat", "Output the whole file decompressed, as zcat "
+            "does, or just the lines from --from-line to --to-line. The "
+            "blocks between the index's checkpoints are decompressed on "
+            "--jobs threads at once", cmd);
+    ValueArg<uint64_t> fromLineArg("", "from-line", "Start --cat at line "
+            "<num>", false, 1, "num", cmd);
+    ValueArg<uint64_t> toLineArg("", "to-line", "Stop --cat after line "
+            "<num>", false, 0, "num", cmd);
+
+    ValueArg<string> keysFromArg("", "keys-from", "Also query for each line "
+            "of <file> as a key ('-' for standard input). Matching lines are "
+            "output once each, in file order", false, "", "file", cmd);
+
+    SwitchArg countArg("c", "count", "Print only the number of matching "
+            "lines. This is answered from the index without decompressing "
+            "anything", cmd);
+    SwitchArg lineNumbersOnlyArg("", "line-numbers-only", "Print only the "
+            "line numbers of matching lines, without decompressing them", cmd);
+    ValueArg<uint64_t> maxCountArg("m", "max-count", "Stop after <num> "
+            "matching lines", false, 0, "num", cmd);
+
     ValueArg<string> rawSqlQueryArg("", "raw", "Expert Mode - Since zindex is "
             "a sqlite3 database under the covers, this flag lets you run a custom "
             "query for use cases not supported by command line args."
@@ -104,26 +552,72 @@ int Main(int argc, const char *argv[]) {
             "and b.key == 'KEY_2';\")"
                             , false, "", "raw", cmd);
 
-    cmd.parse(argc, argv);
+    MultiArg<string> fileArg("f", "file", "Also read input from <file> (or "
+            "glob pattern). May be given several times", false, "file", cmd);
+    SwitchArg withFilenameArg("H", "with-filename", "Prefix each line of "
+            "output with its file name. This is the default when querying "
+            "several files", cmd);
+    SwitchArg noFilenameArg("", "no-filename", "Never prefix output with "
+            "file names", cmd);
+    ValueArg<unsigned> jobsArg("j", "jobs", "Query up to <num> files at once "
+            "(default: the number of CPUs)", false, 0, "num", cmd);
+    ValueArg<string> mergeByArg("", "merge-by", "Interleave the matching "
+            "lines from all the files in order of their keys in the numeric "
+            "<index>, such as a timestamp, which should increase through each "
+            "file", false, "", "index", cmd);
 
-    ConsoleLog log(
-            debug.isSet() ? Log::Severity::Debug : verbose.isSet()
-                                                   ? Log::Severity::Info
-                                                   : Log::Severity::Warning,
-            forceColour.isSet() || forceColor.isSet(), warnings.isSet());
+    ValueArg<string> clientArg("", "client", "Send the query to the server "
+            "listening on <socket> rather than running it directly", false, "",
+            "socket", cmd);
 
     try {
-        auto compressedFile = inputFile.getValue();
-        File in(fopen(compressedFile.c_str(), "rb"));
-        if (in.get() == nullptr) {
-            log.error("Could not open ", compressedFile, " for reading");
-            return 1;
+        cmd.parse(argc, argv);
+    } catch (ArgException &e) {
+        try {
+            cmd.getOutput()->failure(cmd, e);
+        } catch (const ExitException &ee) {
+            return ee.getExitStatus();
         }
+        return 1;
+    } catch (const ExitException &e) {
+        return e.getExitStatus();
+    }
+
+    if (clientArg.isSet())
+        return forward(argc, argv, clientArg.getValue());
 
-        auto indexFile = indexArg.isSet() ? indexArg.getValue() :
-                         inputFile.getValue() + ".zindex";
-        auto index = Index::load(log, move(in), indexFile.c_str(),
-                                 forceLoad.isSet());
+    auto severity = debug.isSet() ? Log::Severity::Debug : verbose.isSet()
+                                                           ? Log::Severity::Info
+                                                           : Log::Severity::Warning;
+    ConsoleLog log(severity, forceColour.isSet() || forceColor.isSet(),
+                   warnings.isSet());
+
+    indexes.log().forwardTo(log, severity);
+    // Indexes may outlive this request, and log as they're closed.
+    struct StopForwarding {
+        ForwardingLog &log;
+        ~StopForwarding() { log.stopForwarding(); }
+    } stopForwarding{indexes.log()};
+    // Don't hold on to indexes of files changed since an earlier request.
+    indexes.prune();
+
+    try {
+        vector<string> files;
+        expandFiles(inputFile.getValue(), files);
+        for (auto &pattern : fileArg.getValue())
+            expandFiles(pattern, files);
+        // A file named twice, say by a glob and by --file, is only queried
+        // once, so no two threads ever share its index.
+        unordered_set<string> seen;
+        files.erase(remove_if(files.begin(), files.end(),
+                              [&](const string &file) {
+                                  return !seen.insert(file).second;
+                              }),
+                    files.end());
+        if (files.size() > 1 && indexArg.isSet())
+            throw runtime_error("--index-file can only be used with one file");
+        auto withFilename = withFilenameArg.isSet()
+                            || (files.size() > 1 && !noFilenameArg.isSet());
         auto queryIndex = queryIndexArg.isSet() ? queryIndexArg.getValue() : "default";
 
         uint64_t before = 0u;
@@ -133,29 +627,296 @@ int Main(int argc, const char *argv[]) {
         if (contextArg.isSet()) before = after = contextArg.getValue();
         log.debug("Fetching context of ", before, " lines before and ", after,
                   " lines after");
-        PrintSink sink(lineNum.isSet());
-        PrintHandler ph(index, sink, (before || after) && !noSepArg.isSet(),
-                        sepArg.getValue());
-        RangeFetcher rangeFetcher(ph, before, after);
-        if (lineMode.isSet()) {
-            for (auto &q : query.getValue())
-                rangeFetcher(toInt(q));
-        } else if (rawSqlQueryArg.isSet()) {
-            index.queryCustom(rawSqlQueryArg.getValue(), rangeFetcher);
-        } else {
-            index.queryIndexMulti(queryIndex, query.getValue(), rangeFetcher);
+        auto keys = query.getValue();
+        if (keysFromArg.isSet()) readKeys(keysFromArg.getValue(), keys);
+        auto maxCount = maxCountArg.isSet()
+                        ? static_cast<size_t>(maxCountArg.getValue())
+                        : Index::Cursor::NoLimit;
+        if (lineMode.isSet() && countArg.isSet())
+            throw runtime_error("--count can't be used with --line");
+        if (mergeByArg.isSet() && (before || after))
+            throw runtime_error("--merge-by can't be used with context lines");
+        if (mergeByArg.isSet() && countArg.isSet())
+            throw runtime_error("--count can't be used with --merge-by");
+        if (grepFieldArg.isSet() && !grepArg.isSet())
+            throw runtime_error("--grep-field needs --grep");
+        if (grepFieldArg.isSet() && grepFieldArg.getValue() < 1)
+            throw runtime_error("--grep-field must be 1 or more");
+        if ((fromLineArg.isSet() || toLineArg.isSet()) && !catArg.isSet())
+            throw runtime_error("--from-line and --to-line need --cat");
+        if (catArg.isSet() && mergeByArg.isSet())
+            throw runtime_error("--cat can't be used with --merge-by");
+        auto jobs = jobsArg.isSet() ? jobsArg.getValue()
+                                    : thread::hardware_concurrency();
+        // Several files are searched at once, so each on a single thread.
+        auto grepOptions = Index::GrepOptions()
+                .withField(grepFieldArg.getValue(), delimiterArg.getValue())
+                .withJobs(files.size() == 1 ? max(jobs, 1u) : 1u);
+
+        // Catalogs let us rule out files whose indexes can't have the keys
+        // we're after, without opening them.
+        unordered_map<string, unique_ptr<Catalog>> catalogs;
+        auto usesCatalog = !indexArg.isSet() && !lineMode.isSet()
+                           && !catArg.isSet()
+                           && (rangeArg.isSet() || (!prefixArg.isSet()
+                                                    && !exprArg.isSet()
+                                                    && !grepArg.isSet()
+                                                    && !rawSqlQueryArg.isSet()));
+        if (usesCatalog) {
+            for (auto &file : files) {
+                auto dir = dirName(file);
+                if (!catalogs.count(dir))
+                    catalogs.emplace(dir, Catalog::load(log, dir));
+            }
         }
+        auto cannotMatch = [&](const string &file) {
+            if (!usesCatalog) return false;
+            auto &catalog = catalogs.at(dirName(file));
+            if (!catalog) return false;
+            auto indexFile = file + ".zindex";
+            bool mayMatch;
+            if (rangeArg.isSet()) {
+                auto range = parseRange(rangeArg.getValue());
+                mayMatch = catalog->mayContainRange(indexFile, queryIndex,
+                                                    range.first, range.second);
+            } else {
+                mayMatch = catalog->mayContainAny(indexFile, queryIndex, keys);
+            }
+            if (!mayMatch) log.debug("Skipping ", file, ", which can't match");
+            return !mayMatch;
+        };
+
+        auto loadIndex = [&](const string &file) {
+            auto indexFile = indexArg.isSet() ? indexArg.getValue()
+                                              : file + ".zindex";
+            auto index = indexes.get(file, indexFile, forceLoad.isSet());
+            if (!index)
+                throw runtime_error("Could not open " + file + " for reading");
+            return index;
+        };
+
+        // The matching line numbers, for all but --line queries.
+        auto cursorFor = [&](Index &index) {
+            if (rangeArg.isSet()) {
+                auto range = parseRange(rangeArg.getValue());
+                return index.cursorIndexRange(queryIndex, range.first,
+                                              range.second);
+            } else if (prefixArg.isSet()) {
+                return index.cursorIndexPrefix(queryIndex,
+                                               prefixArg.getValue());
+            } else if (exprArg.isSet()) {
+                return index.cursorExpression(exprArg.getValue(), queryIndex);
+            } else if (grepArg.isSet()) {
+                return index.cursorGrep(grepArg.getValue(), grepOptions);
+            } else if (rawSqlQueryArg.isSet()) {
+                return index.cursorCustom(rawSqlQueryArg.getValue());
+            } else {
+                return index.cursorIndexMulti(queryIndex, keys);
+            }
+        };
+
+        auto count = [&](Index &index) {
+            if (rangeArg.isSet()) {
+                auto range = parseRange(rangeArg.getValue());
+                return index.countIndexRange(queryIndex, range.first,
+                                             range.second);
+            } else if (prefixArg.isSet()) {
+                return index.countIndexPrefix(queryIndex,
+                                              prefixArg.getValue());
+            } else if (exprArg.isSet()) {
+                return index.countExpression(exprArg.getValue(), queryIndex);
+            } else if (grepArg.isSet()) {
+                return index.cursorGrep(grepArg.getValue(), grepOptions)
+                        .forEach([](uint64_t) {});
+            } else if (rawSqlQueryArg.isSet()) {
+                return index.queryCustom(rawSqlQueryArg.getValue(),
+                                         [](size_t) {});
+            } else {
+                return index.countIndexMulti(queryIndex, keys);
+            }
+        };
+
+        auto printSep = (before || after) && !noSepArg.isSet();
+        auto run = [&](const string &file, OutputBuffer &out) {
+            if (catArg.isSet()) {
+                // Blocks are mostly a MiB or more, bigger than the output
+                // buffer, so go straight out without being copied.
+                loadIndex(file)->cat(
+                        fromLineArg.getValue(),
+                        toLineArg.isSet() ? toLineArg.getValue()
+                                          : numeric_limits<uint64_t>::max(),
+                        [&](const char *data, size_t length) {
+                            out.write(data, length);
+                        }, max(jobs, 1u));
+                return;
+            }
+            auto skip = cannotMatch(file);
+            auto prefix = withFilename ? file + ":" : "";
+            if (countArg.isSet()) {
+                out.write(prefix.data(), prefix.size());
+                out.writeNumber(skip ? 0 : min(count(*loadIndex(file)),
+                                               maxCount));
+                out.writeLine("", 0);
+                return;
+            }
+            if (skip) return;
+            auto indexPtr = loadIndex(file);
+            auto &index = *indexPtr;
+            PrintSink sink(out, prefix, lineNum.isSet());
+            PrintHandler ph(index, sink, out, printSep, sepArg.getValue());
+            LineNumberHandler lnh(out, prefix, printSep, sepArg.getValue());
+            RangeFetcher rangeFetcher(
+                    lineNumbersOnlyArg.isSet()
+                    ? static_cast<RangeFetcher::Handler &>(lnh) : ph,
+                    before, after);
+            if (lineMode.isSet()) {
+                auto &lines = query.getValue();
+                for (size_t i = 0; i < lines.size() && i < maxCount; ++i)
+                    rangeFetcher(toInt(lines[i]));
+            } else if (before || after) {
+                cursorFor(index).limit(maxCount).forEach(rangeFetcher);
+            } else if (grepArg.isSet() && !lineNumbersOnlyArg.isSet()) {
+                // Print the matches as they're found, rather than decoding
+                // them all over again.
+                LimitSink limited(sink, maxCount);
+                if (maxCount)
+                    index.grep(grepArg.getValue(), limited, grepOptions);
+            } else {
+                // Without context, runs of consecutive matches (as a range
+                // query over ordered keys gives) are decoded in one go.
+                RangeFetcher::Handler &handler = lineNumbersOnlyArg.isSet()
+                    ? static_cast<RangeFetcher::Handler &>(lnh) : ph;
+                cursorFor(index).limit(maxCount).forEachRun(
+                        [&](uint64_t first, uint64_t last) {
+                            handler.onRange(first, last);
+                        });
+            }
+        };
+
+        OutputBuffer out(STDOUT_FILENO);
+
+        // Each matching line, tagged with its key in the --merge-by index.
+        auto runKeyed = [&](const string &file, KeyedLines &keyed) {
+            if (cannotMatch(file)) return;
+            auto indexPtr = loadIndex(file);
+            auto &index = *indexPtr;
+            vector<uint64_t> lines;
+            if (lineMode.isSet()) {
+                for (auto &line : query.getValue()) lines.push_back(toInt(line));
+                if (lines.size() > maxCount) lines.resize(maxCount);
+                sort(lines.begin(), lines.end());
+            } else {
+                cursorFor(index).limit(maxCount).forEach(
+                        [&](uint64_t line) { lines.push_back(line); });
+            }
+            unordered_map<uint64_t, int64_t> keyOf;
+            index.lineKeys(mergeByArg.getValue(), lines,
+                           [&](uint64_t line, int64_t key) {
+                               keyOf.emplace(line, key);
+                           });
+            vector<int64_t> keys;
+            keys.reserve(lines.size());
+            auto key = numeric_limits<int64_t>::min();
+            for (auto line : lines) {
+                auto it = keyOf.find(line);
+                if (it != keyOf.end()) {
+                    // Merging relies on the keys being in order already.
+                    if (it->second < key)
+                        throw runtime_error(
+                                "keys in the --merge-by index '"
+                                + mergeByArg.getValue() + "' go down at line "
+                                + to_string(line) + ", so its lines can't be "
+                                  "merged in order");
+                    key = it->second;
+                }
+                keys.push_back(key);
+            }
+            keyed.sink.reset(new PrintSink(out, withFilename ? file + ":" : "",
+                                           lineNum.isSet()));
+            keyed.lines = move(lines);
+            keyed.keys = move(keys);
+            keyed.index = move(indexPtr);
+        };
+
+        if (catArg.isSet()) {
+            // Each file is decompressed on all the threads in turn.
+            for (auto &file : files) run(file, out);
+            out.flush();
+            return 0;
+        }
+        if (files.size() == 1 && !mergeByArg.isSet()) {
+            run(files[0], out);
+            out.flush();
+            return 0;
+        }
+
+        jobs = max<size_t>(1u, min<size_t>(jobs, files.size()));
+        log.debug("Querying ", files.size(), " files with ", jobs, " threads");
+        vector<string> outputs(files.size());
+        vector<KeyedLines> keyed(files.size());
+        vector<string> errors(files.size());
+        int result = 0;
+        forEachInParallel(files.size(), jobs, [&](size_t, size_t i) {
+            try {
+                if (mergeByArg.isSet()) {
+                    runKeyed(files[i], keyed[i]);
+                } else {
+                    OutputBuffer fileOut(outputs[i]);
+                    run(files[i], fileOut);
+                }
+            } catch (const exception &e) {
+                errors[i] = files[i] + ": " + e.what();
+            }
+        }, [&](size_t i) {
+            out.write(outputs[i].data(), outputs[i].size());
+            string().swap(outputs[i]);
+            if (!errors[i].empty()) {
+                out.flush();
+                log.error(errors[i]);
+                result = 1;
+            }
+            return true;
+        });
+        if (mergeByArg.isSet()) {
+            // Each file's lines are in order of their keys already, so
+            // repeatedly taking the first of the next lines from each gives
+            // them all in order. Equal keys stay in file order, then line
+            // order.
+            using Next = pair<int64_t, size_t>;
+            priority_queue<Next, vector<Next>, greater<Next>> next;
+            for (size_t i = 0; i < keyed.size(); ++i)
+                if (!keyed[i].lines.empty()) next.emplace(keyed[i].keys[0], i);
+            while (!next.empty()) {
+                auto i = next.top().second;
+                next.pop();
+                auto &file = keyed[i];
+                auto line = file.lines[file.next];
+                if (lineNumbersOnlyArg.isSet()) {
+                    out.write(file.sink->prefix.data(),
+                              file.sink->prefix.size());
+                    out.writeNumber(line);
+                    out.writeLine("", 0);
+                } else {
+                    file.index->getLine(line, *file.sink);
+                }
+                if (++file.next < file.lines.size())
+                    next.emplace(file.keys[file.next], i);
+                else
+                    file.index.reset();
+            }
+        }
+        out.flush();
+        return result;
     } catch (const exception &e) {
         log.error(e.what());
         return 1;
     }
-
-    return 0;
 }
 
 int main(int argc, const char *argv[]) {
     try {
-        return Main(argc, argv);
+        IndexCache indexes;
+        return Main(argc, argv, indexes, false);
     } catch (const exception &e) {
         cerr << e.what() << endl;
         return 1;
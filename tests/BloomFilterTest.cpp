@@ -0,0 +1,41 @@
+#include "BloomFilter.h"
+
+#include "catch.hpp"
+
+#include <string>
+
+using namespace std;
+
+TEST_CASE("Bloom filters", "[BloomFilter]") {
+    constexpr auto numKeys = 10000;
+    BloomFilter filter(numKeys, 0.01);
+    for (auto i = 0; i < numKeys; ++i) filter.add("key" + to_string(i));
+
+    SECTION("never miss a key") {
+        for (auto i = 0; i < numKeys; ++i)
+            REQUIRE(filter.mayContain("key" + to_string(i)));
+    }
+
+    SECTION("rarely claim to have keys they don't") {
+        auto falsePositives = 0;
+        for (auto i = numKeys; i < numKeys * 11; ++i)
+            if (filter.mayContain("key" + to_string(i))) ++falsePositives;
+        CHECK(falsePositives < numKeys * 10 * 0.02);
+    }
+
+    SECTION("can be saved and loaded") {
+        BloomFilter loaded(filter.bits(), filter.numHashes());
+        for (auto i = 0; i < numKeys * 2; ++i) {
+            auto key = "key" + to_string(i);
+            REQUIRE(loaded.mayContain(key) == filter.mayContain(key));
+        }
+    }
+}
+
+TEST_CASE("empty Bloom filters", "[BloomFilter]") {
+    BloomFilter filter(0, 0.01);
+    CHECK(!filter.mayContain("anything"));
+    CHECK(!filter.mayContain(""));
+    BloomFilter unknown("", 3);
+    CHECK(unknown.mayContain("anything"));
+}
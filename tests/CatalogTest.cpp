@@ -0,0 +1,87 @@
+#include "Catalog.h"
+#include "Index.h"
+#include "RegExpIndexer.h"
+
+#include "catch.hpp"
+#include "CaptureLog.h"
+#include "TempDir.h"
+
+#include <fstream>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+// Index a file whose lines have ids from first to last, and a name which is
+// the id spelled out in letters.
+void makeIndexedFile(Log &log, const string &path, int first, int last) {
+    {
+        ofstream out(path);
+        for (auto i = first; i <= last; ++i) {
+            string name;
+            for (auto c : to_string(i)) name += static_cast<char>('a' + c - '0');
+            out << "id:" << i << " name:" << name << endl;
+        }
+    }
+    REQUIRE(system(("gzip -f " + path).c_str()) == 0);
+    auto gzPath = path + ".gz";
+    Index::Builder builder(log, File(fopen(gzPath.c_str(), "rb")), gzPath,
+                           gzPath + ".zindex");
+    builder.addIndexer("default", "blah",
+                       Index::IndexConfig().withNumeric(true),
+                       unique_ptr<LineIndexer>(new RegExpIndexer("id:([0-9]+)")))
+            .addIndexer("name", "blah", Index::IndexConfig(),
+                        unique_ptr<LineIndexer>(
+                                new RegExpIndexer("name:([a-z]+)")))
+            .build();
+}
+
+}
+
+TEST_CASE("catalogs a directory of indexes", "[Catalog]") {
+    TempDir tempDir;
+    CaptureLog log;
+    auto &dir = tempDir.path;
+    makeIndexedFile(log, dir + "/a.log", 1, 1000);
+    makeIndexedFile(log, dir + "/b.log", 1001, 2000);
+    auto aIndex = dir + "/a.log.gz.zindex";
+    auto bIndex = dir + "/b.log.gz.zindex";
+
+    CHECK(Catalog::load(log, dir) == nullptr);
+    CHECK(Catalog::build(log, dir) == 2);
+    auto catalog = Catalog::load(log, dir);
+    REQUIRE(catalog != nullptr);
+
+    SECTION("by key") {
+        CHECK(catalog->mayContainAny(aIndex, "default", {"500"}));
+        CHECK(!catalog->mayContainAny(bIndex, "default", {"500"}));
+        CHECK(catalog->mayContainAny(bIndex, "default", {"500", "1500"}));
+        CHECK(!catalog->mayContainAny(aIndex, "default", {"5000", "1500"}));
+        CHECK(catalog->mayContainAny(aIndex, "name", {"efa"}));
+        CHECK(!catalog->mayContainAny(bIndex, "name", {"efa"}));
+    }
+
+    SECTION("by range") {
+        CHECK(catalog->mayContainRange(aIndex, "default", "900", "1100"));
+        CHECK(catalog->mayContainRange(bIndex, "default", "900", "1100"));
+        CHECK(!catalog->mayContainRange(bIndex, "default", "1", "1000"));
+        CHECK(!catalog->mayContainRange(aIndex, "default", "2000", "3000"));
+    }
+
+    SECTION("assumes anything unknown may match") {
+        CHECK(catalog->mayContainAny(dir + "/c.log.gz.zindex", "default",
+                                     {"500"}));
+        CHECK(catalog->mayContainAny(bIndex, "other", {"500"}));
+    }
+
+    SECTION("ignores indexes changed since") {
+        makeIndexedFile(log, dir + "/b.log", 1, 10);
+        CHECK(catalog->mayContainAny(bIndex, "default", {"5"}));
+        CHECK(Catalog::build(log, dir) == 2);
+        CHECK(Catalog::load(log, dir)->mayContainAny(bIndex, "default",
+                                                    {"5"}));
+        CHECK(!Catalog::load(log, dir)->mayContainAny(bIndex, "default",
+                                                     {"500"}));
+    }
+}
@@ -0,0 +1,11 @@
+#include "Hash.h"
+
+#include "catch.hpp"
+
+TEST_CASE("hashes match their published values", "[Hash]") {
+    CHECK(fnv1a("") == 0xcbf29ce484222325ull);
+    CHECK(fnv1a("a") == 0xaf63dc4c8601ec8cull);
+    CHECK(fnv1a("foobar") == 0x85944171f73967e8ull);
+    // The first output of splitmix64 seeded with 0.
+    CHECK(mix64(0x9e3779b97f4a7c15ull) == 0xe220a8397b1dcdafull);
+}
@@ -1,14 +1,19 @@
 #include <fstream>
+#include <iomanip>
+#include <sstream>
 #include "RegExpIndexer.h"
 #include "Index.h"
+#include "Sqlite.h"
 
 #include "catch.hpp"
 #include "TempDir.h"
 #include "LineSink.h"
 #include "CaptureLog.h"
 #include <unordered_map>
+#include <algorithm>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <thread>
 #include <FieldIndexer.h>
 #include <Index.h>
 
@@ -83,6 +88,70 @@ TEST_CASE("indexes files", "[Index]") {
         CheckIndex(1, "Line 1 - Hex 1 - Mod 1");
         CheckIndex(2, "Line 2 - Hex 2 - Mod 2");
         CheckIndex(3, "Line 3 - Hex 3 - Mod 3");
+
+        CaptureSink range;
+        CHECK(index.getLineRange(99, 101, range) == 3);
+        CHECK(range.captured == vector<string>({"Line 99 - Hex 63 - Mod 99",
+                                                "Line 100 - Hex 64 - Mod 100",
+                                                "Line 101 - Hex 65 - Mod 101"}));
+        CHECK(index.getLineRange(65535, 70000, range) == 2);
+        CHECK(range.captured.back() == "Line 65536 - Hex 10000 - Mod 0");
+        CHECK(index.getLineRange(10, 9, range) == 0);
+
+        vector<uint64_t> lines;
+        auto collect = [&](uint64_t line) { lines.emplace_back(line); };
+        CHECK(index.queryIndexRange("default", "98", "102", collect) == 5);
+        CHECK(lines == vector<uint64_t>({98, 99, 100, 101, 102}));
+        lines.clear();
+        CHECK(index.queryIndexRange("default", "65530", "70000", collect) == 7);
+        CHECK(lines.front() == 65530);
+        CHECK(lines.back() == 65536);
+        CHECK_THROWS(index.queryIndexPrefix("default", "1", collect));
+        CHECK_THROWS(index.queryIndexRange("nonexistent", "1", "2", collect));
+
+        SECTION("cursors") {
+            uint64_t line;
+            auto cursor = index.cursorIndexRange("default", "100", "200");
+            REQUIRE(cursor.next(line));
+            CHECK(line == 100);
+            REQUIRE(cursor.next(line));
+            CHECK(line == 101);
+            lines.clear();
+            CHECK(cursor.offset(10).limit(3).forEach(collect) == 3);
+            CHECK(lines == vector<uint64_t>({112, 113, 114}));
+            CHECK(!cursor.next(line));
+
+            lines.clear();
+            CHECK(index.cursorIndexMulti("default", {"9", "3", "5", "7"})
+                          .offset(1).limit(2).forEach(collect) == 2);
+            CHECK(lines == vector<uint64_t>({5, 7}));
+            lines.clear();
+            CHECK(index.cursorIndexMulti("default", {"9", "3"})
+                          .offset(5).forEach(collect) == 0);
+            CHECK(index.cursorIndexRange("default", "1", "10")
+                          .offset(8).limit(5).forEach(collect) == 2);
+            CHECK(lines == vector<uint64_t>({9, 10}));
+            CHECK(index.cursorCustom("SELECT line FROM index_default")
+                          .limit(0).forEach(collect) == 0);
+            lines.clear();
+            CHECK(index.cursorIndex("default", "42").forEach(collect) == 1);
+            CHECK(lines == vector<uint64_t>({42}));
+            CHECK(index.cursorIndex("default", "42").offset(1)
+                          .forEach(collect) == 0);
+            CHECK(index.cursorIndex("default", "70000").forEach(collect) == 0);
+        }
+
+        SECTION("sinks can stop ranges early") {
+            struct FirstTwo : CaptureSink {
+                bool onLine(size_t lineNumber, size_t fileOffset,
+                            const char *line, size_t length) override {
+                    CaptureSink::onLine(lineNumber, fileOffset, line, length);
+                    return captured.size() < 2;
+                }
+            } firstTwo;
+            CHECK(index.getLineRange(1000, 2000, firstTwo) == 2);
+            CHECK(firstTwo.captured.back() == "Line 1001 - Hex 3e9 - Mod 233");
+        }
     }
 
     SECTION("should throw if created unique and there's duplicates") {
@@ -130,6 +199,413 @@ TEST_CASE("indexes files", "[Index]") {
         CheckIndex(2);
         CheckIndex(3);
         CheckIndex(255);
+
+        vector<uint64_t> lines;
+        auto collect = [&](uint64_t line) { lines.emplace_back(line); };
+        CHECK(index.queryIndexRange("default", "1", "2", collect) == 512);
+        REQUIRE(lines.size() == 512);
+        CHECK(lines[0] == 1);
+        CHECK(lines[1] == 2);
+        CHECK(lines[2] == 257);
+        CHECK(is_sorted(lines.begin(), lines.end()));
+
+        vector<uint64_t> multiLines;
+        auto collectMulti = [&](uint64_t line) {
+            multiLines.emplace_back(line);
+        };
+        CHECK(index.queryIndexMulti("default", {"2", "1", "2", "999"},
+                                    collectMulti) == 512);
+        CHECK(multiLines == lines);
+        multiLines.clear();
+        CHECK(index.queryIndexMulti("default", {}, collectMulti) == 0);
+        CHECK(multiLines.empty());
+        CHECK_THROWS(index.queryIndexMulti("nonexistent", {"1"}, collectMulti));
+    }
+
+    SECTION("boolean expressions over several indexes") {
+        Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                               testFile, testFile + ".zindex");
+        builder.addIndexer("line", "blah",
+                           Index::IndexConfig().withNumeric(true),
+                           unique_ptr<LineIndexer>(
+                                   new RegExpIndexer("^Line ([0-9]+)")))
+                .addIndexer("mod", "blah",
+                            Index::IndexConfig().withNumeric(true),
+                            unique_ptr<LineIndexer>(
+                                    new RegExpIndexer("Mod ([0-9]+)")))
+                .indexEvery(256 * 1024)
+                .build();
+        Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                  testFile + ".zindex", false);
+        vector<uint64_t> lines;
+        auto collect = [&](uint64_t line) { lines.emplace_back(line); };
+        CHECK(index.queryExpression("1..1000 AND mod:1", "line", collect) == 4);
+        CHECK(lines == vector<uint64_t>({1, 257, 513, 769}));
+        lines.clear();
+        CHECK(index.queryExpression("mod:1 AND NOT 1..1000", "line", collect)
+              == 252);
+        CHECK(lines.front() == 1025);
+        lines.clear();
+        CHECK(index.queryExpression("(mod:1 OR mod:2) 1..300", "line", collect)
+              == 4);
+        CHECK(lines == vector<uint64_t>({1, 2, 257, 258}));
+        lines.clear();
+        CHECK(index.queryExpression("NOT mod:0..254", "line", collect) == 256);
+        CHECK(lines.front() == 255);
+        CHECK(lines.back() == 65535);
+
+        CaptureSink cs;
+        CHECK(index.queryExpression("5 OR 7", "line", cs) == 2);
+        CHECK(cs.captured == vector<string>({"Line 5 - Hex 5 - Mod 5",
+                                             "Line 7 - Hex 7 - Mod 7"}));
+        CHECK_THROWS(index.queryExpression("mod:1 AND (", "line", collect));
+        CHECK_THROWS(index.queryExpression("nonexistent:1", "line", collect));
+        lines.clear();
+        CHECK(index.cursorExpression("mod:1", "line").offset(2).limit(2)
+                      .forEach(collect) == 2);
+        CHECK(lines == vector<uint64_t>({513, 769}));
+
+        // The mod keys repeat every 256 lines, too jumbled for zone maps.
+        CHECK(index.countIndexRange("mod", "10", "12") == 768);
+        lines.clear();
+        CHECK(index.queryIndexRange("mod", "10", "12", collect) == 768);
+        CHECK(lines.front() == 10);
+        CHECK(lines.back() == 65292);
+
+        vector<pair<uint64_t, int64_t>> keys;
+        CHECK(index.lineKeys("mod", {1, 2, 256, 300, 70000},
+                             [&](uint64_t line, int64_t key) {
+                                 keys.emplace_back(line, key);
+                             }) == 4);
+        vector<pair<uint64_t, int64_t>> expectedKeys{
+                {1, 1}, {2, 2}, {256, 0}, {300, 44}};
+        CHECK(keys == expectedKeys);
+        CHECK_THROWS_AS(index.lineKeys("nonexistent", {1},
+                                       [](uint64_t, int64_t) {}),
+                        const std::runtime_error &);
+
+        SECTION("counts from the index alone") {
+            auto indexOnlyFile = tempDir.path + "/index-only.zindex";
+            REQUIRE(system(("cp " + testFile + ".zindex " + indexOnlyFile)
+                                   .c_str()) == 0);
+            {
+                Sqlite db(log);
+                db.open(indexOnlyFile, false);
+                db.exec("DELETE FROM AccessPoints");
+            }
+            Index indexOnly = Index::load(
+                    log, File(fopen(testFile.c_str(), "rb")), indexOnlyFile,
+                    false);
+            CHECK(indexOnly.countIndex("mod", "1") == 256);
+            CHECK(indexOnly.countIndexMulti("mod", {"1", "2", "1"}) == 512);
+            CHECK(indexOnly.countIndexRange("line", "10", "19") == 10);
+            CHECK(indexOnly.countExpression("1..1000 AND mod:1", "line") == 4);
+            CHECK(indexOnly.countExpression("NOT mod:0..254", "line") == 256);
+            CHECK_THROWS(indexOnly.countIndexPrefix("line", "1"));
+            CaptureSink cs;
+            CHECK_THROWS(indexOnly.getLine(1, cs));
+        }
+    }
+
+    SECTION("posting lists") {
+        Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                               testFile, testFile + ".zindex");
+        builder.addIndexer("line", "blah",
+                           Index::IndexConfig().withNumeric(true),
+                           unique_ptr<LineIndexer>(
+                                   new RegExpIndexer("^Line ([0-9]+)")))
+                .addIndexer("mod", "blah",
+                            Index::IndexConfig().withNumeric(true)
+                                    .withPostingLists(true),
+                            unique_ptr<LineIndexer>(
+                                    new RegExpIndexer("Mod ([0-9]+)")))
+                .addIndexer("digit", "blah",
+                            Index::IndexConfig().withPostingLists(true),
+                            unique_ptr<LineIndexer>(
+                                    new RegExpIndexer("^Line ([0-9])")))
+                .indexEvery(256 * 1024)
+                .build();
+        Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                  testFile + ".zindex", false);
+        CHECK(index.indexSize("mod") == 65536);
+        CHECK(index.indexSize("digit") == 65536);
+
+        // Lines starting with a 1 take more than one block.
+        vector<uint64_t> ones;
+        for (uint64_t i = 1; i <= 65536; ++i)
+            if (to_string(i)[0] == '1') ones.push_back(i);
+        vector<uint64_t> lines;
+        auto collect = [&](uint64_t line) { lines.emplace_back(line); };
+        CHECK(index.queryIndex("digit", "1", collect) == ones.size());
+        CHECK(lines == ones);
+        CHECK(index.countIndex("digit", "1") == ones.size());
+        lines.clear();
+        CHECK(index.cursorIndex("digit", "1").offset(9000).limit(3)
+                      .forEach(collect) == 3);
+        CHECK(lines == vector<uint64_t>(ones.begin() + 9000,
+                                        ones.begin() + 9003));
+        CHECK(index.countIndexPrefix("digit", "1") == ones.size());
+        CHECK(index.countIndexRange("digit", "1", "2") == 2 * ones.size());
+
+        lines.clear();
+        CHECK(index.queryIndexMulti("mod", {"2", "1", "2"}, collect) == 512);
+        CHECK(lines.front() == 1);
+        CHECK(lines[1] == 2);
+        CHECK(lines.back() == 65282);
+        CHECK(index.countIndexMulti("mod", {"1", "2", "1"}) == 512);
+        CHECK(index.countIndexRange("mod", "250", "300") == 6 * 256);
+        CHECK(index.countIndex("mod", "256") == 0);
+
+        size_t expected = 0;
+        for (uint64_t i = 1; i <= 65536; ++i)
+            if ((i & 0xff) == 1 && to_string(i)[0] == '2') ++expected;
+        CHECK(index.countExpression("mod:1 AND digit:2", "line") == expected);
+        CaptureSink cs;
+        CHECK(index.queryExpression("mod:5 AND 1..300 AND NOT digit:2", "line",
+                                    cs) == 1);
+        CHECK(cs.captured == vector<string>({"Line 5 - Hex 5 - Mod 5"}));
+
+        vector<pair<uint64_t, int64_t>> keys;
+        CHECK(index.lineKeys("mod", {300, 1, 256, 70000},
+                             [&](uint64_t line, int64_t key) {
+                                 keys.emplace_back(line, key);
+                             }) == 3);
+        vector<pair<uint64_t, int64_t>> expectedKeys{
+                {1, 1}, {256, 0}, {300, 44}};
+        CHECK(keys == expectedKeys);
+    }
+
+    SECTION("clustered") {
+        Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                               testFile, testFile + ".zindex");
+        // The line and mod numbers, which coincide on the first 256 lines.
+        builder.addIndexer("numbers", "blah",
+                           Index::IndexConfig().withNumeric(true)
+                                   .withClustered(true),
+                           unique_ptr<LineIndexer>(
+                                   new RegExpIndexer("[ed] ([0-9]+)")))
+                .addIndexer("hex", "blah",
+                            Index::IndexConfig().withUnique(true)
+                                    .withClustered(true),
+                            unique_ptr<LineIndexer>(
+                                    new RegExpIndexer("Hex ([0-9a-f]+)")))
+                .indexEvery(256 * 1024)
+                .build();
+        {
+            Sqlite db(log);
+            db.open(testFile + ".zindex", true);
+            auto tables = db.prepare(R"(
+SELECT COUNT(*) FROM sqlite_master
+WHERE name LIKE 'index_%' AND sql LIKE '%WITHOUT ROWID')");
+            REQUIRE(!tables.step());
+            CHECK(tables.columnInt64(0) == 2);
+            auto indexes = db.prepare(R"(
+SELECT COUNT(*) FROM sqlite_master WHERE name LIKE '%_key_index')");
+            REQUIRE(!indexes.step());
+            CHECK(indexes.columnInt64(0) == 0);
+        }
+        Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                  testFile + ".zindex", false);
+        vector<uint64_t> lines;
+        auto collect = [&](uint64_t line) { lines.emplace_back(line); };
+        CHECK(index.queryIndexMulti("numbers", {"17"}, collect) == 256);
+        CHECK(lines.front() == 17);
+        CHECK(lines.back() == 65297);
+        CHECK(index.countIndexRange("numbers", "65535", "70000") == 2);
+        CaptureSink cs;
+        CHECK(index.queryIndex("hex", "ffff", cs) == 1);
+        CHECK(cs.captured == vector<string>({"Line 65535 - Hex ffff - Mod 255"}));
+    }
+
+    SECTION("dictionary encoded") {
+        Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                               testFile, testFile + ".zindex");
+        builder.addIndexer("first", "blah",
+                           Index::IndexConfig().withDictionary(true),
+                           unique_ptr<LineIndexer>(
+                                   new RegExpIndexer("Hex ([0-9a-f])")))
+                .addIndexer("hex", "blah",
+                            Index::IndexConfig().withDictionary(true)
+                                    .withUnique(true).withClustered(true),
+                            unique_ptr<LineIndexer>(
+                                    new RegExpIndexer("Hex ([0-9a-f]+)")))
+                .indexEvery(256 * 1024)
+                .build();
+        {
+            Sqlite db(log);
+            db.open(testFile + ".zindex", true);
+            auto keys = db.prepare("SELECT COUNT(*) FROM keys_first");
+            REQUIRE(!keys.step());
+            CHECK(keys.columnInt64(0) == 15);
+        }
+        Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                  testFile + ".zindex", false);
+        CHECK(index.indexSize("first") == 65536);
+        // 1, 10-1f, 100-1ff, 1000-1fff and 10000.
+        CHECK(index.countIndex("first", "1") == 1 + 16 + 256 + 4096 + 1);
+        CHECK(index.countIndexMulti("first", {"e", "f"}) == 2 * (1 + 16 + 256
+                                                                + 4096));
+        CHECK(index.countIndexRange("first", "a", "c") == 3 * (1 + 16 + 256
+                                                              + 4096));
+        CHECK(index.countExpression("first:f AND hex:ff*", "hex") == 273);
+        CaptureSink cs;
+        CHECK(index.queryIndex("hex", "ff10", cs) == 1);
+        CHECK(cs.captured == vector<string>({"Line 65296 - Hex ff10 - Mod 16"}));
+        vector<uint64_t> lines;
+        CHECK(index.queryIndexMulti("first", {"9"}, [&](uint64_t line) {
+            lines.emplace_back(line);
+        }) == 1 + 16 + 256 + 4096);
+        CHECK(lines.front() == 9);
+        CHECK(std::is_sorted(lines.begin(), lines.end()));
+    }
+
+    SECTION("grep") {
+        auto expected = vector<string>();
+        for (auto i = 0xff00; i <= 0xff90; i += 0x10) {
+            ostringstream line;
+            line << "Line " << i << " - Hex " << hex << i << " - Mod " << dec
+                 << (i & 0xff);
+            expected.push_back(line.str());
+        }
+        for (auto trigrams : {0, 1000}) {
+            INFO("trigram blocks of " << trigrams << " lines");
+            Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                                   testFile, testFile + ".zindex");
+            builder.indexTrigrams(trigrams)
+                    .storeLineOffsets(trigrams == 0)
+                    .indexEvery(256 * 1024)
+                    .build();
+            Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                      testFile + ".zindex", false);
+            auto count = [&](const string &regex) {
+                return index.cursorGrep(regex).forEach([](uint64_t) {});
+            };
+            CaptureSink cs;
+            CHECK(index.grep("Hex ff[0-9]0 ", cs) == 10);
+            CHECK(cs.captured == expected);
+            CHECK(count("^Line 6553[0-9]|Hex 1 ") == 8);
+            CHECK(count("Mod (255|0)$") == 512);
+            CHECK(count("Hex fffff") == 0);
+            // The sink stops the search.
+            struct FirstThree : LineSink {
+                vector<uint64_t> lines;
+                bool onLine(size_t lineNumber, size_t, const char *,
+                            size_t) override {
+                    lines.push_back(lineNumber);
+                    return lines.size() < 3;
+                }
+            } firstThree;
+            CHECK(index.grep("Mod 7$", firstThree) == 3);
+            CHECK(firstThree.lines == vector<uint64_t>({7, 263, 519}));
+
+            // Searching in parallel, or a single field, finds the same.
+            auto parallel = Index::GrepOptions().withJobs(4);
+            CaptureSink inParallel;
+            CHECK(index.grep("Hex ff[0-9]0 ", inParallel, parallel) == 10);
+            CHECK(inParallel.captured == expected);
+            CHECK(index.cursorGrep("Mod (255|0)$", parallel)
+                          .forEach([](uint64_t) {}) == 512);
+            firstThree.lines.clear();
+            CHECK(index.grep("Mod 7$", firstThree, parallel) == 3);
+            CHECK(firstThree.lines == vector<uint64_t>({7, 263, 519}));
+            CaptureSink field;
+            CHECK(index.grep("^ff[0-9]0$", field,
+                             parallel.withField(5, " ")) == 10);
+            CHECK(field.captured == expected);
+            CHECK(count("^Line 1 ") == 1);
+            CHECK(index.cursorGrep("^1$", Index::GrepOptions().withField(2, " "))
+                          .forEach([](uint64_t) {}) == 1);
+            CHECK_THROWS_AS(index.cursorGrep(
+                    "1", Index::GrepOptions().withField(-1, " ")),
+                            const std::invalid_argument &);
+        }
+    }
+
+    SECTION("hashed") {
+        Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                               testFile, testFile + ".zindex");
+        builder.addIndexer("first", "blah",
+                           Index::IndexConfig().withHashed(true),
+                           unique_ptr<LineIndexer>(
+                                   new RegExpIndexer("Hex ([0-9a-f])")))
+                .addIndexer("hex", "blah",
+                            Index::IndexConfig().withHashed(true)
+                                    .withUnique(true),
+                            unique_ptr<LineIndexer>(
+                                    new RegExpIndexer("Hex ([0-9a-f]+)")))
+                .indexEvery(256 * 1024)
+                .build();
+        {
+            // Give line 14 (Hex e) the hash of line 15 (Hex f), as if the two
+            // keys had the same hash.
+            Sqlite db(log);
+            db.open(testFile + ".zindex", false);
+            db.exec("UPDATE index_first SET key = (SELECT key FROM index_first"
+                    " WHERE line = 15) WHERE line = 14");
+        }
+        Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                  testFile + ".zindex", false);
+        CHECK(index.indexSize("first") == 65536);
+        CHECK(index.countIndex("first", "f") == 1 + 16 + 256 + 4096);
+        CHECK(index.countIndex("first", "e") == 16 + 256 + 4096);
+        CHECK(index.countIndexMulti("first", {"e", "f"}) == 1 + 2 * (16 + 256
+                                                                    + 4096));
+        CHECK(index.countExpression("first:f AND hex:ff10", "hex") == 1);
+        CHECK_THROWS_AS(index.countIndexRange("first", "a", "c"),
+                        const std::invalid_argument &);
+        CHECK_THROWS_AS(index.countIndexPrefix("hex", "ff"),
+                        const std::invalid_argument &);
+        CaptureSink cs;
+        CHECK(index.queryIndex("hex", "ff10", cs) == 1);
+        CHECK(cs.captured == vector<string>({"Line 65296 - Hex ff10 - Mod 16"}));
+        CHECK(index.queryIndex("hex", "fffff", cs) == 0);
+        vector<uint64_t> lines;
+        CHECK(index.queryIndexMulti("first", {"f"}, [&](uint64_t line) {
+            lines.emplace_back(line);
+        }) == 1 + 16 + 256 + 4096);
+        CHECK(lines.front() == 15);
+        CHECK(std::is_sorted(lines.begin(), lines.end()));
+    }
+
+    SECTION("hashed, checking keys with the indexer") {
+        Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                               testFile, testFile + ".zindex");
+        builder.addIndexer("hex", "blah",
+                           Index::IndexConfig().withHashed(true)
+                                   .withIndexerConfig(
+                                           "{\"type\": \"regex\", "
+                                           "\"regex\": \"Hex ([0-9a-f]+)\"}"),
+                           unique_ptr<LineIndexer>(
+                                   new RegExpIndexer("Hex ([0-9a-f]+)")))
+                .indexEvery(256 * 1024)
+                .build();
+        {
+            // Give line 31 (Hex 1f) the hash of line 15 (Hex f), with no
+            // offset, as an external indexer would: its text has an "f" in
+            // it, but its key isn't "f".
+            Sqlite db(log);
+            db.open(testFile + ".zindex", false);
+            db.exec("UPDATE index_hex SET key = (SELECT key FROM index_hex"
+                    " WHERE line = 15), offset = 0 WHERE line = 31");
+        }
+        Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                  testFile + ".zindex", false);
+        vector<uint64_t> lines;
+        CHECK(index.queryIndex("hex", "f", [&](uint64_t line) {
+            lines.emplace_back(line);
+        }) == 1);
+        CHECK(lines == vector<uint64_t>({15}));
+        CHECK(index.countIndexMulti("hex", {"f", "1f", "ff10"}) == 2);
+    }
+
+    SECTION("hashed numeric") {
+        Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                               testFile, testFile + ".zindex");
+        CHECK_THROWS_AS(builder.addIndexer(
+                "default", "blah",
+                Index::IndexConfig().withHashed(true).withNumeric(true),
+                unique_ptr<LineIndexer>(new RegExpIndexer("Line ([0-9]+)"))),
+                        const std::invalid_argument &);
     }
 
     SECTION("unique alpha") {
@@ -159,6 +635,18 @@ TEST_CASE("indexes files", "[Index]") {
         CheckIndex("2", "Line 2 - Hex 2 - Mod 2");
         CheckIndex("3", "Line 3 - Hex 3 - Mod 3");
         CheckIndex("a", "Line 10 - Hex a - Mod 10");
+
+        CaptureSink cs;
+        // ff, ff0-fff and ff00-ffff
+        CHECK(index.queryIndexPrefix("default", "ff", cs) == 1 + 16 + 256);
+        REQUIRE(cs.captured.size() == 1 + 16 + 256);
+        CHECK(cs.captured.front() == "Line 255 - Hex ff - Mod 255");
+        CHECK(cs.captured.back() == "Line 65535 - Hex ffff - Mod 255");
+        cs.captured.clear();
+        CHECK(index.queryIndexRange("default", "fffe", "g", cs) == 2);
+        CHECK(cs.captured == vector<string>({
+                "Line 65534 - Hex fffe - Mod 254",
+                "Line 65535 - Hex ffff - Mod 255"}));
     }
 
     SECTION("non-unique alpha") {
@@ -282,6 +770,72 @@ TEST_CASE("indexes concatenated files", "[Index]") {
     CheckIndex(1, "Line 1 - Hex 1 - Mod 1");
     CheckIndex(2, "Line 2 - Hex 2 - Mod 2");
     CheckIndex(3, "Line 3 - Hex 3 - Mod 3");
+
+    SECTION("concurrent readers") {
+        // CaptureLog isn't thread safe.
+        log.minSeverity_ = Log::Severity::Warning;
+        constexpr auto numThreads = 4;
+        vector<vector<string>> results(numThreads);
+        vector<thread> threads;
+        for (auto t = 0; t < numThreads; ++t) {
+            threads.emplace_back([&, t](Index reader) {
+                for (auto line = 1 + t; line <= maxNum; line += 1023) {
+                    CaptureSink cs;
+                    reader.getLine(line, cs);
+                    reader.queryIndex("default", to_string(line), cs);
+                    for (auto &l : cs.captured)
+                        results[t].emplace_back(l);
+                }
+            }, index.reader());
+        }
+        for (auto &thread : threads) thread.join();
+        for (auto t = 0; t < numThreads; ++t) {
+            auto it = results[t].begin();
+            for (auto line = 1 + t; line <= maxNum; line += 1023) {
+                ostringstream expected;
+                expected << "Line " << line << " - Hex " << hex << line
+                         << " - Mod " << dec << (line & 0xff);
+                REQUIRE(distance(it, results[t].end()) >= 2);
+                CHECK(*it++ == expected.str());
+                CHECK(*it++ == expected.str());
+            }
+            CHECK(it == results[t].end());
+        }
+        // The original index is unaffected.
+        CheckLine(65536, "Line 65536 - Hex 10000 - Mod 0");
+    }
+
+    SECTION("cat") {
+        // CaptureLog isn't thread safe.
+        log.minSeverity_ = Log::Severity::Warning;
+        auto text = [](uint64_t first, uint64_t last) {
+            ostringstream lines;
+            for (auto line = first; line <= last; ++line) {
+                lines << "Line " << line << " - Hex " << hex << line
+                      << " - Mod " << dec << (line & 0xff) << "\n";
+            }
+            return lines.str();
+        };
+        for (auto jobs : {1u, 4u}) {
+            INFO(jobs << " jobs");
+            auto cat = [&](uint64_t first, uint64_t last) {
+                string result;
+                auto bytes = index.cat(first, last,
+                                       [&](const char *data, size_t length) {
+                                           result.append(data, length);
+                                       }, jobs);
+                CHECK(bytes == result.size());
+                return result;
+            };
+            CHECK(cat(1, maxNum) == text(1, maxNum));
+            CHECK(cat(0, 1000000) == text(1, maxNum));
+            CHECK(cat(5, 5) == text(5, 5));
+            CHECK(cat(1000, 40000) == text(1000, 40000));
+            CHECK(cat(65000, 70000) == text(65000, maxNum));
+            CHECK(cat(70000, 80000).empty());
+            CHECK(cat(10, 9).empty());
+        }
+    }
 }
 
 TEST_CASE("sparsely indexes files", "[Index]") {
@@ -325,6 +879,142 @@ TEST_CASE("sparsely indexes files", "[Index]") {
         };
         CheckIndex("1", 1);
         CheckIndex("65536", 1);
+        CHECK(index.getMetadata().at("sparse") == "0");
+    }
+
+    SECTION("records that it's sparse") {
+        Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                               testFile, testFile + ".zindex");
+        unique_ptr<LineIndexer> indexer(new RegExpIndexer("Line ([^-]+) "));
+        builder
+                .addIndexer("default", "blah",
+                            Index::IndexConfig().withSparse(true),
+                            move(indexer))
+                .indexEvery(256 * 1024)
+                .build();
+        Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                  testFile + ".zindex", false);
+        CHECK(index.getMetadata().at("sparse") == "1");
+    }
+}
+
+TEST_CASE("samples indexes of keys which never decrease", "[Index]") {
+    TempDir tempDir;
+    CaptureLog log;
+    auto testFile = tempDir.path + "/test.log";
+    // Every third line shares a time, and every tenth has none.
+    auto timeOf = [](int line) { return line % 10 ? line / 3 : -1; };
+    {
+        ofstream fileOut(testFile);
+        for (auto i = 1; i <= 20000; ++i) {
+            fileOut << "Line " << i << " - ";
+            if (timeOf(i) < 0) fileOut << "no time" << endl;
+            else fileOut << "Time " << setfill('0') << setw(6) << timeOf(i)
+                         << endl;
+        }
+        fileOut.close();
+        REQUIRE(system(("gzip -f " + testFile).c_str()) == 0);
+        testFile = testFile + ".gz";
+    }
+    auto indexerConfig =
+            "{\"type\": \"regex\", \"regex\": \"Time ([0-9]+)\"}";
+    auto linesBetween = [&](int from, int to) {
+        vector<uint64_t> lines;
+        for (auto i = 1; i <= 20000; ++i)
+            if (timeOf(i) >= from && timeOf(i) <= to) lines.push_back(i);
+        return lines;
+    };
+
+    SECTION("numeric, every so many lines") {
+        Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                               testFile, testFile + ".zindex");
+        builder.addIndexer("time", "blah",
+                           Index::IndexConfig().withNumeric(true)
+                                   .withSampling(500, indexerConfig),
+                           unique_ptr<LineIndexer>(
+                                   new RegExpIndexer("Time ([0-9]+)")))
+                .addIndexer("line", "blah",
+                            Index::IndexConfig().withNumeric(true),
+                            unique_ptr<LineIndexer>(
+                                    new RegExpIndexer("^Line ([0-9]+)")))
+                .indexEvery(64 * 1024)
+                .build();
+        Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                  testFile + ".zindex", false);
+        CHECK(index.indexSize("time") < 50);
+
+        vector<uint64_t> lines;
+        auto collect = [&](uint64_t line) { lines.emplace_back(line); };
+        CHECK(index.queryIndex("time", "1000", collect) == 2);
+        CHECK(lines == linesBetween(1000, 1000));
+        lines.clear();
+        CHECK(index.queryIndexRange("time", "2995", "3500", collect)
+              == linesBetween(2995, 3500).size());
+        CHECK(lines == linesBetween(2995, 3500));
+        lines.clear();
+        CHECK(index.queryIndexRange("time", "0", "2", collect) == 8);
+        CHECK(lines == linesBetween(0, 2));
+        lines.clear();
+        CHECK(index.queryIndexRange("time", "6600", "7000", collect) == 180);
+        CHECK(lines == linesBetween(6600, 7000));
+        CHECK(index.countIndexRange("time", "10", "19") == 27);
+        CHECK(index.countIndexMulti("time", {"10", "5000", "10"}) == 4);
+        CHECK(index.countIndex("time", "4444") == 3);
+        CHECK(index.countIndex("time", "7000") == 0);
+        CHECK(index.countExpression("time:100..200 AND line:1..305", "line")
+              == 5);
+
+        CaptureSink cs;
+        CHECK(index.queryIndexRange("time", "3333", "3334", cs) == 5);
+        CHECK(cs.captured.front() == "Line 9999 - Time 003333");
+        CHECK(cs.captured.back() == "Line 10004 - Time 003334");
+
+        vector<pair<uint64_t, int64_t>> keys;
+        CHECK(index.lineKeys("time", {20, 7, 19999},
+                             [&](uint64_t line, int64_t key) {
+                                 keys.emplace_back(line, key);
+                             }) == 2);
+        vector<pair<uint64_t, int64_t>> expectedKeys{{7, 2}, {19999, 6666}};
+        CHECK(keys == expectedKeys);
+    }
+
+    SECTION("alphabetic, at each checkpoint") {
+        Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                               testFile, testFile + ".zindex");
+        builder.addIndexer("time", "blah",
+                           Index::IndexConfig().withSampling(0, indexerConfig),
+                           unique_ptr<LineIndexer>(
+                                   new RegExpIndexer("Time ([0-9]+)")))
+                .indexEvery(16 * 1024)
+                .storeLineOffsets(false)
+                .build();
+        Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                  testFile + ".zindex", false);
+        CHECK(index.indexSize("time") < 100);
+        vector<uint64_t> lines;
+        auto collect = [&](uint64_t line) { lines.emplace_back(line); };
+        CHECK(index.queryIndexPrefix("time", "00123", collect) == 27);
+        CHECK(lines == linesBetween(1230, 1239));
+        lines.clear();
+        CHECK(index.queryIndexRange("time", "001000", "001001", collect) == 5);
+        CHECK(lines == linesBetween(1000, 1001));
+        CHECK(index.countIndexPrefix("time", "0066") == 180);
+    }
+
+    SECTION("refuses keys which decrease") {
+        Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                               testFile, testFile + ".zindex");
+        builder.addIndexer("line", "blah",
+                           Index::IndexConfig().withNumeric(true).withSampling(
+                                   10, "{\"type\": \"regex\", "
+                                       "\"regex\": \"^Line ([0-9]+)\"}"),
+                           unique_ptr<LineIndexer>(
+                                   new RegExpIndexer("^Line ([0-9]+)")))
+                .addIndexer("backwards", "blah",
+                            Index::IndexConfig().withSampling(10, ""),
+                            unique_ptr<LineIndexer>(
+                                    new RegExpIndexer("^Line ([0-9]+)")));
+        CHECK_THROWS_AS(builder.build(), const std::runtime_error &);
     }
 }
 
@@ -408,3 +1098,172 @@ TEST_CASE("metadata tests", "[Index]") {
         }
     }
 }
+
+TEST_CASE("cats files with far apart access points", "[Index]") {
+    TempDir tempDir;
+    CaptureLog log;
+    log.minSeverity_ = Log::Severity::Warning;
+    auto testFile = tempDir.path + "/test.log";
+    // Just over 32MiB, so the first gap between access points is too big to
+    // decompress at once.
+    string expected;
+    {
+        ofstream fileOut(testFile);
+        for (auto i = 1; expected.size() < 36 * 1024 * 1024; ++i) {
+            ostringstream line;
+            line << "Line " << i << " - Hex " << hex << i << "\n";
+            expected += line.str();
+        }
+        fileOut << expected;
+        fileOut.close();
+        REQUIRE(system(("gzip -1f " + testFile).c_str()) == 0);
+        testFile = testFile + ".gz";
+    }
+    Index::Builder(log, File(fopen(testFile.c_str(), "rb")), testFile,
+                   testFile + ".zindex").build();
+    Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                              testFile + ".zindex", false);
+    auto numLines = static_cast<uint64_t>(
+            count(expected.begin(), expected.end(), '\n'));
+    for (auto jobs : {1u, 4u}) {
+        string all;
+        size_t largest = 0;
+        CHECK(index.cat(1, numLines, [&](const char *data, size_t length) {
+            all.append(data, length);
+            largest = max(largest, length);
+        }, jobs) == expected.size());
+        CHECK(all == expected);
+        CHECK(largest <= 32 * 1024 * 1024u);
+        string some;
+        index.cat(2, numLines - 1, [&](const char *data, size_t length) {
+            some.append(data, length);
+        }, jobs);
+        auto begin = expected.find('\n') + 1;
+        auto end = expected.rfind('\n', expected.size() - 2) + 1;
+        CHECK(some == expected.substr(begin, end - begin));
+    }
+}
+
+TEST_CASE("finds lines from checkpoints", "[Index]") {
+    TempDir tempDir;
+    CaptureLog log;
+    auto testFile = tempDir.path + "/test.log";
+    {
+        ofstream fileOut(testFile);
+        for (auto i = 1; i <= 65536; ++i) {
+            fileOut << "Line " << i
+                    << " - Hex " << hex << i
+                    << " - Mod " << dec << (i & 0xff);
+            if (i != 65536) fileOut << endl;
+        }
+        fileOut.close();
+        REQUIRE(system(("gzip -f " + testFile).c_str()) == 0);
+        testFile = testFile + ".gz";
+    }
+    Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                           testFile, testFile + ".zindex");
+    unique_ptr<LineIndexer> indexer(new RegExpIndexer("^Line ([0-9]+)"));
+    builder
+            .addIndexer("default", "blah",
+                        Index::IndexConfig().withNumeric(true).withUnique(
+                                true), move(indexer))
+            .indexEvery(64 * 1024)
+            .storeLineOffsets(false)
+            .build();
+    Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                              testFile + ".zindex", false);
+    CHECK(index.getMetadata().at("lineIndex") == "checkpoints");
+    auto CheckLine = [&](uint64_t line) {
+        CaptureSink cs;
+        INFO("line " << line);
+        REQUIRE(index.getLine(line, cs));
+        REQUIRE(cs.captured.size() == 1);
+        ostringstream expected;
+        expected << "Line " << line << " - Hex " << hex << line
+                 << " - Mod " << dec << (line & 0xff);
+        CHECK(cs.captured.at(0) == expected.str());
+    };
+    SECTION("in order") {
+        for (auto line = 1u; line <= 65536; line += 97) CheckLine(line);
+        CheckLine(65536);
+    }
+    SECTION("out of order") {
+        CheckLine(40000);
+        CheckLine(3);
+        CheckLine(65535);
+        CheckLine(1);
+        CheckLine(40001);
+        CheckLine(39999);
+    }
+    SECTION("ranges") {
+        CaptureSink cs;
+        CHECK(index.getLineRange(1, 1000, cs) == 1000);
+        CHECK(index.getLineRange(65000, 70000, cs) == 537);
+        REQUIRE(cs.captured.size() == 1537);
+        for (auto line = 1u; line <= 65536; ++line) {
+            if (line == 1001) line = 65000;
+            ostringstream expected;
+            expected << "Line " << line << " - Hex " << hex << line
+                     << " - Mod " << dec << (line & 0xff);
+            REQUIRE(cs.captured.at(line <= 1000 ? line - 1 : line - 64000)
+                    == expected.str());
+        }
+        CheckLine(3);
+        CHECK(index.getLineRange(65537, 70000, cs) == 0);
+
+        struct FirstOnly : CaptureSink {
+            bool onLine(size_t lineNumber, size_t fileOffset,
+                        const char *line, size_t length) override {
+                CaptureSink::onLine(lineNumber, fileOffset, line, length);
+                return false;
+            }
+        } firstOnly;
+        CHECK(index.getLineRange(100, 200, firstOnly) == 1);
+        CheckLine(101);
+    }
+    SECTION("cat") {
+        log.minSeverity_ = Log::Severity::Warning;
+        string all;
+        auto bytes = index.cat(1, 65536, [&](const char *data, size_t length) {
+            all.append(data, length);
+        }, 4);
+        CHECK(bytes == all.size());
+        // The last line has no newline.
+        REQUIRE(all.size() > 0);
+        CHECK(all.back() == '0');
+        CHECK(count(all.begin(), all.end(), '\n') == 65535);
+        string some;
+        index.cat(30000, 40000, [&](const char *data, size_t length) {
+            some.append(data, length);
+        });
+        auto begin = all.find("Line 30000 ");
+        auto end = all.find("Line 40001 ");
+        CHECK(some == all.substr(begin, end - begin));
+    }
+    SECTION("past the end") {
+        CaptureSink cs;
+        CHECK(!index.getLine(65537, cs));
+        CHECK(!index.getLine(0, cs));
+        CHECK(cs.captured.empty());
+    }
+    SECTION("by index") {
+        CaptureSink cs;
+        index.queryIndex("default", "12345", cs);
+        REQUIRE(cs.captured.size() == 1);
+        CHECK(cs.captured.at(0) == "Line 12345 - Hex 3039 - Mod 57");
+    }
+    SECTION("ranges by zone") {
+        CaptureSink cs;
+        CHECK(index.queryIndexRange("default", "9990", "30010", cs) == 20021);
+        REQUIRE(cs.captured.size() == 20021);
+        CHECK(cs.captured.front() == "Line 9990 - Hex 2706 - Mod 6");
+        CHECK(cs.captured.back() == "Line 30010 - Hex 753a - Mod 58");
+        vector<pair<uint64_t, uint64_t>> runs;
+        CHECK(index.cursorIndexMulti("default", {"7", "3", "4", "9"})
+                      .forEachRun([&](uint64_t first, uint64_t last) {
+                          runs.emplace_back(first, last);
+                      }) == 4);
+        vector<pair<uint64_t, uint64_t>> expectedRuns{{3, 4}, {7, 7}, {9, 9}};
+        CHECK(runs == expectedRuns);
+    }
+}
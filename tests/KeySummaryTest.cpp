@@ -0,0 +1,42 @@
+#include "KeySummary.h"
+
+#include "catch.hpp"
+
+#include <string>
+
+using namespace std;
+
+TEST_CASE("summarises numeric keys", "[KeySummary]") {
+    BloomFilter filter(3, KeySummary::FalsePositiveRate);
+    for (auto key : {"-5", "10", "200"}) filter.add(key);
+    KeySummary summary(true, 3, "-5", "200", filter);
+    CHECK(summary.mayContain("10"));
+    CHECK(summary.mayContain("010"));
+    CHECK(summary.mayContain("-5"));
+    CHECK(!summary.mayContain("11"));
+    CHECK(summary.mayContain("not a number"));
+    CHECK(summary.mayContainRange("100", "300"));
+    CHECK(summary.mayContainRange("-10", "-5"));
+    CHECK(!summary.mayContainRange("201", "300"));
+    CHECK(!summary.mayContainRange("-100", "-6"));
+    // Numerically, not lexicographically.
+    CHECK(!summary.mayContainRange("3000", "9000"));
+}
+
+TEST_CASE("summarises alpha keys", "[KeySummary]") {
+    BloomFilter filter(2, KeySummary::FalsePositiveRate);
+    for (auto key : {"apple", "melon"}) filter.add(key);
+    KeySummary summary(false, 2, "apple", "melon", filter);
+    CHECK(summary.mayContain("apple"));
+    CHECK(!summary.mayContain("banana"));
+    CHECK(summary.mayContainRange("a", "b"));
+    CHECK(summary.mayContainRange("melon", "z"));
+    CHECK(!summary.mayContainRange("n", "z"));
+    CHECK(!summary.mayContainRange("0", "9"));
+}
+
+TEST_CASE("summarises no keys", "[KeySummary]") {
+    KeySummary summary(true, 0, "", "", BloomFilter(0, 0.01));
+    CHECK(!summary.mayContain("1"));
+    CHECK(!summary.mayContainRange("0", "100"));
+}
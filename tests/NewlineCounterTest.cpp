@@ -0,0 +1,41 @@
+#include "NewlineCounter.h"
+
+#include "catch.hpp"
+
+#include <string>
+
+namespace {
+
+const uint8_t *bytes(const std::string &s) {
+    return reinterpret_cast<const uint8_t *>(s.data());
+}
+
+}
+
+TEST_CASE("counts newlines", "[NewlineCounter]") {
+    CHECK(countNewlines(bytes(""), 0) == 0);
+    CHECK(countNewlines(bytes("no newlines"), 11) == 0);
+    CHECK(countNewlines(bytes("\n"), 1) == 1);
+    std::string data;
+    for (auto i = 0; i < 1000; ++i) {
+        data += std::string(i % 37, 'x');
+        data += '\n';
+    }
+    CHECK(countNewlines(bytes(data), data.size()) == 1000);
+    SECTION("unaligned starts and ends") {
+        for (auto skip = 0u; skip < 17; ++skip) {
+            auto expected = countNewlines(bytes(data), skip);
+            CHECK(countNewlines(bytes(data) + skip, data.size() - skip) ==
+                  1000 - expected);
+        }
+    }
+}
+
+TEST_CASE("finds newlines", "[NewlineCounter]") {
+    std::string data = "one\ntwo\nthree\nfour";
+    CHECK(findNewline(bytes(data), data.size(), 1) == bytes(data) + 3);
+    CHECK(findNewline(bytes(data), data.size(), 2) == bytes(data) + 7);
+    CHECK(findNewline(bytes(data), data.size(), 3) == bytes(data) + 13);
+    CHECK(findNewline(bytes(data), data.size(), 4) == nullptr);
+    CHECK(findNewline(bytes(data), data.size(), 0) == nullptr);
+}
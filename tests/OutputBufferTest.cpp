@@ -0,0 +1,86 @@
+#include "OutputBuffer.h"
+
+#include "catch.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include "TempDir.h"
+
+using namespace std;
+
+namespace {
+
+string readAll(const string &path) {
+    ifstream in(path);
+    stringstream contents;
+    contents << in.rdbuf();
+    return contents.str();
+}
+
+}
+
+TEST_CASE("buffers output", "[OutputBuffer]") {
+    TempDir tempDir;
+    auto path = tempDir.path + "/out.txt";
+    auto fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    REQUIRE(fd != -1);
+
+    SECTION("writes only when full or flushed") {
+        OutputBuffer out(fd, 32);
+        out.writeLine("hello", 5);
+        out.writeNumber(1234567890123ull);
+        out.write(":", 1);
+        out.writeLine("world", 5);
+        CHECK(readAll(path).empty());
+        out.writeLine("0123456789", 10);
+        CHECK(readAll(path) == "hello\n1234567890123:world\n0123456789\n");
+        out.writeNumber(0);
+        out.writeLine("", 0);
+        CHECK(readAll(path) == "hello\n1234567890123:world\n0123456789\n");
+        out.flush();
+        CHECK(readAll(path)
+              == "hello\n1234567890123:world\n0123456789\n0\n");
+    }
+
+    SECTION("writes large lines directly") {
+        string big(100, 'x');
+        {
+            OutputBuffer out(fd, 16);
+            out.write("a", 1);
+            out.writeLine(big.data(), big.size());
+            CHECK(readAll(path) == "a" + big + "\n");
+            out.writeLine("b", 1);
+        }
+        CHECK(readAll(path) == "a" + big + "\nb\n");
+    }
+
+    SECTION("flushes every line when line buffered") {
+        OutputBuffer out(fd);
+        out.setLineBuffered(true);
+        out.write("1:", 2);
+        CHECK(readAll(path).empty());
+        out.writeLine("one", 3);
+        CHECK(readAll(path) == "1:one\n");
+    }
+
+    close(fd);
+}
+
+TEST_CASE("collects output in a string", "[OutputBuffer]") {
+    string collected;
+    {
+        OutputBuffer out(collected, 16);
+        out.writeNumber(42);
+        out.writeLine(":hello", 6);
+        CHECK(collected.empty());
+        string big(40, 'x');
+        out.writeLine(big.data(), big.size());
+        CHECK(collected == "42:hello\n" + big + "\n");
+        out.writeLine("tail", 4);
+    }
+    CHECK(collected == "42:hello\n" + string(40, 'x') + "\ntail\n");
+}
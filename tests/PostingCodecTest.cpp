@@ -0,0 +1,64 @@
+#include "PostingCodec.h"
+
+#include "catch.hpp"
+
+#include <stdexcept>
+
+namespace {
+
+PostingList roundTrip(const PostingList &lines) {
+    PostingEncoder encoder;
+    for (auto line : lines) encoder.add(line);
+    PostingList decoded;
+    PostingDecoder(encoder.bytes()).decodeInto(decoded);
+    return decoded;
+}
+
+}
+
+TEST_CASE("encodes posting lists", "[PostingCodec]") {
+    PostingEncoder encoder;
+    CHECK(encoder.empty());
+    encoder.add(1);
+    encoder.add(2);
+    encoder.add(130);
+    CHECK(encoder.size() == 3);
+    CHECK(encoder.first() == 1);
+    CHECK(encoder.last() == 130);
+    // Deltas of 1, 1 and 128, the last needing two bytes.
+    CHECK(encoder.bytes() == std::string("\x01\x01\x80\x01", 4));
+    CHECK_THROWS_AS(encoder.add(130), const std::invalid_argument &);
+    encoder.clear();
+    CHECK(encoder.empty());
+    CHECK(encoder.bytes().empty());
+}
+
+TEST_CASE("decodes posting lists", "[PostingCodec]") {
+    CHECK(roundTrip({}) == PostingList());
+    CHECK(roundTrip({7}) == PostingList({7}));
+    PostingList lines;
+    for (uint64_t line = 1; line < 1000000; line += line / 3 + 1)
+        lines.push_back(line);
+    lines.push_back(1ull << 40);
+    lines.push_back(~0ull);
+    CHECK(roundTrip(lines) == lines);
+
+    SECTION("one at a time") {
+        PostingEncoder encoder;
+        for (auto line : lines) encoder.add(line);
+        PostingDecoder decoder(encoder.bytes());
+        uint64_t line;
+        REQUIRE(decoder.next(line));
+        CHECK(line == 1);
+        REQUIRE(decoder.next(line));
+        CHECK(line == 2);
+    }
+
+    SECTION("complains about truncated lists") {
+        std::string truncated("\x01\x80", 2);
+        PostingList decoded;
+        CHECK_THROWS_AS(PostingDecoder(truncated).decodeInto(decoded),
+                        const std::runtime_error &);
+        CHECK(decoded == PostingList({1}));
+    }
+}
@@ -0,0 +1,42 @@
+#include "PostingList.h"
+
+#include "catch.hpp"
+
+TEST_CASE("intersects posting lists", "[PostingList]") {
+    CHECK(intersect({}, {}) == PostingList());
+    CHECK(intersect({1, 2, 3}, {}) == PostingList());
+    CHECK(intersect({1, 2, 3}, {2}) == PostingList({2}));
+    CHECK(intersect({2}, {1, 2, 3}) == PostingList({2}));
+    CHECK(intersect({1, 3, 5, 7}, {2, 3, 4, 7, 8}) == PostingList({3, 7}));
+    SECTION("galloping over large lists") {
+        PostingList evens, sparse;
+        for (uint64_t i = 2; i <= 100000; i += 2) evens.emplace_back(i);
+        for (uint64_t i = 1; i <= 100000; i += 999) sparse.emplace_back(i);
+        auto result = intersect(evens, sparse);
+        PostingList expected;
+        for (auto i : sparse) if (i % 2 == 0) expected.emplace_back(i);
+        CHECK(result == expected);
+        CHECK(intersect(sparse, evens) == expected);
+        CHECK(intersect(evens, {100000}) == PostingList({100000}));
+        CHECK(intersect(evens, {100001}) == PostingList());
+    }
+}
+
+TEST_CASE("unites posting lists", "[PostingList]") {
+    CHECK(unite({}, {}) == PostingList());
+    CHECK(unite({1, 3}, {}) == PostingList({1, 3}));
+    CHECK(unite({1, 3}, {2, 3, 4}) == PostingList({1, 2, 3, 4}));
+}
+
+TEST_CASE("subtracts posting lists", "[PostingList]") {
+    CHECK(subtract({}, {1}) == PostingList());
+    CHECK(subtract({1, 2, 3}, {}) == PostingList({1, 2, 3}));
+    CHECK(subtract({1, 2, 3, 4, 5}, {2, 4, 6}) == PostingList({1, 3, 5}));
+    CHECK(subtract({5, 6}, {1, 2, 3}) == PostingList({5, 6}));
+}
+
+TEST_CASE("complements posting lists", "[PostingList]") {
+    CHECK(complement({}, 3) == PostingList({1, 2, 3}));
+    CHECK(complement({1, 3}, 4) == PostingList({2, 4}));
+    CHECK(complement({1, 2}, 2) == PostingList());
+}
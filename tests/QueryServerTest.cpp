@@ -0,0 +1,82 @@
+#include "QueryServer.h"
+
+#include "catch.hpp"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+
+#include <string>
+#include <thread>
+#include <vector>
+#include "CaptureLog.h"
+#include "Pipe.h"
+#include "TempDir.h"
+
+using namespace std;
+
+TEST_CASE("serves requests over a socket", "[QueryServer]") {
+    TempDir tempDir;
+    CaptureLog log;
+    auto socket = tempDir.path + "/zq.sock";
+    QueryServer server(log, socket);
+    Pipe out;
+    vector<string> received;
+    auto handler = [&](const vector<string> &args, int, int outFd, int) {
+        received = args;
+        string reply = "hello " + args.back();
+        REQUIRE(write(outFd, reply.data(), reply.size())
+                == static_cast<ssize_t>(reply.size()));
+        return 42;
+    };
+
+    thread serverThread([&] { server.serveOne(handler); });
+    auto result = QueryServer::request(socket, {"one", "", "three"},
+                                       STDIN_FILENO, out.writeFd(),
+                                       STDERR_FILENO);
+    serverThread.join();
+    CHECK(result == 42);
+    CHECK(received == vector<string>({"one", "", "three"}));
+    char buffer[64];
+    auto length = read(out.readFd(), buffer, sizeof(buffer));
+    CHECK(string(buffer, length > 0 ? length : 0) == "hello three");
+
+    SECTION("refuses to steal a live socket") {
+        CHECK_THROWS(QueryServer(log, socket));
+    }
+}
+
+TEST_CASE("drops clients which stall", "[QueryServer]") {
+    TempDir tempDir;
+    CaptureLog log;
+    auto socket = tempDir.path + "/zq.sock";
+    QueryServer server(log, socket, chrono::milliseconds(50));
+    auto handled = false;
+    auto handler = [&](const vector<string> &, int, int, int) {
+        handled = true;
+        return 0;
+    };
+
+    // Connect, but never send a request.
+    auto address = sockaddr_un();
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket.c_str());
+    auto idle = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    REQUIRE(connect(idle, reinterpret_cast<sockaddr *>(&address),
+                    sizeof(address)) == 0);
+    CHECK_THROWS(server.serveOne(handler));
+    CHECK(!handled);
+    close(idle);
+
+    // Others are served as normal.
+    Pipe out;
+    thread serverThread([&] { server.serveOne(handler); });
+    auto result = QueryServer::request(socket, {"hello"}, STDIN_FILENO,
+                                       out.writeFd(), STDERR_FILENO);
+    serverThread.join();
+    CHECK(result == 0);
+    CHECK(handled);
+}
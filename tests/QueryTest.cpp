@@ -0,0 +1,97 @@
+#include "Query.h"
+
+#include "catch.hpp"
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+// A Source over a fixed set of keys, where each index:key maps to its lines.
+// Tracks which terms were fetched, so we can check terms get skipped.
+struct FakeSource : Query::Source {
+    map<string, PostingList> postings;
+    uint64_t lineCount = 20;
+    vector<string> fetched;
+
+    static string name(const Query::Term &term) {
+        return term.index + ":" + term.key;
+    }
+
+    size_t estimate(const Query::Term &term) override {
+        auto it = postings.find(name(term));
+        return it == postings.end() ? 0 : it->second.size();
+    }
+
+    PostingList lines(const Query::Term &term) override {
+        fetched.emplace_back(name(term));
+        auto it = postings.find(name(term));
+        return it == postings.end() ? PostingList() : it->second;
+    }
+
+    uint64_t numLines() override {
+        return lineCount;
+    }
+};
+
+}
+
+TEST_CASE("parses queries", "[Query]") {
+    auto parse = [](const string &expression) {
+        return Query(expression, "default").toString();
+    };
+    CHECK(parse("foo") == "default:foo");
+    CHECK(parse("a:1 AND b:2") == "(AND a:1 b:2)");
+    CHECK(parse("a:1 b:2 c:3") == "(AND a:1 b:2 c:3)");
+    CHECK(parse("a:1 OR b:2 AND c:3") == "(OR a:1 (AND b:2 c:3))");
+    CHECK(parse("(a:1 OR b:2) AND NOT c:3")
+          == "(AND (OR a:1 b:2) (NOT c:3))");
+    CHECK(parse("NOT NOT a:1") == "(NOT (NOT a:1))");
+    CHECK(parse("a:1..10 b:abc*") == "(AND a:1..10 b:abc*)");
+    CHECK(parse("url:http://x") == "url:http://x");
+    CHECK(parse("a:\"two words\" \"AND\"") == "(AND a:two words default:AND)");
+    CHECK(parse("a:\"x*\"") == "a:x*");
+
+    CHECK_THROWS_AS(parse(""), const std::invalid_argument &);
+    CHECK_THROWS_AS(parse("a:1 AND"), const std::invalid_argument &);
+    CHECK_THROWS_AS(parse("(a:1"), const std::invalid_argument &);
+    CHECK_THROWS_AS(parse("a:1)"), const std::invalid_argument &);
+    CHECK_THROWS_AS(parse("a:\"1"), const std::invalid_argument &);
+    CHECK_THROWS_AS(parse(":1"), const std::invalid_argument &);
+    CHECK_THROWS_AS(Query("1", ""), const std::invalid_argument &);
+}
+
+TEST_CASE("evaluates queries", "[Query]") {
+    FakeSource source;
+    source.postings["a:1"] = {1, 2, 3, 4, 5, 6};
+    source.postings["b:1"] = {2, 4, 6, 8};
+    source.postings["c:1"] = {4};
+    source.postings["d:1"] = {7, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20};
+    auto evaluate = [&](const string &expression) {
+        source.fetched.clear();
+        return Query(expression, "a").evaluate(source);
+    };
+
+    CHECK(evaluate("1") == PostingList({1, 2, 3, 4, 5, 6}));
+    CHECK(evaluate("a:1 AND b:1") == PostingList({2, 4, 6}));
+    CHECK(evaluate("a:1 OR b:1") == PostingList({1, 2, 3, 4, 5, 6, 8}));
+    CHECK(evaluate("a:1 AND NOT b:1") == PostingList({1, 3, 5}));
+    CHECK(evaluate("(a:1 OR c:1) AND NOT (b:1 OR c:1)")
+          == PostingList({1, 3, 5}));
+    CHECK(evaluate("NOT a:1 AND NOT b:1")
+          == PostingList({7, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20}));
+    CHECK(evaluate("NOT (a:1 OR b:1 OR d:1)") == PostingList());
+
+    SECTION("evaluates the most selective term first") {
+        CHECK(evaluate("a:1 b:1 c:1") == PostingList({4}));
+        CHECK(source.fetched == vector<string>({"c:1", "b:1", "a:1"}));
+    }
+
+    SECTION("stops when nothing can match") {
+        CHECK(evaluate("a:1 missing:1 b:1 NOT c:1") == PostingList());
+        CHECK(source.fetched == vector<string>({"missing:1"}));
+    }
+}
@@ -17,6 +17,13 @@ struct MockHandler : RangeFetcher::Handler {
     }
 };
 
+struct RangeHandler : MockHandler {
+    void onRange(uint64_t first, uint64_t last) override {
+        lines.emplace_back(first);
+        lines.emplace_back(last);
+    }
+};
+
 }
 
 TEST_CASE("fetches just the lines asked", "[RangeFetcher]") {
@@ -191,3 +198,13 @@ TEST_CASE("handles both", "[RangeFetcher]") {
         CHECK(handler.lines == LL({ 3, 4, 5, 6, 7 }));
     }
 }
+
+TEST_CASE("fetches consecutive lines as ranges", "[RangeFetcher]") {
+    RangeHandler handler;
+    RangeFetcher rf(handler, 2, 2);
+    rf(10);
+    rf(12);
+    rf(1);
+    rf(30);
+    CHECK(handler.lines == LL({ 8, 12, 13, 14, 0, 1, 3, 0, 28, 32 }));
+}
@@ -0,0 +1,91 @@
+#include "Recompressor.h"
+#include "Index.h"
+#include "LineSink.h"
+#include "Sqlite.h"
+
+#include "catch.hpp"
+#include "TempDir.h"
+#include "CaptureLog.h"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+struct CaptureSink : LineSink {
+    vector<string> captured;
+
+    bool onLine(size_t, size_t, const char *line, size_t length) override {
+        captured.emplace_back(line, length);
+        return true;
+    }
+};
+
+string readAll(const string &path) {
+    ifstream in(path);
+    stringstream contents;
+    contents << in.rdbuf();
+    return contents.str();
+}
+
+}
+
+TEST_CASE("recompresses into independent blocks", "[Recompressor]") {
+    TempDir tempDir;
+    CaptureLog log;
+    auto plainFile = tempDir.path + "/test.log";
+    {
+        ofstream fileOut(plainFile);
+        for (auto i = 1; i <= 65536; ++i) {
+            fileOut << "Line " << i
+                    << " - Hex " << hex << i
+                    << " - Mod " << dec << (i & 0xff) << endl;
+        }
+    }
+    auto original = readAll(plainFile);
+    REQUIRE(system(("gzip -k -f " + plainFile).c_str()) == 0);
+    auto rewritten = tempDir.path + "/rewritten.gz";
+    uint64_t members;
+    {
+        File in(fopen((plainFile + ".gz").c_str(), "rb"));
+        File out(fopen(rewritten.c_str(), "wb"));
+        members = Recompressor(log, 64 * 1024).recompress(in, out);
+    }
+    CHECK(members == (original.size() + 64 * 1024 - 1) / (64 * 1024));
+
+    SECTION("is readable by gzip") {
+        auto unzipped = tempDir.path + "/unzipped.log";
+        REQUIRE(system(("gzip -dc " + rewritten + " > " + unzipped).c_str())
+                == 0);
+        CHECK(readAll(unzipped) == original);
+    }
+
+    SECTION("indexes without windows") {
+        auto indexFile = rewritten + ".zindex";
+        Index::Builder(log, File(fopen(rewritten.c_str(), "rb")), rewritten,
+                       indexFile).build();
+        Sqlite db(log);
+        db.open(indexFile, true);
+        auto count = db.prepare("SELECT COUNT(*), COUNT(window) "
+                                        "FROM AccessPoints");
+        REQUIRE(!count.step());
+        CHECK(count.columnInt64(0) == static_cast<int64_t>(members));
+        CHECK(count.columnInt64(1) == 0);
+
+        auto index = Index::load(log, File(fopen(rewritten.c_str(), "rb")),
+                                 indexFile, false);
+        for (auto line : {65536u, 1u, 2u, 4000u, 4001u, 30000u, 29999u}) {
+            CaptureSink sink;
+            REQUIRE(index.getLine(line, sink));
+            REQUIRE(sink.captured.size() == 1);
+            ostringstream expected;
+            expected << "Line " << line << " - Hex " << hex << line
+                     << " - Mod " << dec << (line & 0xff);
+            CHECK(sink.captured[0] == expected.str());
+        }
+    }
+}
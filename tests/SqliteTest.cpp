@@ -2,6 +2,7 @@
 
 #include "catch.hpp"
 
+#include <cstring>
 #include <string>
 #include <vector>
 #include "SqliteError.h"
@@ -113,6 +114,9 @@ TEST_CASE("handles binds and blobs", "[Sqlite]") {
     auto blob2 = select.columnBlob(1);
     REQUIRE(blob2.size() == byteLen);
     for (int i = 0; i < byteLen; ++i) REQUIRE(blob2[i] == (0xff ^ (i & 0xff)));
+    auto view = select.columnBlobView(1);
+    REQUIRE(view.length() == byteLen);
+    CHECK(std::memcmp(view.begin(), bytes, byteLen) == 0);
     CHECK(select.step() == true);
 }
 
@@ -0,0 +1,68 @@
+#include "StatementCache.h"
+
+#include "catch.hpp"
+
+#include <string>
+#include "TempDir.h"
+#include "CaptureLog.h"
+
+TEST_CASE("caches statements", "[StatementCache]") {
+    TempDir tempDir;
+    CaptureLog log;
+    Sqlite sqlite(log);
+    sqlite.open(tempDir.path + "/db.sqlite", false);
+    sqlite.exec("CREATE TABLE t(key INTEGER)");
+    sqlite.exec("INSERT INTO t VALUES(1)");
+    sqlite.exec("INSERT INTO t VALUES(2)");
+    StatementCache cache(sqlite, 2);
+    const std::string count = "SELECT COUNT(*) FROM t WHERE key >= :key";
+    auto countFrom = [&](int64_t key) {
+        auto stmt = cache.get(count);
+        stmt->bindInt64(":key", key);
+        REQUIRE(!stmt->step());
+        return stmt->columnInt64(0);
+    };
+
+    SECTION("reuses statements") {
+        CHECK(countFrom(1) == 2);
+        CHECK(countFrom(2) == 1);
+        CHECK(countFrom(3) == 0);
+        CHECK(cache.prepared() == 1);
+        CHECK(cache.size() == 1);
+    }
+
+    SECTION("prepares a new statement for nested use") {
+        auto outer = cache.get(count);
+        CHECK(cache.size() == 0);
+        CHECK(countFrom(2) == 1);
+        CHECK(cache.prepared() == 2);
+        CHECK(cache.size() == 1);
+    }
+
+    SECTION("evicts the least recently used") {
+        countFrom(1);
+        cache.get("SELECT 1");
+        cache.get("SELECT 2");
+        CHECK(cache.size() == 2);
+        countFrom(1);
+        CHECK(cache.prepared() == 4);
+        cache.get("SELECT 2");
+        CHECK(cache.prepared() == 4);
+    }
+
+    SECTION("resets statements when they're returned") {
+        {
+            auto stmt = cache.get("SELECT key FROM t ORDER BY key");
+            REQUIRE(!stmt->step());
+            CHECK(stmt->columnInt64(0) == 1);
+        }
+        auto stmt = cache.get("SELECT key FROM t ORDER BY key");
+        REQUIRE(!stmt->step());
+        CHECK(stmt->columnInt64(0) == 1);
+    }
+
+    SECTION("throws on bad SQL") {
+        CHECK_THROWS(cache.get("SELECT * FROM nonexistent"));
+        CHECK(cache.size() == 0);
+    }
+}
@@ -0,0 +1,94 @@
+#include "Trigrams.h"
+
+#include "catch.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+// The distinct trigrams of some pieces of literal text, in order.
+vector<Trigram> trigramsOf(const vector<string> &texts) {
+    vector<Trigram> result;
+    for (auto &text : texts)
+        for (size_t i = 0; i + 3 <= text.size(); ++i)
+            result.push_back(makeTrigram(text.data() + i));
+    sort(result.begin(), result.end());
+    result.erase(unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+vector<vector<Trigram>> required(const string &regex) {
+    vector<vector<Trigram>> alternatives;
+    if (!requiredTrigrams(regex, alternatives)) CHECK(alternatives.empty());
+    return alternatives;
+}
+
+}
+
+TEST_CASE("finds the trigrams a regex needs", "[Trigrams]") {
+    using Alternatives = vector<vector<Trigram>>;
+    CHECK(makeTrigram("abc") == 0x616263u);
+    CHECK(required("hello") == Alternatives{trigramsOf({"hello"})});
+    SECTION("runs of literal text") {
+        CHECK(required("^GET /index [0-9]+ ms$")
+              == Alternatives{trigramsOf({"GET /index ", " ms"})});
+        CHECK(required("error.*disk full")
+              == Alternatives{trigramsOf({"error", "disk full"})});
+        CHECK(required("a\\.b\\.c") == Alternatives{trigramsOf({"a.b.c"})});
+        CHECK(required("\\w+ing") == Alternatives{trigramsOf({"ing"})});
+        CHECK(required("[[:alpha:]]] x]yz")
+              == Alternatives{trigramsOf({"] x]yz"})});
+    }
+    SECTION("optional and repeated characters") {
+        CHECK(required("colou?red")
+              == Alternatives{trigramsOf({"colo", "red"})});
+        CHECK(required("abcd*e") == Alternatives{trigramsOf({"abc"})});
+        CHECK(required("abc+de") == Alternatives{trigramsOf({"abc", "cde"})});
+        CHECK(required("abc{2,3}de")
+              == Alternatives{trigramsOf({"abc", "cde"})});
+        CHECK(required("abcd{0,1}efg")
+              == Alternatives{trigramsOf({"abc", "efg"})});
+    }
+    SECTION("alternatives and groups") {
+        CHECK(required("foobar|bazqux")
+              == (Alternatives{trigramsOf({"foobar"}),
+                               trigramsOf({"bazqux"})}));
+        CHECK(required("id=(12345) done")
+              == Alternatives{trigramsOf({"id=", "12345", " done"})});
+        CHECK(required("id=(12345)? done")
+              == Alternatives{trigramsOf({"id=", " done"})});
+        CHECK(required("user (alice|bob) login")
+              == Alternatives{trigramsOf({"user ", " login"})});
+    }
+    SECTION("regexes which could match anything") {
+        CHECK(required("ab").empty());
+        CHECK(required("a.c").empty());
+        CHECK(required("\\w+in\\b").empty());
+        CHECK(required("foobar|x").empty());
+        CHECK(required("abc)").empty());
+    }
+}
+
+TEST_CASE("collects the blocks trigrams are in", "[Trigrams]") {
+    TrigramBlocks blocks(2);
+    string lines[] = {"abcd", "abc", "xyz", "", "bcd abc"};
+    for (size_t i = 0; i < 5; ++i)
+        blocks.add(i + 1, lines[i].data(), lines[i].size());
+    blocks.finish();
+    CHECK(blocks.blockLines() == 2);
+    auto blocksOf = [&](const string &trigram) {
+        PostingList result;
+        auto it = blocks.blocks().find(makeTrigram(trigram.data()));
+        if (it != blocks.blocks().end())
+            PostingDecoder(it->second.bytes()).decodeInto(result);
+        return result;
+    };
+    CHECK(blocksOf("abc") == PostingList({0, 2}));
+    CHECK(blocksOf("bcd") == PostingList({0, 2}));
+    CHECK(blocksOf("xyz") == PostingList({1}));
+    CHECK(blocksOf("cd ") == PostingList({2}));
+    CHECK(blocksOf("zzz").empty());
+    CHECK(blocks.blocks().size() == 6);
+}